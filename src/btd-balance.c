@@ -0,0 +1,330 @@
+/*
+ * Copyright (C) Matthias Klumpp <matthias@tenstral.net>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+/**
+ * SECTION:btd-balance
+ * @short_description: Native balance engine.
+ *
+ * Runs balance operations on a Btrfs filesystem directly via the kernel's
+ * balance ioctls, so we can observe, pause and resume them.
+ */
+
+#include "config.h"
+#include "btd-balance.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/btrfs.h>
+
+#include "btd-utils.h"
+#include "btd-logging.h"
+
+/* interval in seconds at which we query the kernel for balance progress */
+#define BTD_BALANCE_POLL_INTERVAL 10
+
+/* period in seconds over which a throttled balance alternates between running and pausing */
+#define BTD_BALANCE_DUTY_PERIOD (5 * 60)
+
+/* maximum time in seconds to wait for high I/O pressure to subside before giving up */
+#define BTD_BALANCE_MAX_PRESSURE_WAIT (60 * 60)
+
+typedef struct {
+    GMutex lock;
+    GCond cond;
+    gint fd;
+    gboolean finished;
+
+    struct btrfs_ioctl_balance_args args;
+    gint ret;
+    gint error_code;
+} BtdBalanceContext;
+
+/**
+ * btd_balance_params_init:
+ * @params: The #BtdBalanceParams to initialize.
+ *
+ * Set balance parameters to our defaults, which only compact
+ * mostly empty chunks.
+ */
+void
+btd_balance_params_init (BtdBalanceParams *params)
+{
+    memset (params, 0, sizeof (*params));
+    params->data_usage = 15;
+    params->metadata_usage = 10;
+}
+
+static void
+btd_balance_args_set_filters (struct btrfs_balance_args *bargs,
+                              BtdBalanceParams *params,
+                              gint usage)
+{
+    bargs->flags |= BTRFS_BALANCE_ARGS_USAGE;
+    bargs->usage = (guint64) usage;
+
+    if (params->limit > 0) {
+        bargs->flags |= BTRFS_BALANCE_ARGS_LIMIT;
+        bargs->limit = params->limit;
+    }
+
+    if (params->vrange_end > params->vrange_start) {
+        bargs->flags |= BTRFS_BALANCE_ARGS_VRANGE;
+        bargs->vstart = params->vrange_start;
+        bargs->vend = params->vrange_end;
+    }
+}
+
+static gboolean
+btd_balance_sleep (gint64 timeout, GCancellable *cancellable)
+{
+    GPollFD pfd = { 0 };
+
+    if (!g_cancellable_make_pollfd (cancellable, &pfd)) {
+        g_usleep (timeout);
+        return TRUE;
+    }
+    g_poll (&pfd, 1, (gint) (timeout / 1000));
+    g_cancellable_release_fd (cancellable);
+
+    return !g_cancellable_is_cancelled (cancellable);
+}
+
+static gpointer
+btd_balance_thread (gpointer data)
+{
+    BtdBalanceContext *ctx = data;
+    gint ret;
+    gint errsv;
+
+    ret = ioctl (ctx->fd, BTRFS_IOC_BALANCE_V2, &ctx->args);
+    errsv = errno;
+
+    g_mutex_lock (&ctx->lock);
+    ctx->ret = ret;
+    ctx->error_code = ret < 0 ? errsv : 0;
+    ctx->finished = TRUE;
+    g_cond_signal (&ctx->cond);
+    g_mutex_unlock (&ctx->lock);
+
+    return NULL;
+}
+
+/**
+ * btd_balance_run:
+ * @bfs: The #BtdFilesystem to balance.
+ * @params: The #BtdBalanceParams to use.
+ * @paused: (out) (optional): Set to %TRUE if the balance was paused and may be resumed later.
+ * @error: A #GError, set if the balance failed.
+ *
+ * Run a balance operation with the selected filters, and pause it
+ * once its maximum runtime has been exceeded.
+ *
+ * If a duty cycle is set, the balance is paused for the remainder of
+ * every period once it has run for its share of it, and resumed
+ * afterwards, to leave the disks idle for other users part of the time.
+ * Likewise, if the I/O pressure monitor of @params fires, the balance is
+ * paused until the pressure has subsided.
+ * If the cancellable of @params is triggered, the balance is paused, so
+ * it can be resumed later.
+ *
+ * Returns: %TRUE if the balance operation completed or was paused, %FALSE on error.
+ */
+gboolean
+btd_balance_run (BtdFilesystem *bfs, BtdBalanceParams *params, gboolean *paused, GError **error)
+{
+    const gchar *mountpoint = btd_filesystem_get_mountpoint (bfs);
+    BtdBalanceContext ctx = { 0 };
+    GThread *thread;
+    gint64 time_start;
+    gint64 run_time = 0;
+    gboolean pause_requested = FALSE;
+    gboolean throttled;
+    gboolean under_pressure;
+
+    if (paused != NULL)
+        *paused = FALSE;
+
+    if (params->resume) {
+        ctx.args.flags = BTRFS_BALANCE_RESUME;
+    } else {
+        if (params->data_usage >= 0) {
+            ctx.args.flags |= BTRFS_BALANCE_DATA;
+            btd_balance_args_set_filters (&ctx.args.data, params, params->data_usage);
+        }
+        if (params->metadata_usage >= 0) {
+            /* system chunks are treated like metadata chunks, like the btrfs tool does it */
+            ctx.args.flags |= BTRFS_BALANCE_METADATA | BTRFS_BALANCE_SYSTEM;
+            btd_balance_args_set_filters (&ctx.args.meta, params, params->metadata_usage);
+            memcpy (&ctx.args.sys, &ctx.args.meta, sizeof (struct btrfs_balance_args));
+        }
+
+        if ((ctx.args.flags & BTRFS_BALANCE_TYPE_MASK) == 0) {
+            btd_debug ("Nothing to balance on %s, all chunk types were excluded.", mountpoint);
+            return TRUE;
+        }
+    }
+
+    ctx.fd = btd_filesystem_open (bfs, error);
+    if (ctx.fd < 0)
+        return FALSE;
+    g_mutex_init (&ctx.lock);
+    g_cond_init (&ctx.cond);
+
+    btd_info ("%s btrfs balance on %s", params->resume ? "Resuming" : "Running", mountpoint);
+    time_start = g_get_monotonic_time ();
+    if (params->duty_cycle > 0 && params->duty_cycle < 100)
+        run_time = BTD_BALANCE_DUTY_PERIOD * params->duty_cycle / 100 * G_TIME_SPAN_SECOND;
+
+    while (TRUE) {
+        gint64 slice_start = g_get_monotonic_time ();
+
+        throttled = FALSE;
+        under_pressure = FALSE;
+        ctx.finished = FALSE;
+        g_mutex_lock (&ctx.lock);
+        thread = g_thread_new ("btd-balance", btd_balance_thread, &ctx);
+        while (!ctx.finished) {
+            struct btrfs_ioctl_balance_args progress = { 0 };
+            gint64 deadline = g_get_monotonic_time () +
+                              BTD_BALANCE_POLL_INTERVAL * G_TIME_SPAN_SECOND;
+            gint64 now;
+
+            if (g_cond_wait_until (&ctx.cond, &ctx.lock, deadline))
+                continue;
+
+            if (ioctl (ctx.fd, BTRFS_IOC_BALANCE_PROGRESS, &progress) == 0)
+                btd_debug ("Balance of %s: %" G_GUINT64_FORMAT " of %" G_GUINT64_FORMAT
+                           " chunks relocated",
+                           mountpoint,
+                           (guint64) progress.stat.completed,
+                           (guint64) progress.stat.expected);
+
+            now = g_get_monotonic_time ();
+            if (pause_requested || throttled)
+                continue;
+            if (g_cancellable_is_cancelled (params->cancellable)) {
+                btd_info ("Pausing balance on %s, it was cancelled.", mountpoint);
+                if (ioctl (ctx.fd, BTRFS_IOC_BALANCE_CTL, BTRFS_BALANCE_CTL_PAUSE) < 0)
+                    btd_warning ("Failed to pause balance on %s: %s",
+                                 mountpoint,
+                                 g_strerror (errno));
+                else
+                    pause_requested = TRUE;
+            } else if (params->max_runtime > 0 &&
+                       now - time_start > params->max_runtime * G_TIME_SPAN_SECOND) {
+                btd_info ("Balance on %s exceeded its maximum runtime, pausing it.", mountpoint);
+                if (ioctl (ctx.fd, BTRFS_IOC_BALANCE_CTL, BTRFS_BALANCE_CTL_PAUSE) < 0)
+                    btd_warning ("Failed to pause balance on %s: %s",
+                                 mountpoint,
+                                 g_strerror (errno));
+                else
+                    pause_requested = TRUE;
+            } else if (run_time > 0 && now - slice_start > run_time) {
+                /* a failure to pause is not fatal, we just don't throttle then */
+                throttled = ioctl (ctx.fd, BTRFS_IOC_BALANCE_CTL, BTRFS_BALANCE_CTL_PAUSE) == 0;
+            } else if (params->pressure != NULL && btd_pressure_monitor_check (params->pressure)) {
+                throttled = ioctl (ctx.fd, BTRFS_IOC_BALANCE_CTL, BTRFS_BALANCE_CTL_PAUSE) == 0;
+                under_pressure = throttled;
+            }
+        }
+        g_mutex_unlock (&ctx.lock);
+        g_thread_join (thread);
+
+        if (!throttled || ctx.ret != -1 || ctx.error_code != ECANCELED)
+            break;
+        if (g_cancellable_is_cancelled (params->cancellable)) {
+            pause_requested = TRUE;
+            break;
+        }
+
+        if (under_pressure) {
+            gint64 max_wait = BTD_BALANCE_MAX_PRESSURE_WAIT;
+
+            if (params->max_runtime > 0)
+                max_wait = MIN (max_wait,
+                                params->max_runtime -
+                                    (g_get_monotonic_time () - time_start) / G_USEC_PER_SEC);
+            btd_info ("Paused balance on %s, I/O pressure is at %.1f%%.",
+                      mountpoint,
+                      btd_pressure_get_io_level ());
+            if (max_wait <= 0 ||
+                !btd_pressure_monitor_wait_calm (params->pressure,
+                                                 max_wait,
+                                                 params->cancellable)) {
+                pause_requested = TRUE;
+                break;
+            }
+            btd_info ("Resuming balance on %s", mountpoint);
+        } else {
+            btd_debug ("Throttling balance on %s", mountpoint);
+            if (!btd_balance_sleep (BTD_BALANCE_DUTY_PERIOD * G_TIME_SPAN_SECOND - run_time,
+                                    params->cancellable)) {
+                pause_requested = TRUE;
+                break;
+            }
+        }
+
+        /* don't resume if the balance is due to be paused anyway */
+        if (params->max_runtime > 0 &&
+            g_get_monotonic_time () - time_start > params->max_runtime * G_TIME_SPAN_SECOND) {
+            pause_requested = TRUE;
+            break;
+        }
+
+        memset (&ctx.args, 0, sizeof (ctx.args));
+        ctx.args.flags = BTRFS_BALANCE_RESUME;
+    }
+
+    close (ctx.fd);
+    g_cond_clear (&ctx.cond);
+    g_mutex_clear (&ctx.lock);
+
+    if (ctx.ret > 0) {
+        g_set_error (error,
+                     BTD_BTRFS_ERROR,
+                     BTD_BTRFS_ERROR_BALANCE_FAILED,
+                     "Balance action failed: %s",
+                     ctx.ret == BTRFS_ERROR_DEV_EXCL_RUN_IN_PROGRESS
+                         ? "Another exclusive operation is in progress"
+                         : "Device error");
+        return FALSE;
+    }
+
+    if (ctx.ret < 0) {
+        /* the kernel returns ECANCELED if the balance was paused */
+        if (ctx.error_code == ECANCELED && pause_requested) {
+            if (paused != NULL)
+                *paused = TRUE;
+            btd_info ("Paused balance on %s after relocating %" G_GUINT64_FORMAT " chunks",
+                      mountpoint,
+                      (guint64) ctx.args.stat.completed);
+            return TRUE;
+        }
+
+        /* nothing was paused anymore (e.g. the kernel resumed it on mount), start a new balance */
+        if (ctx.error_code == ENOTCONN && params->resume) {
+            BtdBalanceParams new_params = *params;
+
+            btd_debug ("No paused balance found on %s, starting a new one.", mountpoint);
+            new_params.resume = FALSE;
+            return btd_balance_run (bfs, &new_params, paused, error);
+        }
+
+        g_set_error (error,
+                     BTD_BTRFS_ERROR,
+                     BTD_BTRFS_ERROR_BALANCE_FAILED,
+                     "Balance action failed: %s",
+                     g_strerror (ctx.error_code));
+        return FALSE;
+    }
+
+    btd_info ("Balance on %s completed, %" G_GUINT64_FORMAT " chunks relocated",
+              mountpoint,
+              (guint64) ctx.args.stat.completed);
+    return TRUE;
+}
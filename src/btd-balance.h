@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) Matthias Klumpp <matthias@tenstral.net>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#pragma once
+
+#include <glib-object.h>
+
+#include "btd-filesystem.h"
+
+G_BEGIN_DECLS
+
+/**
+ * BtdBalanceParams:
+ * @data_usage:     Only relocate data chunks used less than this percentage, or -1 to skip data
+ * @metadata_usage: Only relocate metadata chunks used less than this percentage, or -1 to skip metadata
+ * @limit:          Maximum number of chunks to relocate per chunk type, 0 for no limit
+ * @vrange_start:   Start of the logical address range to balance
+ * @vrange_end:     End of the logical address range to balance, 0 to not filter by range
+ * @max_runtime:    Time in seconds after which the balance is paused, 0 to never pause
+ * @duty_cycle:     Percentage of the time the balance may run, 0 to run it continuously
+ * @pressure:       Monitor for the I/O pressure at which the balance is paused, or %NULL
+ * @cancellable:    Cancellable to pause the balance early, e.g. on shutdown, or %NULL
+ * @resume:         %TRUE to resume a previously paused balance operation
+ *
+ * Parameters for a balance operation.
+ **/
+struct _BtdBalanceParams {
+    gint                data_usage;
+    gint                metadata_usage;
+    guint64             limit;
+    guint64             vrange_start;
+    guint64             vrange_end;
+    gint64              max_runtime;
+    guint               duty_cycle;
+    BtdPressureMonitor *pressure;
+    GCancellable       *cancellable;
+    gboolean            resume;
+};
+
+void     btd_balance_params_init (BtdBalanceParams *params);
+
+gboolean btd_balance_run (BtdFilesystem    *bfs,
+                          BtdBalanceParams *params,
+                          gboolean         *paused,
+                          GError          **error);
+
+G_END_DECLS
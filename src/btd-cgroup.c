@@ -0,0 +1,158 @@
+/*
+ * Copyright (C) Matthias Klumpp <matthias@tenstral.net>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+/**
+ * SECTION:btd-cgroup
+ * @short_description: Resource control for maintenance actions.
+ *
+ * Translates resource limits for heavy maintenance actions into properties
+ * of the transient systemd units they run in, and reads back the I/O the
+ * actions caused from their cgroup v2 accounting data.
+ */
+
+#include "config.h"
+#include "btd-cgroup.h"
+
+#include <string.h>
+
+#include "btd-utils.h"
+#include "btd-logging.h"
+
+/**
+ * btd_cgroup_limits_to_unit_args:
+ * @limits: The #BtdCgroupLimits to apply.
+ * @devices: (element-type utf8): Paths of the block devices the bandwidth limits apply to.
+ *
+ * Create the systemd-run arguments which set up the cgroup of a transient
+ * unit with the given limits. I/O accounting is always enabled, so the
+ * I/O of the unit can be read back afterwards.
+ *
+ * Returns: (transfer full) (element-type utf8): Arguments for systemd-run.
+ */
+GPtrArray *
+btd_cgroup_limits_to_unit_args (const BtdCgroupLimits *limits, GPtrArray *devices)
+{
+    GPtrArray *args = g_ptr_array_new_with_free_func (g_free);
+
+    g_ptr_array_add (args, g_strdup ("--property=IOAccounting=yes"));
+    if (limits->io_weight > 0)
+        g_ptr_array_add (args,
+                         g_strdup_printf ("--property=IOWeight=%u",
+                                          CLAMP (limits->io_weight, 1, 10000)));
+    if (limits->cpu_weight > 0)
+        g_ptr_array_add (args,
+                         g_strdup_printf ("--property=CPUWeight=%u",
+                                          CLAMP (limits->cpu_weight, 1, 10000)));
+    if (limits->memory_high > 0)
+        g_ptr_array_add (args,
+                         g_strdup_printf ("--property=MemoryHigh=%" G_GUINT64_FORMAT,
+                                          limits->memory_high));
+
+    /* systemd resolves partitions to the disk they are on, which is where io.max applies */
+    for (guint i = 0; devices != NULL && i < devices->len; i++) {
+        const gchar *device = g_ptr_array_index (devices, i);
+        if (limits->io_read_max > 0)
+            g_ptr_array_add (args,
+                             g_strdup_printf ("--property=IOReadBandwidthMax=%s "
+                                              "%" G_GUINT64_FORMAT,
+                                              device,
+                                              limits->io_read_max));
+        if (limits->io_write_max > 0)
+            g_ptr_array_add (args,
+                             g_strdup_printf ("--property=IOWriteBandwidthMax=%s "
+                                              "%" G_GUINT64_FORMAT,
+                                              device,
+                                              limits->io_write_max));
+    }
+
+    return args;
+}
+
+/**
+ * btd_cgroup_parse_io_stat:
+ * @data: Contents of a cgroup io.stat file.
+ * @read_bytes: (out): Bytes read, summed up over all devices.
+ * @write_bytes: (out): Bytes written, summed up over all devices.
+ *
+ * Parse the I/O accounting data of a cgroup, which has one line
+ * per device like "8:0 rbytes=1024 wbytes=0 rios=1 wios=0 ...".
+ *
+ * Returns: %TRUE if the data could be parsed.
+ */
+gboolean
+btd_cgroup_parse_io_stat (const gchar *data, guint64 *read_bytes, guint64 *write_bytes)
+{
+    g_auto(GStrv) lines = NULL;
+
+    *read_bytes = 0;
+    *write_bytes = 0;
+    if (data == NULL)
+        return FALSE;
+
+    lines = g_strsplit (data, "\n", -1);
+    for (guint i = 0; lines[i] != NULL; i++) {
+        g_auto(GStrv) fields = NULL;
+
+        if (btd_is_empty (lines[i]))
+            continue;
+        fields = g_strsplit (lines[i], " ", -1);
+
+        /* the first field is the device number, the others are key=value pairs */
+        for (guint j = 1; fields[j] != NULL; j++) {
+            if (g_str_has_prefix (fields[j], "rbytes="))
+                *read_bytes += g_ascii_strtoull (fields[j] + strlen ("rbytes="), NULL, 10);
+            else if (g_str_has_prefix (fields[j], "wbytes="))
+                *write_bytes += g_ascii_strtoull (fields[j] + strlen ("wbytes="), NULL, 10);
+        }
+    }
+
+    return TRUE;
+}
+
+/**
+ * btd_cgroup_read_own_io_stat:
+ * @read_bytes: (out): Bytes read by the cgroup of this process.
+ * @write_bytes: (out): Bytes written by the cgroup of this process.
+ *
+ * Read the I/O accounting data of the cgroup this process runs in.
+ * This is only meaningful if the process has a cgroup of its own,
+ * as is the case for transient units.
+ *
+ * Returns: %TRUE if the data could be read.
+ */
+gboolean
+btd_cgroup_read_own_io_stat (guint64 *read_bytes, guint64 *write_bytes)
+{
+    g_autofree gchar *cgroups = NULL;
+    g_autofree gchar *io_stat = NULL;
+    g_autofree gchar *io_stat_fname = NULL;
+    g_auto(GStrv) lines = NULL;
+
+    *read_bytes = 0;
+    *write_bytes = 0;
+    if (!g_file_get_contents ("/proc/self/cgroup", &cgroups, NULL, NULL))
+        return FALSE;
+
+    /* on the cgroup v2 unified hierarchy, our entry is "0::/path" */
+    lines = g_strsplit (cgroups, "\n", -1);
+    for (guint i = 0; lines[i] != NULL; i++) {
+        if (!g_str_has_prefix (lines[i], "0::/"))
+            continue;
+        io_stat_fname = g_build_filename ("/sys/fs/cgroup", lines[i] + 3, "io.stat", NULL);
+        break;
+    }
+    if (io_stat_fname == NULL) {
+        btd_debug ("Unable to find the cgroup v2 of this process.");
+        return FALSE;
+    }
+
+    if (!g_file_get_contents (io_stat_fname, &io_stat, NULL, NULL)) {
+        btd_debug ("Unable to read I/O statistics from %s", io_stat_fname);
+        return FALSE;
+    }
+
+    return btd_cgroup_parse_io_stat (io_stat, read_bytes, write_bytes);
+}
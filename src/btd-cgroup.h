@@ -0,0 +1,38 @@
+/*
+ * Copyright (C) Matthias Klumpp <matthias@tenstral.net>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#pragma once
+
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+/**
+ * BtdCgroupLimits:
+ * @io_weight:    Relative I/O weight (1-10000), or 0 to keep the default
+ * @cpu_weight:   Relative CPU weight (1-10000), or 0 to keep the default
+ * @memory_high:  Memory usage above which the cgroup is throttled, in bytes, or 0 for no limit
+ * @io_read_max:  Read bandwidth limit per device in bytes per second, or 0 for no limit
+ * @io_write_max: Write bandwidth limit per device in bytes per second, or 0 for no limit
+ *
+ * Resource limits for the cgroup an action is run in.
+ **/
+typedef struct {
+    guint   io_weight;
+    guint   cpu_weight;
+    guint64 memory_high;
+    guint64 io_read_max;
+    guint64 io_write_max;
+} BtdCgroupLimits;
+
+GPtrArray *btd_cgroup_limits_to_unit_args (const BtdCgroupLimits *limits, GPtrArray *devices);
+
+gboolean   btd_cgroup_parse_io_stat (const gchar *data,
+                                     guint64     *read_bytes,
+                                     guint64     *write_bytes);
+gboolean   btd_cgroup_read_own_io_stat (guint64 *read_bytes, guint64 *write_bytes);
+
+G_END_DECLS
@@ -0,0 +1,547 @@
+/*
+ * Copyright (C) Matthias Klumpp <matthias@tenstral.net>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+/**
+ * SECTION:btd-daemon
+ * @short_description: Persistent daemon mode.
+ *
+ * Keeps the scheduler with its configuration, filesystem list and state in
+ * memory, and sleeps until the next maintenance action is due.
+ * Changes to the mount table are picked up as they happen, and Btrfs issues
+ * reported in the kernel log trigger an immediate error check.
+ */
+
+#include "config.h"
+#include "btd-daemon.h"
+
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/timerfd.h>
+#include <gio/gio.h>
+#include <glib-unix.h>
+#include <libmount/libmount.h>
+#ifdef HAVE_SYSTEMD
+#include <systemd/sd-daemon.h>
+#endif
+
+#include "btd-utils.h"
+#include "btd-logging.h"
+#include "btd-filesystem.h"
+#include "btd-kmsg.h"
+
+/* time in seconds to collect kernel log messages before analyzing the affected filesystems */
+#define BTD_KMSG_COALESCE_DELAY 5
+
+/* minimum time in seconds between two checks of the same filesystem triggered by the kernel log */
+#define BTD_KMSG_HOLDOFF_TIME (15 * 60)
+
+typedef struct {
+    BtdScheduler *scheduler;
+    GMainLoop *loop;
+    GDBusConnection *system_bus;
+
+    gint timer_fd;
+    guint timer_source_id;
+
+    struct libmnt_monitor *mount_monitor;
+    guint mount_source_id;
+
+    gint kmsg_fd;
+    guint kmsg_source_id;
+    guint kmsg_flush_id;
+    GHashTable *kmsg_pending_devices;
+    GHashTable *kmsg_last_checks;
+
+    gboolean reload_pending;
+    gboolean mounts_changed;
+    gboolean quit_requested;
+} BtdDaemonPrivate;
+
+G_DEFINE_TYPE_WITH_PRIVATE (BtdDaemon, btd_daemon, G_TYPE_OBJECT)
+#define GET_PRIVATE(o) (btd_daemon_get_instance_private (o))
+
+static void
+btd_daemon_init (BtdDaemon *self)
+{
+    BtdDaemonPrivate *priv = GET_PRIVATE (self);
+
+    priv->loop = g_main_loop_new (NULL, FALSE);
+    priv->timer_fd = -1;
+    priv->kmsg_fd = -1;
+    priv->kmsg_pending_devices = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    priv->kmsg_last_checks = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+}
+
+static void
+btd_daemon_stop_kmsg_watch (BtdDaemon *self)
+{
+    BtdDaemonPrivate *priv = GET_PRIVATE (self);
+
+    if (priv->kmsg_flush_id != 0)
+        g_source_remove (priv->kmsg_flush_id);
+    priv->kmsg_flush_id = 0;
+    if (priv->kmsg_source_id != 0)
+        g_source_remove (priv->kmsg_source_id);
+    priv->kmsg_source_id = 0;
+    if (priv->kmsg_fd >= 0)
+        close (priv->kmsg_fd);
+    priv->kmsg_fd = -1;
+    g_hash_table_remove_all (priv->kmsg_pending_devices);
+}
+
+static void
+btd_daemon_finalize (GObject *object)
+{
+    BtdDaemon *self = BTD_DAEMON (object);
+    BtdDaemonPrivate *priv = GET_PRIVATE (self);
+
+    if (priv->timer_source_id != 0)
+        g_source_remove (priv->timer_source_id);
+    if (priv->timer_fd >= 0)
+        close (priv->timer_fd);
+    if (priv->mount_source_id != 0)
+        g_source_remove (priv->mount_source_id);
+    if (priv->mount_monitor != NULL)
+        mnt_unref_monitor (priv->mount_monitor);
+    btd_daemon_stop_kmsg_watch (self);
+    g_hash_table_unref (priv->kmsg_pending_devices);
+    g_hash_table_unref (priv->kmsg_last_checks);
+    if (priv->system_bus != NULL)
+        g_object_unref (priv->system_bus);
+    g_main_loop_unref (priv->loop);
+    g_object_unref (priv->scheduler);
+
+    G_OBJECT_CLASS (btd_daemon_parent_class)->finalize (object);
+}
+
+static void
+btd_daemon_class_init (BtdDaemonClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS (klass);
+    object_class->finalize = btd_daemon_finalize;
+}
+
+/**
+ * btd_daemon_new:
+ * @scheduler: A loaded #BtdScheduler to run actions with.
+ *
+ * Creates a new #BtdDaemon.
+ *
+ * Returns: (transfer full): a #BtdDaemon
+ */
+BtdDaemon *
+btd_daemon_new (BtdScheduler *scheduler)
+{
+    BtdDaemon *self;
+    BtdDaemonPrivate *priv;
+
+    self = g_object_new (BTD_TYPE_DAEMON, NULL);
+    priv = GET_PRIVATE (self);
+    priv->scheduler = g_object_ref (scheduler);
+    btd_scheduler_set_persistent (priv->scheduler, TRUE);
+
+    return BTD_DAEMON (self);
+}
+
+static gboolean
+btd_daemon_arm_timer (BtdDaemon *self, GError **error)
+{
+    BtdDaemonPrivate *priv = GET_PRIVATE (self);
+    struct itimerspec spec = { 0 };
+    time_t next_time;
+
+    next_time = btd_scheduler_get_next_run_time (priv->scheduler);
+    if (next_time == 0) {
+        btd_debug ("No maintenance actions scheduled, waiting for configuration changes.");
+    } else {
+        g_autofree gchar *wait_str = btd_humanize_time (MAX (next_time - time (NULL), 1));
+        btd_debug ("Next maintenance action is due in %s", wait_str);
+
+        /* a zero value would disarm the timer, so fire right away for overdue actions */
+        spec.it_value.tv_sec = MAX (next_time, time (NULL) + 1);
+    }
+
+    /* get notified about wall clock changes too, as our schedule is based on it */
+    if (timerfd_settime (priv->timer_fd,
+                         TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET,
+                         &spec,
+                         NULL) < 0) {
+        g_set_error (error,
+                     BTD_BTRFS_ERROR,
+                     BTD_BTRFS_ERROR_FAILED,
+                     "Unable to arm timer: %s",
+                     g_strerror (errno));
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static void btd_daemon_update_kmsg_watch (BtdDaemon *self);
+
+static void
+btd_daemon_apply_pending_changes (BtdDaemon *self)
+{
+    BtdDaemonPrivate *priv = GET_PRIVATE (self);
+    g_autoptr(GError) error = NULL;
+
+    if (priv->reload_pending) {
+        priv->reload_pending = FALSE;
+        btd_info ("Reloading configuration");
+        if (!btd_scheduler_reload (priv->scheduler, &error)) {
+            btd_warning ("Failed to reload configuration: %s", error->message);
+            g_clear_error (&error);
+        }
+        btd_daemon_update_kmsg_watch (self);
+
+        /* reloading refreshes the mount list as well */
+        priv->mounts_changed = FALSE;
+    }
+
+    if (priv->mounts_changed) {
+        priv->mounts_changed = FALSE;
+        if (!btd_scheduler_refresh_mounts (priv->scheduler, &error))
+            btd_warning ("Failed to update list of mounted filesystems: %s", error->message);
+    }
+}
+
+static void
+btd_daemon_quit (BtdDaemon *self)
+{
+    BtdDaemonPrivate *priv = GET_PRIVATE (self);
+
+    /* the main loop may not be running yet if we are asked to quit during the first run */
+    priv->quit_requested = TRUE;
+    g_main_loop_quit (priv->loop);
+}
+
+static void
+btd_daemon_reschedule (BtdDaemon *self)
+{
+    g_autoptr(GError) error = NULL;
+
+    if (!btd_daemon_arm_timer (self, &error)) {
+        btd_error ("%s", error->message);
+        btd_daemon_quit (self);
+    }
+}
+
+static void
+btd_daemon_run_scheduled (BtdDaemon *self)
+{
+    BtdDaemonPrivate *priv = GET_PRIVATE (self);
+    g_autoptr(GError) error = NULL;
+
+    if (!btd_scheduler_run (priv->scheduler, &error)) {
+        btd_error ("Failed to run maintenance actions: %s", error->message);
+        g_clear_error (&error);
+    }
+
+    /* apply changes that arrived while actions were running */
+    btd_daemon_apply_pending_changes (self);
+    btd_daemon_reschedule (self);
+}
+
+static gboolean
+btd_daemon_timer_cb (gint fd, GIOCondition condition, gpointer user_data)
+{
+    BtdDaemon *self = BTD_DAEMON (user_data);
+    BtdDaemonPrivate *priv = GET_PRIVATE (self);
+    guint64 expirations;
+
+    /* this fails with ECANCELED if the clock was changed, which is fine for us */
+    if (read (fd, &expirations, sizeof (expirations)) < 0 && errno == ECANCELED)
+        btd_debug ("System clock changed, recalculating schedule.");
+
+    /* we get here from within a running scheduler, the timer is rearmed once it is done */
+    if (btd_scheduler_is_running (priv->scheduler))
+        return G_SOURCE_CONTINUE;
+
+    btd_daemon_run_scheduled (self);
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+btd_daemon_mounts_changed_cb (gint fd, GIOCondition condition, gpointer user_data)
+{
+    BtdDaemon *self = BTD_DAEMON (user_data);
+    BtdDaemonPrivate *priv = GET_PRIVATE (self);
+    gboolean changed = FALSE;
+
+    /* drain all pending events, we only care whether anything changed at all */
+    while (mnt_monitor_next_change (priv->mount_monitor, NULL, NULL) == 0)
+        changed = TRUE;
+    if (!changed)
+        return G_SOURCE_CONTINUE;
+
+    /* the filesystem list must not change while actions are running */
+    priv->mounts_changed = TRUE;
+    if (btd_scheduler_is_running (priv->scheduler))
+        return G_SOURCE_CONTINUE;
+
+    /* new filesystems may need to be checked right away */
+    btd_daemon_apply_pending_changes (self);
+    btd_daemon_reschedule (self);
+
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+btd_daemon_setup_mount_monitor (BtdDaemon *self, GError **error)
+{
+    BtdDaemonPrivate *priv = GET_PRIVATE (self);
+    gint fd;
+
+    priv->mount_monitor = mnt_new_monitor ();
+    if (priv->mount_monitor == NULL || mnt_monitor_enable_kernel (priv->mount_monitor, TRUE) < 0) {
+        g_set_error_literal (error,
+                             BTD_BTRFS_ERROR,
+                             BTD_BTRFS_ERROR_FAILED,
+                             "Unable to monitor mount table");
+        return FALSE;
+    }
+
+    fd = mnt_monitor_get_fd (priv->mount_monitor);
+    if (fd < 0) {
+        g_set_error (error,
+                     BTD_BTRFS_ERROR,
+                     BTD_BTRFS_ERROR_FAILED,
+                     "Unable to monitor mount table: %s",
+                     g_strerror (-fd));
+        return FALSE;
+    }
+    priv->mount_source_id = g_unix_fd_add (fd, G_IO_IN, btd_daemon_mounts_changed_cb, self);
+
+    return TRUE;
+}
+
+static gboolean
+btd_daemon_reload_cb (gpointer user_data)
+{
+    BtdDaemon *self = BTD_DAEMON (user_data);
+    BtdDaemonPrivate *priv = GET_PRIVATE (self);
+
+    /* the configuration must not change while actions are running */
+    priv->reload_pending = TRUE;
+    if (btd_scheduler_is_running (priv->scheduler)) {
+        btd_info ("Configuration will be reloaded once running actions have completed");
+        return G_SOURCE_CONTINUE;
+    }
+
+#ifdef HAVE_SYSTEMD
+    sd_notify (0, "RELOADING=1");
+#endif
+    btd_daemon_apply_pending_changes (self);
+
+    /* intervals may have changed */
+    btd_daemon_reschedule (self);
+#ifdef HAVE_SYSTEMD
+    sd_notify (0, "READY=1");
+#endif
+
+    return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+btd_daemon_kmsg_flush_cb (gpointer user_data)
+{
+    BtdDaemon *self = BTD_DAEMON (user_data);
+    BtdDaemonPrivate *priv = GET_PRIVATE (self);
+    g_autoptr(GPtrArray) to_check = g_ptr_array_new ();
+    gint64 now = g_get_monotonic_time () / G_USEC_PER_SEC;
+    gint64 retry_delay = 0;
+    GHashTableIter iter;
+    gpointer key;
+
+    priv->kmsg_flush_id = 0;
+
+    g_hash_table_iter_init (&iter, priv->kmsg_pending_devices);
+    while (g_hash_table_iter_next (&iter, &key, NULL)) {
+        const gchar *device_name = key;
+        BtdFilesystem *bfs;
+        gint64 *last_check;
+
+        bfs = btd_scheduler_find_filesystem_for_device (priv->scheduler, device_name);
+        if (bfs == NULL) {
+            btd_debug ("Kernel reported Btrfs issues on %s, which is not a monitored filesystem",
+                       device_name);
+            g_hash_table_iter_remove (&iter);
+            continue;
+        }
+
+        /* don't analyze the same filesystem over and over while a disk is dying */
+        last_check = g_hash_table_lookup (priv->kmsg_last_checks,
+                                          btd_filesystem_get_mountpoint (bfs));
+        if (last_check != NULL && now - *last_check < BTD_KMSG_HOLDOFF_TIME) {
+            gint64 delay = BTD_KMSG_HOLDOFF_TIME - (now - *last_check);
+            if (retry_delay == 0 || delay < retry_delay)
+                retry_delay = delay;
+            continue;
+        }
+
+        if (!g_ptr_array_find (to_check, bfs, NULL))
+            g_ptr_array_add (to_check, bfs);
+        g_hash_table_iter_remove (&iter);
+    }
+
+    for (guint i = 0; i < to_check->len; i++) {
+        BtdFilesystem *bfs = g_ptr_array_index (to_check, i);
+        gint64 *check_time = g_new (gint64, 1);
+
+        btd_info ("Kernel reported Btrfs issues on %s, checking for errors",
+                  btd_filesystem_get_mountpoint (bfs));
+        btd_scheduler_check_errors (priv->scheduler, bfs);
+
+        *check_time = now;
+        g_hash_table_insert (priv->kmsg_last_checks,
+                             g_strdup (btd_filesystem_get_mountpoint (bfs)),
+                             check_time);
+    }
+
+    if (g_hash_table_size (priv->kmsg_pending_devices) > 0)
+        priv->kmsg_flush_id = g_timeout_add_seconds (MAX (retry_delay, BTD_KMSG_COALESCE_DELAY),
+                                                     btd_daemon_kmsg_flush_cb,
+                                                     self);
+
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean
+btd_daemon_kmsg_cb (gint fd, GIOCondition condition, gpointer user_data)
+{
+    BtdDaemon *self = BTD_DAEMON (user_data);
+    BtdDaemonPrivate *priv = GET_PRIVATE (self);
+
+    while (TRUE) {
+        g_autofree gchar *record = NULL;
+        g_autofree gchar *device_name = NULL;
+        gboolean again;
+
+        record = btd_kmsg_read_record (fd, &again);
+        if (record == NULL) {
+            if (again)
+                continue;
+            break;
+        }
+
+        if (!btd_kmsg_parse_btrfs_issue (record, &device_name))
+            continue;
+        if (!g_hash_table_contains (priv->kmsg_pending_devices, device_name))
+            g_hash_table_add (priv->kmsg_pending_devices, g_steal_pointer (&device_name));
+    }
+
+    /* coalesce bursts of messages into a single check */
+    if (priv->kmsg_flush_id == 0 && g_hash_table_size (priv->kmsg_pending_devices) > 0)
+        priv->kmsg_flush_id = g_timeout_add_seconds (BTD_KMSG_COALESCE_DELAY,
+                                                     btd_daemon_kmsg_flush_cb,
+                                                     self);
+
+    return G_SOURCE_CONTINUE;
+}
+
+static void
+btd_daemon_update_kmsg_watch (BtdDaemon *self)
+{
+    BtdDaemonPrivate *priv = GET_PRIVATE (self);
+    g_autoptr(GError) error = NULL;
+
+    if (!btd_scheduler_get_watch_kernel_log (priv->scheduler)) {
+        btd_daemon_stop_kmsg_watch (self);
+        return;
+    }
+    if (priv->kmsg_fd >= 0)
+        return;
+
+    priv->kmsg_fd = btd_kmsg_open (&error);
+    if (priv->kmsg_fd < 0) {
+        btd_warning ("%s", error->message);
+        return;
+    }
+    priv->kmsg_source_id = g_unix_fd_add (priv->kmsg_fd, G_IO_IN, btd_daemon_kmsg_cb, self);
+    btd_debug ("Watching kernel log for Btrfs issues");
+}
+
+static gboolean
+btd_daemon_quit_cb (gpointer user_data)
+{
+    BtdDaemon *self = BTD_DAEMON (user_data);
+    BtdDaemonPrivate *priv = GET_PRIVATE (self);
+
+    btd_debug ("Shutting down");
+#ifdef HAVE_SYSTEMD
+    sd_notify (0, "STOPPING=1");
+#endif
+
+    /* running actions are interrupted, and we quit once the scheduler has waited for them */
+    btd_scheduler_stop (priv->scheduler);
+    btd_daemon_quit (self);
+
+    return G_SOURCE_CONTINUE;
+}
+
+/**
+ * btd_daemon_run:
+ * @self: An instance of #BtdDaemon
+ * @error: A #GError
+ *
+ * Run as a persistent daemon, executing maintenance actions whenever they
+ * become due, until we receive SIGTERM or SIGINT.
+ * SIGHUP reloads the configuration.
+ *
+ * Returns: %TRUE on success.
+ */
+gboolean
+btd_daemon_run (BtdDaemon *self, GError **error)
+{
+    BtdDaemonPrivate *priv = GET_PRIVATE (self);
+    guint signal_ids[3];
+
+    if (!btd_user_is_root ()) {
+        g_set_error_literal (error,
+                             BTD_BTRFS_ERROR,
+                             BTD_BTRFS_ERROR_FAILED,
+                             "Need to be root to run this daemon.");
+        return FALSE;
+    }
+
+    /* hold on to the shared system bus connection, so we do not reconnect for every run */
+    priv->system_bus = g_bus_get_sync (G_BUS_TYPE_SYSTEM, NULL, NULL);
+
+    priv->timer_fd = timerfd_create (CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (priv->timer_fd < 0) {
+        g_set_error (error,
+                     BTD_BTRFS_ERROR,
+                     BTD_BTRFS_ERROR_FAILED,
+                     "Unable to create timer: %s",
+                     g_strerror (errno));
+        return FALSE;
+    }
+    priv->timer_source_id = g_unix_fd_add (priv->timer_fd, G_IO_IN, btd_daemon_timer_cb, self);
+
+    if (!btd_daemon_setup_mount_monitor (self, error))
+        return FALSE;
+    btd_daemon_update_kmsg_watch (self);
+
+    signal_ids[0] = g_unix_signal_add (SIGHUP, btd_daemon_reload_cb, self);
+    signal_ids[1] = g_unix_signal_add (SIGTERM, btd_daemon_quit_cb, self);
+    signal_ids[2] = g_unix_signal_add (SIGINT, btd_daemon_quit_cb, self);
+
+    btd_info ("Btrfsd %s started in daemon mode", PACKAGE_VERSION);
+#ifdef HAVE_SYSTEMD
+    sd_notify (0, "READY=1");
+#endif
+
+    /* run anything that is already due, then sleep until the next action */
+    btd_daemon_run_scheduled (self);
+    if (!priv->quit_requested)
+        g_main_loop_run (priv->loop);
+
+    for (guint i = 0; i < G_N_ELEMENTS (signal_ids); i++)
+        g_source_remove (signal_ids[i]);
+
+    return TRUE;
+}
@@ -0,0 +1,33 @@
+/*
+ * Copyright (C) Matthias Klumpp <matthias@tenstral.net>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#pragma once
+
+#include <glib-object.h>
+
+#include "btd-scheduler.h"
+
+G_BEGIN_DECLS
+
+#define BTD_TYPE_DAEMON (btd_daemon_get_type ())
+G_DECLARE_DERIVABLE_TYPE (BtdDaemon, btd_daemon, BTD, DAEMON, GObject)
+
+struct _BtdDaemonClass {
+    GObjectClass parent_class;
+    /*< private >*/
+    void (*_as_reserved1) (void);
+    void (*_as_reserved2) (void);
+    void (*_as_reserved3) (void);
+    void (*_as_reserved4) (void);
+    void (*_as_reserved5) (void);
+    void (*_as_reserved6) (void);
+};
+
+BtdDaemon *btd_daemon_new (BtdScheduler *scheduler);
+
+gboolean   btd_daemon_run (BtdDaemon *self, GError **error);
+
+G_END_DECLS
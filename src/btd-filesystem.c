@@ -15,16 +15,26 @@
 #include "config.h"
 #include "btd-filesystem.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
 #include <libmount/libmount.h>
-#include <json-glib/json-glib.h>
+#include <linux/btrfs.h>
+#include <linux/btrfs_tree.h>
 
 #include "btd-utils.h"
 #include "btd-logging.h"
+#include "btd-scrub.h"
+#include "btd-balance.h"
 
 typedef struct {
     gchar *device_name;
     gchar *mountpoint;
     dev_t devno;
+
+    gchar *fsid;
 } BtdFilesystemPrivate;
 
 enum {
@@ -91,6 +101,45 @@ out:
     return g_steal_pointer (&result);
 }
 
+/**
+ * btd_get_btrfs_mounts_fingerprint:
+ *
+ * Compute a cheap fingerprint of all mounted Btrfs filesystems, which
+ * changes whenever a Btrfs filesystem is mounted or unmounted.
+ * This reads the kernel's mount table directly, without involving libmount.
+ *
+ * Returns: (transfer full): A fingerprint string, or %NULL on error.
+ */
+gchar *
+btd_get_btrfs_mounts_fingerprint (void)
+{
+    g_autofree gchar *mountinfo = NULL;
+    g_auto(GStrv) lines = NULL;
+    g_autoptr(GString) btrfs_mounts = g_string_new (NULL);
+
+    if (!g_file_get_contents ("/proc/self/mountinfo", &mountinfo, NULL, NULL))
+        return NULL;
+
+    /* lines look like "36 35 0:42 / /mnt rw,relatime shared:1 - btrfs /dev/sda1 rw,..." */
+    lines = g_strsplit (mountinfo, "\n", -1);
+    for (guint i = 0; lines[i] != NULL; i++) {
+        g_auto(GStrv) fields = NULL;
+        guint n_fields;
+
+        if (strstr (lines[i], " - btrfs ") == NULL)
+            continue;
+        fields = g_strsplit (lines[i], " ", -1);
+        n_fields = g_strv_length (fields);
+        if (n_fields < 5)
+            continue;
+
+        /* device number and mountpoint */
+        g_string_append_printf (btrfs_mounts, "%s %s\n", fields[2], fields[4]);
+    }
+
+    return g_compute_checksum_for_string (G_CHECKSUM_SHA1, btrfs_mounts->str, btrfs_mounts->len);
+}
+
 static void
 btd_filesystem_init (BtdFilesystem *self)
 {
@@ -107,6 +156,7 @@ btd_filesystem_finalize (GObject *object)
 
     g_free (priv->device_name);
     g_free (priv->mountpoint);
+    g_free (priv->fsid);
 
     G_OBJECT_CLASS (btd_filesystem_parent_class)->finalize (object);
 }
@@ -257,52 +307,661 @@ btd_filesystem_get_devno (BtdFilesystem *self)
 }
 
 /**
- * btd_filesystem_read_usage:
+ * btd_device_info_free:
+ * @dinfo: A #BtdDeviceInfo
+ *
+ * Free a device information struct.
+ */
+void
+btd_device_info_free (BtdDeviceInfo *dinfo)
+{
+    if (dinfo == NULL)
+        return;
+    g_free (dinfo->path);
+    g_free (dinfo);
+}
+
+/**
+ * btd_filesystem_open:
  * @self: An instance of #BtdFilesystem.
  * @error: A #GError
  *
- * Read filesystem usage information (btrfs fi df).
+ * Open the mountpoint of this filesystem, so we can issue ioctls on it.
  *
- * Returns: The Btrfs usage report.
+ * Returns: A file descriptor which the caller needs to close, or -1 on error.
+ */
+gint
+btd_filesystem_open (BtdFilesystem *self, GError **error)
+{
+    BtdFilesystemPrivate *priv = GET_PRIVATE (self);
+    gint fd;
+
+    fd = open (priv->mountpoint, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        g_set_error (error,
+                     BTD_BTRFS_ERROR,
+                     BTD_BTRFS_ERROR_FAILED,
+                     "Failed to open %s: %s",
+                     priv->mountpoint,
+                     g_strerror (errno));
+        return -1;
+    }
+
+    return fd;
+}
+
+static gboolean
+btd_filesystem_query_fs_info (BtdFilesystem *self,
+                              gint fd,
+                              struct btrfs_ioctl_fs_info_args *fs_info,
+                              GError **error)
+{
+    BtdFilesystemPrivate *priv = GET_PRIVATE (self);
+
+    memset (fs_info, 0, sizeof (*fs_info));
+    if (ioctl (fd, BTRFS_IOC_FS_INFO, fs_info) < 0) {
+        g_set_error (error,
+                     BTD_BTRFS_ERROR,
+                     BTD_BTRFS_ERROR_FAILED,
+                     "Failed to query filesystem information for %s: %s",
+                     priv->mountpoint,
+                     g_strerror (errno));
+        return FALSE;
+    }
+
+    if (priv->fsid == NULL) {
+        GString *fsid_str = g_string_sized_new (37);
+        for (guint i = 0; i < BTRFS_FSID_SIZE; i++) {
+            if (i == 4 || i == 6 || i == 8 || i == 10)
+                g_string_append_c (fsid_str, '-');
+            g_string_append_printf (fsid_str, "%02x", fs_info->fsid[i]);
+        }
+        priv->fsid = g_string_free (fsid_str, FALSE);
+    }
+
+    return TRUE;
+}
+
+/**
+ * btd_filesystem_get_fsid:
+ * @self: An instance of #BtdFilesystem.
+ *
+ * Get the UUID of this filesystem, as used in /sys/fs/btrfs.
+ *
+ * Returns: The filesystem UUID, or %NULL if it could not be determined.
+ */
+const gchar *
+btd_filesystem_get_fsid (BtdFilesystem *self)
+{
+    BtdFilesystemPrivate *priv = GET_PRIVATE (self);
+    struct btrfs_ioctl_fs_info_args fs_info;
+    g_autoptr(GError) error = NULL;
+    gint fd;
+
+    if (priv->fsid != NULL)
+        return priv->fsid;
+
+    fd = btd_filesystem_open (self, &error);
+    if (fd < 0) {
+        btd_debug ("Unable to determine fsid: %s", error->message);
+        return NULL;
+    }
+    if (!btd_filesystem_query_fs_info (self, fd, &fs_info, &error))
+        btd_debug ("Unable to determine fsid: %s", error->message);
+    close (fd);
+
+    return priv->fsid;
+}
+
+/**
+ * btd_filesystem_get_generation:
+ * @self: An instance of #BtdFilesystem.
+ *
+ * Get the current transaction generation of this filesystem.
+ *
+ * Returns: The generation, or 0 if the kernel does not report it.
+ */
+guint64
+btd_filesystem_get_generation (BtdFilesystem *self)
+{
+    struct btrfs_ioctl_fs_info_args fs_info = { 0 };
+    g_autoptr(GError) error = NULL;
+    gint fd;
+    gint ret;
+
+    fd = btd_filesystem_open (self, &error);
+    if (fd < 0) {
+        btd_debug ("Unable to determine generation: %s", error->message);
+        return 0;
+    }
+
+    /* kernels that do not know about the flag clear it */
+    fs_info.flags = BTRFS_FS_INFO_FLAG_GENERATION;
+    ret = ioctl (fd, BTRFS_IOC_FS_INFO, &fs_info);
+    close (fd);
+    if (ret < 0 || (fs_info.flags & BTRFS_FS_INFO_FLAG_GENERATION) == 0)
+        return 0;
+
+    return fs_info.generation;
+}
+
+/**
+ * btd_filesystem_get_exclusive_operation:
+ * @self: An instance of #BtdFilesystem.
+ *
+ * Find out which exclusive operation is in progress on this filesystem.
+ * Only one of balance, device add, remove or replace, resize and swapfile
+ * activation can run at a time, and starting another one fails.
+ *
+ * Returns: (transfer full) (nullable): The operation as named by the kernel,
+ *          e.g. "device replace", or %NULL if there is none.
  */
 gchar *
+btd_filesystem_get_exclusive_operation (BtdFilesystem *self)
+{
+    struct btrfs_ioctl_balance_args bargs = { 0 };
+    g_autofree gchar *contents = NULL;
+    const gchar *fsid;
+    gint fd;
+    gint ret;
+
+    fsid = btd_filesystem_get_fsid (self);
+    if (fsid != NULL) {
+        g_autofree gchar *fname = g_build_filename ("/sys/fs/btrfs",
+                                                    fsid,
+                                                    "exclusive_operation",
+                                                    NULL);
+        if (g_file_get_contents (fname, &contents, NULL, NULL)) {
+            g_strstrip (contents);
+            if (btd_is_empty (contents) || g_strcmp0 (contents, "none") == 0)
+                return NULL;
+            return g_steal_pointer (&contents);
+        }
+    }
+
+    /* kernels older than 5.10 lack the sysfs file, but can at least tell us about balance */
+    fd = btd_filesystem_open (self, NULL);
+    if (fd < 0)
+        return NULL;
+    ret = ioctl (fd, BTRFS_IOC_BALANCE_PROGRESS, &bargs);
+    close (fd);
+
+    /* the kernel returns ENOTCONN if there is no balance, running or paused */
+    if (ret < 0)
+        return NULL;
+    if ((bargs.state & BTRFS_BALANCE_STATE_RUNNING) == 0)
+        return g_strdup ("balance paused");
+    return g_strdup ("balance");
+}
+
+/**
+ * btd_filesystem_has_device_name:
+ * @self: An instance of #BtdFilesystem.
+ * @device_name: Kernel name of a block device, e.g. "sda1" or "dm-0".
+ *
+ * Check whether the block device with the given kernel name is
+ * a member of this filesystem.
+ *
+ * Returns: %TRUE if the device belongs to this filesystem.
+ */
+gboolean
+btd_filesystem_has_device_name (BtdFilesystem *self, const gchar *device_name)
+{
+    const gchar *fsid;
+    g_autofree gchar *sysfs_path = NULL;
+
+    fsid = btd_filesystem_get_fsid (self);
+    if (fsid == NULL || strchr (device_name, '/') != NULL)
+        return FALSE;
+
+    sysfs_path = g_build_filename ("/sys/fs/btrfs", fsid, "devices", device_name, NULL);
+    return g_file_test (sysfs_path, G_FILE_TEST_EXISTS);
+}
+
+/**
+ * btd_filesystem_get_devices:
+ * @self: An instance of #BtdFilesystem.
+ * @error: A #GError
+ *
+ * Enumerate all devices that are part of this filesystem.
+ *
+ * Returns: (transfer container) (element-type BtdDeviceInfo): the member devices, or %NULL on error.
+ */
+GPtrArray *
+btd_filesystem_get_devices (BtdFilesystem *self, GError **error)
+{
+    struct btrfs_ioctl_fs_info_args fs_info;
+    g_autoptr(GPtrArray) devices = NULL;
+    gint fd;
+
+    fd = btd_filesystem_open (self, error);
+    if (fd < 0)
+        return NULL;
+
+    if (!btd_filesystem_query_fs_info (self, fd, &fs_info, error)) {
+        close (fd);
+        return NULL;
+    }
+
+    /* device IDs may have gaps if devices were removed, so we probe all of them */
+    devices = g_ptr_array_new_with_free_func ((GDestroyNotify) btd_device_info_free);
+    for (guint64 devid = 1; devid <= fs_info.max_id; devid++) {
+        struct btrfs_ioctl_dev_info_args dev_args = { 0 };
+        BtdDeviceInfo *dinfo;
+
+        dev_args.devid = devid;
+        if (ioctl (fd, BTRFS_IOC_DEV_INFO, &dev_args) < 0) {
+            if (errno == ENODEV)
+                continue;
+            g_set_error (error,
+                         BTD_BTRFS_ERROR,
+                         BTD_BTRFS_ERROR_FAILED,
+                         "Failed to query device %" G_GUINT64_FORMAT ": %s",
+                         devid,
+                         g_strerror (errno));
+            close (fd);
+            return NULL;
+        }
+
+        dinfo = g_new0 (BtdDeviceInfo, 1);
+        dinfo->devid = dev_args.devid;
+        dinfo->total_bytes = dev_args.total_bytes;
+        dinfo->bytes_used = dev_args.bytes_used;
+        if (dev_args.path[0] == '\0')
+            dinfo->path = g_strdup_printf ("<missing disk #%" G_GUINT64_FORMAT ">", devid);
+        else
+            dinfo->path = g_strndup ((const gchar *) dev_args.path, sizeof (dev_args.path));
+        g_ptr_array_add (devices, dinfo);
+    }
+
+    close (fd);
+    return g_steal_pointer (&devices);
+}
+
+/**
+ * btd_block_group_type_to_string:
+ * @flags: Block group flags.
+ *
+ * Returns: The human-readable type name of the block group.
+ */
+const gchar *
+btd_block_group_type_to_string (guint64 flags)
+{
+    if (flags & BTRFS_SPACE_INFO_GLOBAL_RSV)
+        return "GlobalReserve";
+    if ((flags & BTRFS_BLOCK_GROUP_TYPE_MASK) ==
+        (BTRFS_BLOCK_GROUP_DATA | BTRFS_BLOCK_GROUP_METADATA))
+        return "Data+Metadata";
+    if (flags & BTRFS_BLOCK_GROUP_DATA)
+        return "Data";
+    if (flags & BTRFS_BLOCK_GROUP_SYSTEM)
+        return "System";
+    if (flags & BTRFS_BLOCK_GROUP_METADATA)
+        return "Metadata";
+    return "Unknown";
+}
+
+/**
+ * btd_block_group_profile_to_string:
+ * @flags: Block group flags.
+ *
+ * Returns: The human-readable RAID profile name of the block group.
+ */
+const gchar *
+btd_block_group_profile_to_string (guint64 flags)
+{
+    switch (flags & BTRFS_BLOCK_GROUP_PROFILE_MASK) {
+    case BTRFS_BLOCK_GROUP_RAID0:
+        return "RAID0";
+    case BTRFS_BLOCK_GROUP_RAID1:
+        return "RAID1";
+    case BTRFS_BLOCK_GROUP_RAID1C3:
+        return "RAID1C3";
+    case BTRFS_BLOCK_GROUP_RAID1C4:
+        return "RAID1C4";
+    case BTRFS_BLOCK_GROUP_DUP:
+        return "DUP";
+    case BTRFS_BLOCK_GROUP_RAID10:
+        return "RAID10";
+    case BTRFS_BLOCK_GROUP_RAID5:
+        return "RAID5";
+    case BTRFS_BLOCK_GROUP_RAID6:
+        return "RAID6";
+    case 0:
+        return "single";
+    default:
+        return "unknown";
+    }
+}
+
+/**
+ * btd_fs_usage_free:
+ * @usage: A #BtdFsUsage
+ *
+ * Free a filesystem usage struct.
+ */
+void
+btd_fs_usage_free (BtdFsUsage *usage)
+{
+    if (usage == NULL)
+        return;
+    if (usage->spaces != NULL)
+        g_ptr_array_unref (usage->spaces);
+    if (usage->devices != NULL)
+        g_ptr_array_unref (usage->devices);
+    g_free (usage);
+}
+
+/**
+ * btd_fs_usage_get_device_size:
+ * @usage: A #BtdFsUsage
+ *
+ * Returns: The combined size of all devices of the filesystem.
+ */
+guint64
+btd_fs_usage_get_device_size (BtdFsUsage *usage)
+{
+    guint64 size = 0;
+    for (guint i = 0; i < usage->devices->len; i++)
+        size += ((BtdDeviceInfo *) g_ptr_array_index (usage->devices, i))->total_bytes;
+    return size;
+}
+
+/**
+ * btd_fs_usage_get_unallocated:
+ * @usage: A #BtdFsUsage
+ *
+ * Returns: The combined space on all devices which is not allocated to any chunk yet.
+ */
+guint64
+btd_fs_usage_get_unallocated (BtdFsUsage *usage)
+{
+    guint64 unallocated = 0;
+    for (guint i = 0; i < usage->devices->len; i++) {
+        BtdDeviceInfo *dinfo = g_ptr_array_index (usage->devices, i);
+        if (dinfo->total_bytes > dinfo->bytes_used)
+            unallocated += dinfo->total_bytes - dinfo->bytes_used;
+    }
+    return unallocated;
+}
+
+/**
+ * btd_fs_usage_get_profiles:
+ * @usage: A #BtdFsUsage
+ * @type_flags: Block group type to filter for, or 0 for all.
+ *
+ * Returns: The profile flags of all block groups of the selected type.
+ */
+guint64
+btd_fs_usage_get_profiles (BtdFsUsage *usage, guint64 type_flags)
+{
+    guint64 profiles = 0;
+    for (guint i = 0; i < usage->spaces->len; i++) {
+        BtdSpaceInfo *sinfo = g_ptr_array_index (usage->spaces, i);
+        if (type_flags != 0 && (sinfo->flags & type_flags) == 0)
+            continue;
+        profiles |= sinfo->flags & BTRFS_BLOCK_GROUP_PROFILE_MASK;
+    }
+    return profiles;
+}
+
+/**
+ * btd_fs_usage_get_scrub_concurrency:
+ * @usage: A #BtdFsUsage
+ *
+ * Determine how many devices of the filesystem should be scrubbed at the same time,
+ * based on the RAID profiles in use. Scrubbing a RAID5/6 filesystem in parallel makes
+ * every device read the parity of the other devices' stripes as well, so its devices
+ * are scrubbed one after another. All other profiles scale with the number of devices.
+ *
+ * Returns: The maximum number of devices to scrub concurrently, or 0 for no limit.
+ */
+guint
+btd_fs_usage_get_scrub_concurrency (BtdFsUsage *usage)
+{
+    if (btd_fs_usage_get_profiles (usage, 0) & BTRFS_BLOCK_GROUP_RAID56_MASK)
+        return 1;
+    return 0;
+}
+
+/**
+ * btd_fs_usage_to_text:
+ * @usage: A #BtdFsUsage
+ *
+ * Render the usage data as human-readable text.
+ *
+ * Returns: (transfer full): The usage report text.
+ */
+gchar *
+btd_fs_usage_to_text (BtdFsUsage *usage)
+{
+    GString *text = g_string_new (NULL);
+    g_autofree gchar *size_str = NULL;
+    g_autofree gchar *unalloc_str = NULL;
+
+    for (guint i = 0; i < usage->spaces->len; i++) {
+        BtdSpaceInfo *sinfo = g_ptr_array_index (usage->spaces, i);
+        g_autofree gchar *total_str = g_format_size_full (sinfo->total_bytes,
+                                                          G_FORMAT_SIZE_IEC_UNITS);
+        g_autofree gchar *used_str = g_format_size_full (sinfo->used_bytes,
+                                                         G_FORMAT_SIZE_IEC_UNITS);
+        g_string_append_printf (text,
+                                "%s, %s: total=%s, used=%s\n",
+                                btd_block_group_type_to_string (sinfo->flags),
+                                btd_block_group_profile_to_string (sinfo->flags),
+                                total_str,
+                                used_str);
+    }
+    if (usage->global_reserve > 0) {
+        g_autofree gchar *total_str = g_format_size_full (usage->global_reserve,
+                                                          G_FORMAT_SIZE_IEC_UNITS);
+        g_autofree gchar *used_str = g_format_size_full (usage->global_reserve_used,
+                                                         G_FORMAT_SIZE_IEC_UNITS);
+        g_string_append_printf (text,
+                                "GlobalReserve, single: total=%s, used=%s\n",
+                                total_str,
+                                used_str);
+    }
+
+    size_str = g_format_size_full (btd_fs_usage_get_device_size (usage), G_FORMAT_SIZE_IEC_UNITS);
+    unalloc_str = g_format_size_full (btd_fs_usage_get_unallocated (usage),
+                                      G_FORMAT_SIZE_IEC_UNITS);
+    g_string_append_printf (text, "Device size: %s, unallocated: %s\n", size_str, unalloc_str);
+    for (guint i = 0; i < usage->devices->len; i++) {
+        BtdDeviceInfo *dinfo = g_ptr_array_index (usage->devices, i);
+        g_autofree gchar *dev_unalloc_str = g_format_size_full (
+            dinfo->total_bytes > dinfo->bytes_used ? dinfo->total_bytes - dinfo->bytes_used : 0,
+            G_FORMAT_SIZE_IEC_UNITS);
+        g_string_append_printf (text, "  • %s: %s unallocated\n", dinfo->path, dev_unalloc_str);
+    }
+
+    /* drop trailing newline */
+    g_string_truncate (text, text->len - 1);
+
+    return g_string_free (text, FALSE);
+}
+
+static gboolean
+btd_read_sysfs_uint64 (const gchar *path, guint64 *value)
+{
+    g_autofree gchar *contents = NULL;
+
+    if (!g_file_get_contents (path, &contents, NULL, NULL))
+        return FALSE;
+    *value = g_ascii_strtoull (contents, NULL, 10);
+    return TRUE;
+}
+
+/**
+ * btd_filesystem_read_usage:
+ * @self: An instance of #BtdFilesystem.
+ * @error: A #GError
+ *
+ * Read filesystem space allocation and usage information directly from the kernel.
+ *
+ * Returns: (transfer full): The Btrfs usage data, or %NULL on error.
+ */
+BtdFsUsage *
 btd_filesystem_read_usage (BtdFilesystem *self, GError **error)
 {
     BtdFilesystemPrivate *priv = GET_PRIVATE (self);
-    GError *tmp_error = NULL;
-    gint btrfs_exit_code;
-    g_autofree gchar *df_output = NULL;
-    g_autofree gchar *stderr_output = NULL;
-
-    gchar *command[] = { BTRFS_CMD, "fi", "df", priv->mountpoint, NULL };
-    if (!g_spawn_sync (NULL, /* working directory */
-                       command,
-                       NULL, /* envp */
-                       G_SPAWN_DEFAULT,
-                       NULL,
-                       NULL,
-                       &df_output,
-                       &stderr_output,
-                       &btrfs_exit_code,
-                       &tmp_error)) {
-        g_propagate_prefixed_error (error, tmp_error, "Failed to execute btrfs fi df command:");
-        return FALSE;
+    g_autoptr(BtdFsUsage) usage = NULL;
+    g_autofree struct btrfs_ioctl_space_args *space_args = NULL;
+    struct btrfs_ioctl_space_args space_count = { 0 };
+    const gchar *fsid;
+    gint fd;
+
+    usage = g_new0 (BtdFsUsage, 1);
+    usage->spaces = g_ptr_array_new_with_free_func (g_free);
+    usage->devices = btd_filesystem_get_devices (self, error);
+    if (usage->devices == NULL)
+        return NULL;
+
+    fd = btd_filesystem_open (self, error);
+    if (fd < 0)
+        return NULL;
+
+    /* ask how many space info slots we need first */
+    if (ioctl (fd, BTRFS_IOC_SPACE_INFO, &space_count) < 0) {
+        g_set_error (error,
+                     BTD_BTRFS_ERROR,
+                     BTD_BTRFS_ERROR_FAILED,
+                     "Failed to query space information for %s: %s",
+                     priv->mountpoint,
+                     g_strerror (errno));
+        close (fd);
+        return NULL;
     }
 
-    if (btrfs_exit_code != 0) {
+    space_args = g_malloc0 (sizeof (struct btrfs_ioctl_space_args) +
+                            space_count.total_spaces * sizeof (struct btrfs_ioctl_space_info));
+    space_args->space_slots = space_count.total_spaces;
+    if (ioctl (fd, BTRFS_IOC_SPACE_INFO, space_args) < 0) {
         g_set_error (error,
                      BTD_BTRFS_ERROR,
                      BTD_BTRFS_ERROR_FAILED,
-                     "Running btrfs fi df has failed: %s",
-                     btd_strstripnl (stderr_output));
-        return FALSE;
+                     "Failed to query space information for %s: %s",
+                     priv->mountpoint,
+                     g_strerror (errno));
+        close (fd);
+        return NULL;
+    }
+    close (fd);
+
+    for (guint64 i = 0; i < space_args->total_spaces; i++) {
+        struct btrfs_ioctl_space_info *space = &space_args->spaces[i];
+        BtdSpaceInfo *sinfo;
+
+        if (space->flags & BTRFS_SPACE_INFO_GLOBAL_RSV) {
+            usage->global_reserve = space->total_bytes;
+            usage->global_reserve_used = space->used_bytes;
+            continue;
+        }
+
+        sinfo = g_new0 (BtdSpaceInfo, 1);
+        sinfo->flags = space->flags;
+        sinfo->total_bytes = space->total_bytes;
+        sinfo->used_bytes = space->used_bytes;
+        g_ptr_array_add (usage->spaces, sinfo);
+    }
+
+    /* older kernels do not report the global reserve via ioctl, so we check sysfs for it */
+    fsid = btd_filesystem_get_fsid (self);
+    if (usage->global_reserve == 0 && fsid != NULL) {
+        g_autofree gchar *rsv_size_fname = NULL;
+        g_autofree gchar *rsv_used_fname = NULL;
+
+        rsv_size_fname = g_strdup_printf ("/sys/fs/btrfs/%s/allocation/global_rsv_size", fsid);
+        rsv_used_fname = g_strdup_printf ("/sys/fs/btrfs/%s/allocation/global_rsv_reserved",
+                                          fsid);
+        if (btd_read_sysfs_uint64 (rsv_size_fname, &usage->global_reserve) &&
+            btd_read_sysfs_uint64 (rsv_used_fname, &usage->global_reserve_used)) {
+            /* the sysfs value is the reserved (unused) part, convert it to used bytes */
+            usage->global_reserve_used = usage->global_reserve > usage->global_reserve_used
+                                             ? usage->global_reserve - usage->global_reserve_used
+                                             : 0;
+        }
+    }
+
+    return g_steal_pointer (&usage);
+}
+
+/**
+ * btd_device_error_stats_free:
+ * @dstats: A #BtdDeviceErrorStats
+ *
+ * Free a device error statistics struct.
+ */
+void
+btd_device_error_stats_free (BtdDeviceErrorStats *dstats)
+{
+    g_free (dstats->device);
+    g_free (dstats);
+}
+
+/**
+ * btd_parse_sysfs_error_stats:
+ * @data: Contents of a sysfs error_stats file.
+ * @values: Receives the error counters, indexed by BTRFS_DEV_STAT_*.
+ *
+ * Parse the error counters of a device as provided by
+ * /sys/fs/btrfs/<fsid>/devinfo/<devid>/error_stats.
+ * Counters missing from @data are left untouched.
+ */
+void
+btd_parse_sysfs_error_stats (const gchar *data, guint64 *values)
+{
+    g_auto(GStrv) lines = NULL;
+    const struct {
+        const gchar *name;
+        guint index;
+    } keys[] = {
+        { "write_errs", BTRFS_DEV_STAT_WRITE_ERRS },
+        { "read_errs", BTRFS_DEV_STAT_READ_ERRS },
+        { "flush_errs", BTRFS_DEV_STAT_FLUSH_ERRS },
+        { "corruption_errs", BTRFS_DEV_STAT_CORRUPTION_ERRS },
+        { "generation_errs", BTRFS_DEV_STAT_GENERATION_ERRS },
+        { NULL, 0 },
+    };
+
+    lines = g_strsplit (data, "\n", -1);
+    for (guint i = 0; lines[i] != NULL; i++) {
+        for (guint j = 0; keys[j].name != NULL; j++) {
+            if (!g_str_has_prefix (lines[i], keys[j].name))
+                continue;
+            values[keys[j].index] = g_ascii_strtoull (lines[i] + strlen (keys[j].name), NULL, 10);
+            break;
+        }
     }
+}
+
+static gboolean
+btd_read_sysfs_error_stats (const gchar *fsid, guint64 devid, guint64 *values)
+{
+    g_autofree gchar *fname = NULL;
+    g_autofree gchar *contents = NULL;
+
+    fname = g_strdup_printf ("/sys/fs/btrfs/%s/devinfo/%" G_GUINT64_FORMAT "/error_stats",
+                             fsid,
+                             devid);
+    if (!g_file_get_contents (fname, &contents, NULL, NULL))
+        return FALSE;
+    btd_parse_sysfs_error_stats (contents, values);
 
-    return btd_strstripnl (g_steal_pointer (&df_output));
+    return TRUE;
 }
 
-static gchar *
-btd_parse_btrfs_device_stats (JsonArray *array, guint64 *errors_count)
+/**
+ * btd_render_device_stats_report:
+ * @dev_stats: (element-type BtdDeviceErrorStats): Error statistics of all devices.
+ * @errors_count: (out) (optional): Total number of errors on all devices.
+ *
+ * Create a human-readable report listing all devices and the errors found on them.
+ *
+ * Returns: (transfer full): The report text.
+ */
+gchar *
+btd_render_device_stats_report (GPtrArray *dev_stats, guint64 *errors_count)
 {
     g_autoptr(GString) intro_text = NULL;
     g_autoptr(GString) issues_text = NULL;
@@ -311,49 +970,44 @@ btd_parse_btrfs_device_stats (JsonArray *array, guint64 *errors_count)
     intro_text = g_string_new ("Registered Devices:\n");
     issues_text = g_string_new ("Issue Report:\n");
 
-    for (guint i = 0; i < json_array_get_length (array); i++) {
-        JsonObject *obj = json_array_get_object_element (array, i);
+    for (guint i = 0; i < dev_stats->len; i++) {
+        BtdDeviceErrorStats *dstats = g_ptr_array_index (dev_stats, i);
+        guint64 dev_errors = 0;
 
-        const gchar *device = json_object_get_string_member (obj, "device");
-        const gchar *devid = json_object_get_string_member (obj, "devid");
-        gint64 write_io_errs = json_object_get_int_member (obj, "write_io_errs");
-        gint64 read_io_errs = json_object_get_int_member (obj, "read_io_errs");
-        gint64 flush_io_errs = json_object_get_int_member (obj, "flush_io_errs");
-        gint64 corruption_errs = json_object_get_int_member (obj, "corruption_errs");
-        gint64 generation_errs = json_object_get_int_member (obj, "generation_errs");
-
-        total_errors = write_io_errs + read_io_errs + flush_io_errs + corruption_errs +
-                       generation_errs;
-        if (errors_count != NULL)
-            *errors_count = total_errors;
+        for (guint j = 0; j < BTRFS_DEV_STAT_VALUES_MAX; j++)
+            dev_errors += dstats->values[j];
+        total_errors += dev_errors;
 
         /* add device to the known devices list */
-        g_string_append_printf (intro_text, "  • %s\n", device);
+        g_string_append_printf (intro_text, "  • %s\n", dstats->device);
 
         /* if there are no errors, we don't add that information to the report */
-        if (total_errors == 0)
+        if (dev_errors == 0)
             continue;
 
         /* we have issues, make a full report */
-        g_string_append_printf (issues_text, "Device: %s\n", device);
-        g_string_append_printf (issues_text, "Devid:  %s\n", devid);
+        g_string_append_printf (issues_text, "Device: %s\n", dstats->device);
+        g_string_append_printf (issues_text, "Devid:  %" G_GUINT64_FORMAT "\n", dstats->devid);
         g_string_append_printf (issues_text,
-                                "Write IO Errors: %" G_GINT64_FORMAT "\n",
-                                write_io_errs);
+                                "Write IO Errors: %" G_GUINT64_FORMAT "\n",
+                                dstats->values[BTRFS_DEV_STAT_WRITE_ERRS]);
         g_string_append_printf (issues_text,
-                                "Read IO Errors:  %" G_GINT64_FORMAT "\n",
-                                read_io_errs);
+                                "Read IO Errors:  %" G_GUINT64_FORMAT "\n",
+                                dstats->values[BTRFS_DEV_STAT_READ_ERRS]);
         g_string_append_printf (issues_text,
-                                "Flush IO Errors: %" G_GINT64_FORMAT "\n",
-                                flush_io_errs);
+                                "Flush IO Errors: %" G_GUINT64_FORMAT "\n",
+                                dstats->values[BTRFS_DEV_STAT_FLUSH_ERRS]);
         g_string_append_printf (issues_text,
-                                "Corruption Errors: %" G_GINT64_FORMAT "\n",
-                                corruption_errs);
+                                "Corruption Errors: %" G_GUINT64_FORMAT "\n",
+                                dstats->values[BTRFS_DEV_STAT_CORRUPTION_ERRS]);
         g_string_append_printf (issues_text,
-                                "Generation Errors: %" G_GINT64_FORMAT "\n\n",
-                                generation_errs);
+                                "Generation Errors: %" G_GUINT64_FORMAT "\n\n",
+                                dstats->values[BTRFS_DEV_STAT_GENERATION_ERRS]);
     }
 
+    if (errors_count != NULL)
+        *errors_count = total_errors;
+
     /* finalize report */
     if (total_errors == 0)
         g_string_append (issues_text, "  • No errors found\n");
@@ -361,9 +1015,7 @@ btd_parse_btrfs_device_stats (JsonArray *array, guint64 *errors_count)
     g_string_prepend (issues_text, intro_text->str);
 
     /* drop trailing newlines */
-    g_string_truncate (issues_text, issues_text->len - 2);
-
-    return g_string_free (g_steal_pointer (&issues_text), FALSE);
+    return btd_strstripnl (g_string_free (g_steal_pointer (&issues_text), FALSE));
 }
 
 /**
@@ -373,6 +1025,10 @@ btd_parse_btrfs_device_stats (JsonArray *array, guint64 *errors_count)
  * @errors_count: (out) (optional): Number of detected erros
  * @error: A #GError, set if we failed to read statistics.
  *
+ * Read the error counters of all devices of this filesystem directly from the kernel.
+ * The counters are read from sysfs if the kernel provides them there, and via ioctl
+ * otherwise. Neither causes any I/O on the devices, so sleeping disks are not woken up.
+ *
  * Returns: %TRUE if stats were read successfully.
  */
 gboolean
@@ -382,175 +1038,156 @@ btd_filesystem_read_error_stats (BtdFilesystem *self,
                                  GError **error)
 {
     BtdFilesystemPrivate *priv = GET_PRIVATE (self);
-    GError *tmp_error = NULL;
-    gint btrfs_exit_code;
-    g_autofree gchar *stats_output = NULL;
-    g_autofree gchar *stderr_output = NULL;
-    g_autoptr(JsonParser) parser = NULL;
+    g_autoptr(GPtrArray) devices = NULL;
+    g_autoptr(GPtrArray) dev_stats = NULL;
     g_autofree gchar *tmp_report = NULL;
-    JsonObject *root = NULL;
-    JsonArray *device_stats = NULL;
-
-    gchar *command[] = { BTRFS_CMD, "--format=json", "device", "stats", priv->mountpoint, NULL };
-    btd_debug ("Running btrfs device stats on %s", priv->mountpoint);
-    if (!g_spawn_sync (NULL, /* working directory */
-                       command,
-                       NULL, /* envp */
-                       G_SPAWN_DEFAULT,
-                       NULL,
-                       NULL,
-                       &stats_output,
-                       &stderr_output,
-                       &btrfs_exit_code,
-                       &tmp_error)) {
-        g_propagate_prefixed_error (error, tmp_error, "Failed to execute btrfs stats command:");
-        return FALSE;
-    }
+    const gchar *fsid;
+    gint fd = -1;
 
-    if (btrfs_exit_code != 0) {
-        g_set_error (error,
-                     BTD_BTRFS_ERROR,
-                     BTD_BTRFS_ERROR_FAILED,
-                     "Running btrfs stats has failed: %s",
-                     btd_strstripnl (stderr_output));
+    btd_debug ("Reading device stats for %s", priv->mountpoint);
+    devices = btd_filesystem_get_devices (self, error);
+    if (devices == NULL)
         return FALSE;
-    }
+    fsid = btd_filesystem_get_fsid (self);
 
-    parser = json_parser_new ();
-    if (!json_parser_load_from_data (parser, stats_output, -1, &tmp_error)) {
-        g_propagate_prefixed_error (error, tmp_error, "Failed to parse btrfs stats JSON:");
-        return FALSE;
-    }
+    dev_stats = g_ptr_array_new_with_free_func ((GDestroyNotify) btd_device_error_stats_free);
+    for (guint i = 0; i < devices->len; i++) {
+        BtdDeviceInfo *dinfo = g_ptr_array_index (devices, i);
+        BtdDeviceErrorStats *dstats;
+        struct btrfs_ioctl_get_dev_stats args = { 0 };
 
-    root = json_node_get_object (json_parser_get_root (parser));
-    device_stats = json_object_get_array_member (root, "device-stats");
-    if (device_stats == NULL) {
-        g_set_error_literal (error,
-                             BTD_BTRFS_ERROR,
-                             BTD_BTRFS_ERROR_PARSE,
-                             "Failed to parse stats output: No 'device-stats' section.");
-        return FALSE;
+        dstats = g_new0 (BtdDeviceErrorStats, 1);
+        dstats->devid = dinfo->devid;
+        dstats->device = g_strdup (dinfo->path);
+        g_ptr_array_add (dev_stats, dstats);
+
+        /* sysfs needs no file descriptor on the filesystem, so prefer it where available */
+        if (fsid != NULL && btd_read_sysfs_error_stats (fsid, dinfo->devid, dstats->values))
+            continue;
+
+        if (fd < 0) {
+            fd = btd_filesystem_open (self, error);
+            if (fd < 0)
+                return FALSE;
+        }
+        args.devid = dinfo->devid;
+        args.nr_items = BTRFS_DEV_STAT_VALUES_MAX;
+        if (ioctl (fd, BTRFS_IOC_GET_DEV_STATS, &args) < 0) {
+            g_set_error (error,
+                         BTD_BTRFS_ERROR,
+                         BTD_BTRFS_ERROR_FAILED,
+                         "Unable to read error statistics for device %s of %s: %s",
+                         dinfo->path,
+                         priv->mountpoint,
+                         g_strerror (errno));
+            close (fd);
+            return FALSE;
+        }
+        for (guint j = 0; j < BTRFS_DEV_STAT_VALUES_MAX && j < args.nr_items; j++)
+            dstats->values[j] = args.values[j];
     }
+    if (fd >= 0)
+        close (fd);
 
-    /* parse stats & generate report */
-    tmp_report = btd_parse_btrfs_device_stats (device_stats, errors_count);
+    /* generate report */
+    tmp_report = btd_render_device_stats_report (dev_stats, errors_count);
     if (report != NULL)
         *report = g_steal_pointer (&tmp_report);
 
     return TRUE;
 }
 
+/**
+ * btd_filesystem_get_scrub_devices:
+ * @self: An instance of #BtdFilesystem.
+ * @error: A #GError, set if the device list could not be read.
+ *
+ * Create scrub units covering the whole of every device of this filesystem.
+ * Their ranges may be narrowed down before passing them to btd_filesystem_scrub().
+ *
+ * Returns: (transfer full) (element-type BtdScrubDevice): Scrub units, or %NULL on error.
+ */
+GPtrArray *
+btd_filesystem_get_scrub_devices (BtdFilesystem *self, GError **error)
+{
+    g_autoptr(GPtrArray) devices = NULL;
+    g_autoptr(GPtrArray) sdevs = NULL;
+
+    devices = btd_filesystem_get_devices (self, error);
+    if (devices == NULL)
+        return NULL;
+
+    sdevs = g_ptr_array_new_with_free_func ((GDestroyNotify) btd_scrub_device_free);
+    for (guint i = 0; i < devices->len; i++) {
+        BtdDeviceInfo *dinfo = g_ptr_array_index (devices, i);
+        BtdScrubDevice *sdev = btd_scrub_device_new (dinfo->devid, dinfo->path);
+        sdev->size = dinfo->bytes_used;
+        sdev->device_size = dinfo->total_bytes;
+        g_ptr_array_add (sdevs, sdev);
+    }
+
+    return g_steal_pointer (&sdevs);
+}
+
 /**
  * btd_filesystem_scrub:
  * @self: An instance of #BtdFilesystem.
+ * @scrub_devices: (element-type BtdScrubDevice): Devices and ranges to scrub, receives the results.
+ * @max_runtime: Time in seconds after which the scrub is cancelled, or 0 for no limit.
+ * @max_parallel: Maximum number of devices to scrub at the same time, or 0 for no limit.
+ * @pressure: (nullable): Monitor for the I/O pressure at which the scrub is paused.
+ * @checkpoint_func: (scope call) (nullable): Function to persist the scrub progress periodically.
+ * @user_data: Data to pass to @checkpoint_func.
+ * @cancellable: (nullable): A #GCancellable to stop the scrub early.
  * @error: A #GError, set if scrub failed.
  *
+ * Scrub the given devices of this filesystem, up to @max_parallel of them in parallel.
+ * Results are stored for all devices, even if scrub failed on some of them.
+ * Devices that were not fully scrubbed within @max_runtime are marked as interrupted.
+ *
  * Returns: %TRUE if scrub operation completed without errors.
  */
 gboolean
-btd_filesystem_scrub (BtdFilesystem *self, GError **error)
+btd_filesystem_scrub (BtdFilesystem *self,
+                      GPtrArray *scrub_devices,
+                      gint64 max_runtime,
+                      guint max_parallel,
+                      BtdPressureMonitor *pressure,
+                      BtdScrubCheckpointFunc checkpoint_func,
+                      gpointer user_data,
+                      GCancellable *cancellable,
+                      GError **error)
 {
     BtdFilesystemPrivate *priv = GET_PRIVATE (self);
-    GError *tmp_error = NULL;
-    gint btrfs_exit_code;
-    g_autofree gchar *btrfs_stdout = NULL;
-    g_autofree gchar *btrfs_stderr = NULL;
 
-    gchar *command[] = { BTRFS_CMD, "-q", "scrub", "start", "-B", priv->mountpoint, NULL };
     btd_info ("Running btrfs scrub on %s", priv->mountpoint);
-    if (!g_spawn_sync (NULL, /* working directory */
-                       command,
-                       NULL, /* envp */
-                       G_SPAWN_DEFAULT,
-                       NULL,
-                       NULL,
-                       &btrfs_stdout,
-                       &btrfs_stderr,
-                       &btrfs_exit_code,
-                       &tmp_error)) {
-        g_propagate_prefixed_error (error, tmp_error, "Failed to execute btrfs scrub command:");
-        return FALSE;
-    }
-
-    if (btrfs_exit_code != 0) {
-        g_autofree gchar *output_msg = NULL;
-        btrfs_stdout = btd_strstripnl (btrfs_stdout);
-        btrfs_stderr = btd_strstripnl (btrfs_stderr);
-
-        if (btd_is_empty (btrfs_stdout))
-            output_msg = g_steal_pointer (&btrfs_stderr);
-        else if (btd_is_empty (btrfs_stderr))
-            output_msg = g_steal_pointer (&btrfs_stdout);
-        else
-            output_msg = g_strconcat (btrfs_stderr, "\n", btrfs_stdout, NULL);
-
-        g_set_error (error,
-                     BTD_BTRFS_ERROR,
-                     BTD_BTRFS_ERROR_SCRUB_FAILED,
-                     "Scrub action failed: %s",
-                     output_msg);
-        return FALSE;
-    }
-
-    /* scrub ran successfully */
-    return TRUE;
+    return btd_scrub_run (self,
+                          scrub_devices,
+                          max_runtime,
+                          max_parallel,
+                          pressure,
+                          checkpoint_func,
+                          user_data,
+                          cancellable,
+                          error);
 }
 
 /**
  * btd_filesystem_balance:
  * @self: An instance of #BtdFilesystem.
- * @error: A #GError, set if scrub failed.
+ * @params: The #BtdBalanceParams to use.
+ * @paused: (out) (optional): Set to %TRUE if the balance was paused before completion.
+ * @error: A #GError, set if balance failed.
  *
- * Run balance operation with some sensible defaults.
+ * Run balance operation with the given filters.
  *
- * Returns: %TRUE if balance operation completed without errors.
+ * Returns: %TRUE if balance operation completed or was paused without errors.
  */
 gboolean
-btd_filesystem_balance (BtdFilesystem *self, GError **error)
+btd_filesystem_balance (BtdFilesystem *self,
+                        BtdBalanceParams *params,
+                        gboolean *paused,
+                        GError **error)
 {
-    BtdFilesystemPrivate *priv = GET_PRIVATE (self);
-    GError *tmp_error = NULL;
-    gint btrfs_exit_code;
-    g_autofree gchar *btrfs_stdout = NULL;
-    g_autofree gchar *btrfs_stderr = NULL;
-
-    gchar *command[] = { BTRFS_CMD,    "balance",    "start",          "--enqueue",
-                         "-dusage=15", "-musage=10", priv->mountpoint, NULL };
-    btd_info ("Running btrfs balance on %s", priv->mountpoint);
-    if (!g_spawn_sync (NULL, /* working directory */
-                       command,
-                       NULL, /* envp */
-                       G_SPAWN_DEFAULT,
-                       NULL,
-                       NULL,
-                       &btrfs_stdout,
-                       &btrfs_stderr,
-                       &btrfs_exit_code,
-                       &tmp_error)) {
-        g_propagate_prefixed_error (error, tmp_error, "Failed to execute btrfs balance command:");
-        return FALSE;
-    }
-
-    if (btrfs_exit_code != 0) {
-        g_autofree gchar *output_msg = NULL;
-        btrfs_stdout = btd_strstripnl (btrfs_stdout);
-        btrfs_stderr = btd_strstripnl (btrfs_stderr);
-
-        if (btd_is_empty (btrfs_stdout))
-            output_msg = g_steal_pointer (&btrfs_stderr);
-        else if (btd_is_empty (btrfs_stderr))
-            output_msg = g_steal_pointer (&btrfs_stdout);
-        else
-            output_msg = g_strconcat (btrfs_stderr, "\n", btrfs_stdout, NULL);
-
-        g_set_error (error,
-                     BTD_BTRFS_ERROR,
-                     BTD_BTRFS_ERROR_SCRUB_FAILED,
-                     "Balance action failed: %s",
-                     output_msg);
-        return FALSE;
-    }
-
-    /* balance ran successfully */
-    return TRUE;
+    return btd_balance_run (self, params, paused, error);
 }
@@ -7,6 +7,9 @@
 #pragma once
 
 #include <glib-object.h>
+#include <linux/btrfs.h>
+
+#include "btd-pressure.h"
 
 G_BEGIN_DECLS
 
@@ -15,6 +18,7 @@ G_BEGIN_DECLS
  * @BTD_BTRFS_ERROR_FAILED:        Generic failure
  * @BTD_BTRFS_ERROR_PARSE:         Data parsing failed
  * @BTD_BTRFS_ERROR_SCRUB_FAILED:  Scrub operation failed.
+ * @BTD_BTRFS_ERROR_BALANCE_FAILED: Balance operation failed.
  *
  * The error type.
  **/
@@ -22,10 +26,23 @@ typedef enum {
     BTD_BTRFS_ERROR_FAILED,
     BTD_BTRFS_ERROR_PARSE,
     BTD_BTRFS_ERROR_SCRUB_FAILED,
+    BTD_BTRFS_ERROR_BALANCE_FAILED,
     /*< private >*/
     BTD_BTRFS_ERROR_LAST
 } BtdBtrfsError;
 
+typedef struct _BtdBalanceParams BtdBalanceParams;
+
+/**
+ * BtdScrubCheckpointFunc:
+ * @scrub_devices: (element-type BtdScrubDevice): Snapshot of the devices being scrubbed.
+ * @user_data: Data passed to btd_scrub_run().
+ *
+ * Called periodically while a scrub is running, so its progress can be
+ * persisted and resumed later if the scrub is interrupted.
+ */
+typedef void (*BtdScrubCheckpointFunc) (GPtrArray *scrub_devices, gpointer user_data);
+
 #define BTD_BTRFS_ERROR btd_btrfs_error_quark ()
 GQuark btd_btrfs_error_quark (void);
 
@@ -43,23 +60,123 @@ struct _BtdFilesystemClass {
     void (*_as_reserved6) (void);
 };
 
+/**
+ * BtdDeviceInfo:
+ * @devid:       The Btrfs device ID
+ * @path:        Path to the block device
+ * @total_bytes: Size of the device that is usable by the filesystem
+ * @bytes_used:  Amount of bytes allocated on the device
+ *
+ * Information about a device that is a member of a Btrfs filesystem.
+ **/
+typedef struct {
+    guint64 devid;
+    gchar  *path;
+    guint64 total_bytes;
+    guint64 bytes_used;
+} BtdDeviceInfo;
+
+void           btd_device_info_free (BtdDeviceInfo *dinfo);
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (BtdDeviceInfo, btd_device_info_free)
+
+/**
+ * BtdSpaceInfo:
+ * @flags:       Block group type and profile flags
+ * @total_bytes: Bytes allocated for block groups of this kind
+ * @used_bytes:  Bytes in use within the allocated block groups
+ *
+ * Space allocation for one kind of block group.
+ **/
+typedef struct {
+    guint64 flags;
+    guint64 total_bytes;
+    guint64 used_bytes;
+} BtdSpaceInfo;
+
+/**
+ * BtdFsUsage:
+ * @spaces:              (element-type BtdSpaceInfo): Allocation per block group type and profile
+ * @devices:             (element-type BtdDeviceInfo): Member devices of the filesystem
+ * @global_reserve:      Size of the global block reserve
+ * @global_reserve_used: Used bytes of the global block reserve
+ *
+ * Space usage information of a Btrfs filesystem.
+ **/
+typedef struct {
+    GPtrArray *spaces;
+    GPtrArray *devices;
+    guint64    global_reserve;
+    guint64    global_reserve_used;
+} BtdFsUsage;
+
+void           btd_fs_usage_free (BtdFsUsage *usage);
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (BtdFsUsage, btd_fs_usage_free)
+
+/**
+ * BtdDeviceErrorStats:
+ * @devid:  The Btrfs device ID
+ * @device: Path to the block device
+ * @values: Error counters of the device, indexed by BTRFS_DEV_STAT_*
+ *
+ * Error statistics of a single device.
+ **/
+typedef struct {
+    guint64  devid;
+    gchar   *device;
+    guint64  values[BTRFS_DEV_STAT_VALUES_MAX];
+} BtdDeviceErrorStats;
+
+void           btd_device_error_stats_free (BtdDeviceErrorStats *dstats);
+void           btd_parse_sysfs_error_stats (const gchar *data, guint64 *values);
+gchar         *btd_render_device_stats_report (GPtrArray *dev_stats, guint64 *errors_count);
+
+guint64        btd_fs_usage_get_device_size (BtdFsUsage *usage);
+guint64        btd_fs_usage_get_unallocated (BtdFsUsage *usage);
+guint64        btd_fs_usage_get_profiles (BtdFsUsage *usage, guint64 type_flags);
+guint          btd_fs_usage_get_scrub_concurrency (BtdFsUsage *usage);
+gchar         *btd_fs_usage_to_text (BtdFsUsage *usage);
+
+const gchar   *btd_block_group_type_to_string (guint64 flags);
+const gchar   *btd_block_group_profile_to_string (guint64 flags);
+
 GPtrArray     *btd_find_mounted_btrfs_filesystems (GError **error);
+gchar         *btd_get_btrfs_mounts_fingerprint (void);
 
 BtdFilesystem *btd_filesystem_new (const gchar *device, dev_t devno, const gchar *mountpoint);
 
 const gchar   *btd_filesystem_get_device_name (BtdFilesystem *self);
 const gchar   *btd_filesystem_get_mountpoint (BtdFilesystem *self);
 dev_t          btd_filesystem_get_devno (BtdFilesystem *self);
+const gchar   *btd_filesystem_get_fsid (BtdFilesystem *self);
+guint64        btd_filesystem_get_generation (BtdFilesystem *self);
+gchar         *btd_filesystem_get_exclusive_operation (BtdFilesystem *self);
+gboolean       btd_filesystem_has_device_name (BtdFilesystem *self, const gchar *device_name);
+
+gint           btd_filesystem_open (BtdFilesystem *self, GError **error);
+
+GPtrArray     *btd_filesystem_get_devices (BtdFilesystem *self, GError **error);
 
-gchar         *btd_filesystem_read_usage (BtdFilesystem *self, GError **error);
+BtdFsUsage    *btd_filesystem_read_usage (BtdFilesystem *self, GError **error);
 
 gboolean       btd_filesystem_read_error_stats (BtdFilesystem *self,
                                                 gchar        **report,
                                                 guint64       *errors_count,
                                                 GError       **error);
 
-gboolean       btd_filesystem_scrub (BtdFilesystem *self, GError **error);
+GPtrArray     *btd_filesystem_get_scrub_devices (BtdFilesystem *self, GError **error);
+gboolean       btd_filesystem_scrub (BtdFilesystem         *self,
+                                     GPtrArray             *scrub_devices,
+                                     gint64                 max_runtime,
+                                     guint                  max_parallel,
+                                     BtdPressureMonitor    *pressure,
+                                     BtdScrubCheckpointFunc checkpoint_func,
+                                     gpointer               user_data,
+                                     GCancellable          *cancellable,
+                                     GError               **error);
 
-gboolean       btd_filesystem_balance (BtdFilesystem *self, GError **error);
+gboolean       btd_filesystem_balance (BtdFilesystem    *self,
+                                       BtdBalanceParams *params,
+                                       gboolean         *paused,
+                                       GError          **error);
 
 G_END_DECLS
@@ -9,6 +9,7 @@
  * @short_description: Helper class to store state about a mounted Btrfs filesystem.
  *
  * Store state about a Btrfs mountpoint for later use.
+ * Records may be accessed from multiple threads.
  */
 
 #include "config.h"
@@ -19,6 +20,7 @@
 typedef struct {
     gchar *mountpoint;
     GKeyFile *state;
+    GRecMutex lock;
 
     gboolean is_new;
 } BtdFsRecordPrivate;
@@ -53,6 +55,10 @@ btd_btrfs_action_to_string (BtdBtrfsAction kind)
         return "scrub";
     if (kind == BTD_BTRFS_ACTION_BALANCE)
         return "balance";
+    if (kind == BTD_BTRFS_ACTION_VERIFY_RECENT)
+        return "verify-recent";
+    if (kind == BTD_BTRFS_ACTION_METADATA_SCRUB)
+        return "metadata-scrub";
     return "unknown";
 }
 
@@ -73,6 +79,10 @@ btd_btrfs_action_from_string (const gchar *str)
         return BTD_BTRFS_ACTION_SCRUB;
     if (btd_str_equal0 (str, "balance"))
         return BTD_BTRFS_ACTION_BALANCE;
+    if (btd_str_equal0 (str, "verify-recent"))
+        return BTD_BTRFS_ACTION_VERIFY_RECENT;
+    if (btd_str_equal0 (str, "metadata-scrub"))
+        return BTD_BTRFS_ACTION_METADATA_SCRUB;
     return BTD_BTRFS_ACTION_UNKNOWN;
 }
 
@@ -93,6 +103,10 @@ btd_btrfs_action_to_human_string (BtdBtrfsAction kind)
         return "Scrub Filesystem";
     if (kind == BTD_BTRFS_ACTION_BALANCE)
         return "Balance Filesystem";
+    if (kind == BTD_BTRFS_ACTION_VERIFY_RECENT)
+        return "Verify Recently Written Data";
+    if (kind == BTD_BTRFS_ACTION_METADATA_SCRUB)
+        return "Scrub Metadata";
     return "Unknown Action";
 }
 
@@ -102,6 +116,7 @@ btd_fs_record_init (BtdFsRecord *self)
     BtdFsRecordPrivate *priv = GET_PRIVATE (self);
 
     priv->state = g_key_file_new ();
+    g_rec_mutex_init (&priv->lock);
 }
 
 static void
@@ -112,6 +127,7 @@ btd_fs_record_finalize (GObject *object)
 
     g_free (priv->mountpoint);
     g_key_file_unref (priv->state);
+    g_rec_mutex_clear (&priv->lock);
 
     G_OBJECT_CLASS (btd_fs_record_parent_class)->finalize (object);
 }
@@ -215,6 +231,7 @@ gboolean
 btd_fs_record_load (BtdFsRecord *self, GError **error)
 {
     BtdFsRecordPrivate *priv = GET_PRIVATE (self);
+    g_autoptr(GRecMutexLocker) locker = g_rec_mutex_locker_new (&priv->lock);
     g_autofree gchar *state_path = NULL;
 
     state_path = btd_fs_record_get_state_filename (self);
@@ -248,6 +265,7 @@ gboolean
 btd_fs_record_save (BtdFsRecord *self, GError **error)
 {
     BtdFsRecordPrivate *priv = GET_PRIVATE (self);
+    g_autoptr(GRecMutexLocker) locker = g_rec_mutex_locker_new (&priv->lock);
     g_autofree gchar *state_path = NULL;
 
     state_path = btd_fs_record_get_state_filename (self);
@@ -308,6 +326,7 @@ gint64
 btd_fs_record_get_last_action_time (BtdFsRecord *self, BtdBtrfsAction action_kind)
 {
     BtdFsRecordPrivate *priv = GET_PRIVATE (self);
+    g_autoptr(GRecMutexLocker) locker = g_rec_mutex_locker_new (&priv->lock);
     return g_key_file_get_int64 (priv->state,
                                  "times",
                                  btd_btrfs_action_to_string (action_kind),
@@ -325,6 +344,7 @@ void
 btd_fs_record_set_last_action_time_now (BtdFsRecord *self, BtdBtrfsAction action_kind)
 {
     BtdFsRecordPrivate *priv = GET_PRIVATE (self);
+    g_autoptr(GRecMutexLocker) locker = g_rec_mutex_locker_new (&priv->lock);
     g_key_file_set_uint64 (priv->state,
                            "times",
                            btd_btrfs_action_to_string (action_kind),
@@ -347,6 +367,7 @@ btd_fs_record_get_value_int (BtdFsRecord *self,
                              gint64 default_value)
 {
     BtdFsRecordPrivate *priv = GET_PRIVATE (self);
+    g_autoptr(GRecMutexLocker) locker = g_rec_mutex_locker_new (&priv->lock);
     gint64 value;
     g_autoptr(GError) error = NULL;
 
@@ -372,5 +393,47 @@ btd_fs_record_set_value_int (BtdFsRecord *self,
                              gint64 value)
 {
     BtdFsRecordPrivate *priv = GET_PRIVATE (self);
+    g_autoptr(GRecMutexLocker) locker = g_rec_mutex_locker_new (&priv->lock);
     g_key_file_set_uint64 (priv->state, group_name, key, value);
 }
+
+/**
+ * btd_fs_record_get_value_str:
+ * @self: An instance of #BtdFsRecord.
+ * @group_name: The group.
+ * @key: The key to look at.
+ *
+ * Returns: (transfer full) (nullable): The selected value, or %NULL if it is not set.
+ */
+gchar *
+btd_fs_record_get_value_str (BtdFsRecord *self, const gchar *group_name, const gchar *key)
+{
+    BtdFsRecordPrivate *priv = GET_PRIVATE (self);
+    g_autoptr(GRecMutexLocker) locker = g_rec_mutex_locker_new (&priv->lock);
+
+    return g_key_file_get_string (priv->state, group_name, key, NULL);
+}
+
+/**
+ * btd_fs_record_set_value_str:
+ * @self: An instance of #BtdFsRecord.
+ * @group_name: The group.
+ * @key: The key to set.
+ * @value: (nullable): The new value, or %NULL to remove the key.
+ *
+ * Set a string value in the state record.
+ */
+void
+btd_fs_record_set_value_str (BtdFsRecord *self,
+                             const gchar *group_name,
+                             const gchar *key,
+                             const gchar *value)
+{
+    BtdFsRecordPrivate *priv = GET_PRIVATE (self);
+    g_autoptr(GRecMutexLocker) locker = g_rec_mutex_locker_new (&priv->lock);
+
+    if (value == NULL)
+        g_key_file_remove_key (priv->state, group_name, key, NULL);
+    else
+        g_key_file_set_string (priv->state, group_name, key, value);
+}
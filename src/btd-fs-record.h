@@ -30,6 +30,8 @@ struct _BtdFsRecordClass {
  * @BTD_BTRFS_ACTION_STATS:   Stats action
  * @BTD_BTRFS_ACTION_SCRUB:   Scrub action
  * @BTD_BTRFS_ACTION_BALANCE: Balance action
+ * @BTD_BTRFS_ACTION_VERIFY_RECENT: Verify recently written data
+ * @BTD_BTRFS_ACTION_METADATA_SCRUB: Scrub metadata and system chunks only
  *
  * A Btrfs action that we perform.
  **/
@@ -38,6 +40,8 @@ typedef enum {
     BTD_BTRFS_ACTION_STATS,
     BTD_BTRFS_ACTION_SCRUB,
     BTD_BTRFS_ACTION_BALANCE,
+    BTD_BTRFS_ACTION_VERIFY_RECENT,
+    BTD_BTRFS_ACTION_METADATA_SCRUB,
     /*< private >*/
     BTD_BTRFS_ACTION_LAST
 } BtdBtrfsAction;
@@ -66,5 +70,12 @@ void   btd_fs_record_set_value_int (BtdFsRecord *self,
                                     const gchar *group_name,
                                     const gchar *key,
                                     gint64       value);
+gchar *btd_fs_record_get_value_str (BtdFsRecord *self,
+                                    const gchar *group_name,
+                                    const gchar *key);
+void   btd_fs_record_set_value_str (BtdFsRecord *self,
+                                    const gchar *group_name,
+                                    const gchar *key,
+                                    const gchar *value);
 
 G_END_DECLS
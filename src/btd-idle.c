@@ -0,0 +1,329 @@
+/*
+ * Copyright (C) Matthias Klumpp <matthias@tenstral.net>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+/**
+ * SECTION:btd-idle
+ * @short_description: Find out whether the machine is idle.
+ *
+ * Judges whether the system is quiet enough for I/O heavy maintenance,
+ * based on the load average, the activity of the disks a filesystem is
+ * stored on and the idle state of user sessions reported by logind.
+ * Also finds out whether disks are spun down, without waking them up.
+ */
+
+#include "config.h"
+#include "btd-idle.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/hdreg.h>
+#include <gio/gio.h>
+
+#include "btd-utils.h"
+#include "btd-topology.h"
+
+/* maximum load average per CPU at which we still consider the system idle */
+#define BTD_IDLE_MAX_LOAD 0.5
+
+/* maximum percentage of time a disk may be busy with I/O while idle */
+#define BTD_IDLE_MAX_IO_BUSY 10
+
+/* time in seconds over which disk activity is sampled */
+#define BTD_IDLE_SAMPLE_TIME 5
+
+/* ATA CHECK POWER MODE command, and its retired variant for very old drives */
+#define BTD_ATA_CHECK_POWER_MODE         0xE5
+#define BTD_ATA_CHECK_POWER_MODE_RETIRED 0x98
+
+/**
+ * btd_idle_parse_loadavg:
+ * @data: Contents of /proc/loadavg.
+ * @load1: (out): Load average over the last minute.
+ * @load5: (out): Load average over the last five minutes.
+ * @load15: (out): Load average over the last fifteen minutes.
+ *
+ * Returns: %TRUE if the data could be parsed.
+ */
+gboolean
+btd_idle_parse_loadavg (const gchar *data, gdouble *load1, gdouble *load5, gdouble *load15)
+{
+    g_auto(GStrv) fields = NULL;
+
+    *load1 = *load5 = *load15 = 0;
+    if (data == NULL)
+        return FALSE;
+
+    /* the data looks like "0.52 0.58 0.59 1/467 12345" */
+    fields = g_strsplit (data, " ", -1);
+    if (g_strv_length (fields) < 3)
+        return FALSE;
+    *load1 = g_ascii_strtod (fields[0], NULL);
+    *load5 = g_ascii_strtod (fields[1], NULL);
+    *load15 = g_ascii_strtod (fields[2], NULL);
+
+    return TRUE;
+}
+
+/**
+ * btd_idle_parse_block_stat:
+ * @data: Contents of the stat file of a block device in sysfs.
+ * @io_ticks: (out): Milliseconds the device spent doing I/O.
+ * @io_count: (out) (optional): Number of completed reads and writes.
+ *
+ * Returns: %TRUE if the data could be parsed.
+ */
+gboolean
+btd_idle_parse_block_stat (const gchar *data, guint64 *io_ticks, guint64 *io_count)
+{
+    g_auto(GStrv) fields = NULL;
+    guint n_fields = 0;
+    guint64 count = 0;
+
+    *io_ticks = 0;
+    if (io_count != NULL)
+        *io_count = 0;
+    if (data == NULL)
+        return FALSE;
+
+    /* completed reads and writes are the first and fifth, io_ticks the tenth
+     * of the whitespace-aligned fields */
+    fields = g_strsplit_set (data, " \t\n", -1);
+    for (guint i = 0; fields[i] != NULL; i++) {
+        if (btd_is_empty (fields[i]))
+            continue;
+        n_fields++;
+        if (n_fields == 1 || n_fields == 5)
+            count += g_ascii_strtoull (fields[i], NULL, 10);
+        if (n_fields == 10) {
+            *io_ticks = g_ascii_strtoull (fields[i], NULL, 10);
+            if (io_count != NULL)
+                *io_count = count;
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+static gboolean
+btd_idle_read_block_stat (BtdDisk *disk, guint64 *io_ticks, guint64 *io_count)
+{
+    g_autofree gchar *stat_fname = g_build_filename (disk->sysfs_path, "stat", NULL);
+    g_autofree gchar *data = NULL;
+
+    if (!g_file_get_contents (stat_fname, &data, NULL, NULL))
+        return FALSE;
+    return btd_idle_parse_block_stat (data, io_ticks, io_count);
+}
+
+static gboolean
+btd_idle_get_logind_hint (gboolean *idle_hint, guint64 *idle_since)
+{
+    g_autoptr(GDBusConnection) connection = NULL;
+    g_autoptr(GVariant) hint_result = NULL;
+    g_autoptr(GVariant) since_result = NULL;
+    g_autoptr(GVariant) hint = NULL;
+    g_autoptr(GVariant) since = NULL;
+
+    connection = g_bus_get_sync (G_BUS_TYPE_SYSTEM, NULL, NULL);
+    if (connection == NULL)
+        return FALSE;
+
+    hint_result = g_dbus_connection_call_sync (
+        connection,
+        "org.freedesktop.login1",
+        "/org/freedesktop/login1",
+        "org.freedesktop.DBus.Properties",
+        "Get",
+        g_variant_new ("(ss)", "org.freedesktop.login1.Manager", "IdleHint"),
+        G_VARIANT_TYPE ("(v)"),
+        G_DBUS_CALL_FLAGS_NONE,
+        -1,
+        NULL,
+        NULL);
+    if (hint_result == NULL)
+        return FALSE;
+    since_result = g_dbus_connection_call_sync (
+        connection,
+        "org.freedesktop.login1",
+        "/org/freedesktop/login1",
+        "org.freedesktop.DBus.Properties",
+        "Get",
+        g_variant_new ("(ss)", "org.freedesktop.login1.Manager", "IdleSinceHint"),
+        G_VARIANT_TYPE ("(v)"),
+        G_DBUS_CALL_FLAGS_NONE,
+        -1,
+        NULL,
+        NULL);
+    if (since_result == NULL)
+        return FALSE;
+
+    g_variant_get (hint_result, "(v)", &hint);
+    g_variant_get (since_result, "(v)", &since);
+    *idle_hint = g_variant_get_boolean (hint);
+    *idle_since = g_variant_get_uint64 (since);
+    return TRUE;
+}
+
+/**
+ * btd_idle_check:
+ * @disks: (element-type BtdDisk) (nullable): The disks whose activity to check.
+ * @idle_time: Time in seconds the system should have been idle.
+ * @reason: (out) (optional): Why the system is not considered idle.
+ *
+ * Check whether the machine has been idle for about @idle_time: the load
+ * average over a matching period must be low, logind must not know about
+ * user sessions that were active recently, and @disks must be mostly idle.
+ * Disk activity is sampled for a few seconds, so this function blocks.
+ *
+ * Returns: %TRUE if the system is idle.
+ */
+gboolean
+btd_idle_check (GPtrArray *disks, gint64 idle_time, gchar **reason)
+{
+    g_autofree gchar *loadavg = NULL;
+    g_autofree guint64 *io_ticks = NULL;
+    gdouble load1;
+    gdouble load5;
+    gdouble load15;
+    gboolean idle_hint;
+    guint64 idle_since;
+    gint64 time_start;
+    gint64 elapsed_ms;
+
+    /* use the load average over the period closest to the idle time we want */
+    if (g_file_get_contents ("/proc/loadavg", &loadavg, NULL, NULL) &&
+        btd_idle_parse_loadavg (loadavg, &load1, &load5, &load15)) {
+        gdouble load = idle_time >= 15 * 60 ? load15 : (idle_time >= 5 * 60 ? load5 : load1);
+
+        if (load / MAX (g_get_num_processors (), 1) > BTD_IDLE_MAX_LOAD) {
+            if (reason != NULL)
+                *reason = g_strdup_printf ("load average is %.2f", load);
+            return FALSE;
+        }
+    }
+
+    /* logind is not available everywhere, in which case we only judge by system activity */
+    if (btd_idle_get_logind_hint (&idle_hint, &idle_since)) {
+        gint64 idle_for = (g_get_real_time () - (gint64) idle_since) / G_USEC_PER_SEC;
+
+        if (!idle_hint) {
+            if (reason != NULL)
+                *reason = g_strdup ("user sessions are active");
+            return FALSE;
+        }
+        if (idle_since > 0 && idle_for < idle_time) {
+            if (reason != NULL)
+                *reason = g_strdup_printf ("user sessions are only idle since %" G_GINT64_FORMAT
+                                           " seconds",
+                                           idle_for);
+            return FALSE;
+        }
+    }
+
+    if (disks == NULL || disks->len == 0)
+        return TRUE;
+
+    io_ticks = g_new0 (guint64, disks->len);
+    for (guint i = 0; i < disks->len; i++)
+        btd_idle_read_block_stat (g_ptr_array_index (disks, i), &io_ticks[i], NULL);
+    time_start = g_get_monotonic_time ();
+    g_usleep (BTD_IDLE_SAMPLE_TIME * G_USEC_PER_SEC);
+    elapsed_ms = MAX ((g_get_monotonic_time () - time_start) / 1000, 1);
+
+    for (guint i = 0; i < disks->len; i++) {
+        BtdDisk *disk = g_ptr_array_index (disks, i);
+        guint64 ticks;
+        guint64 busy;
+
+        if (!btd_idle_read_block_stat (disk, &ticks, NULL) || ticks < io_ticks[i])
+            continue;
+        busy = (ticks - io_ticks[i]) * 100 / (guint64) elapsed_ms;
+        if (busy > BTD_IDLE_MAX_IO_BUSY) {
+            if (reason != NULL)
+                *reason = g_strdup_printf ("disk %s is busy %" G_GUINT64_FORMAT "%% of the time",
+                                           disk->name,
+                                           MIN (busy, 100));
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+/**
+ * btd_idle_read_disk_io_count:
+ * @disk: A #BtdDisk
+ * @io_count: (out): Number of reads and writes the disk completed since boot.
+ *
+ * Read the I/O counters of @disk from sysfs, which does not wake it up.
+ *
+ * Returns: %TRUE if the counters could be read.
+ */
+gboolean
+btd_idle_read_disk_io_count (BtdDisk *disk, guint64 *io_count)
+{
+    guint64 io_ticks;
+
+    return btd_idle_read_block_stat (disk, &io_ticks, io_count);
+}
+
+static BtdDiskPowerState
+btd_idle_query_ata_power_mode (BtdDisk *disk)
+{
+    g_autofree gchar *dev_fname = g_build_filename ("/dev", disk->name, NULL);
+    guchar args[4] = { BTD_ATA_CHECK_POWER_MODE, 0, 0, 0 };
+    gint fd;
+
+    fd = open (dev_fname, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+        return BTD_DISK_POWER_STATE_UNKNOWN;
+
+    /* this is what "hdparm -C" does, drives answer it without spinning up */
+    if (ioctl (fd, HDIO_DRIVE_CMD, args) != 0) {
+        args[0] = BTD_ATA_CHECK_POWER_MODE_RETIRED;
+        args[1] = args[2] = args[3] = 0;
+        if (ioctl (fd, HDIO_DRIVE_CMD, args) != 0) {
+            close (fd);
+            return BTD_DISK_POWER_STATE_UNKNOWN;
+        }
+    }
+    close (fd);
+
+    /* the sector count register holds the mode, 0x40 means the spindle is
+     * down while a non-volatile cache is serving requests */
+    if (args[2] == 0x00 || args[2] == 0x40)
+        return BTD_DISK_POWER_STATE_STANDBY;
+    return BTD_DISK_POWER_STATE_ACTIVE;
+}
+
+/**
+ * btd_idle_get_disk_power_state:
+ * @disk: A #BtdDisk
+ *
+ * Find out whether @disk is spun down. Runtime power management state is
+ * checked first, as it is available from sysfs without touching the device.
+ * Otherwise ATA disks are asked for their power mode, which they answer
+ * without spinning up. Other disks, like SCSI disks which are not behind an
+ * ATA translation layer, have an unknown power state.
+ *
+ * Returns: The power state of @disk.
+ */
+BtdDiskPowerState
+btd_idle_get_disk_power_state (BtdDisk *disk)
+{
+    g_autofree gchar *rpm_fname = NULL;
+    g_autofree gchar *rpm_status = NULL;
+
+    /* opening a runtime-suspended device would resume it, so never query those */
+    rpm_fname = g_build_filename (disk->sysfs_path, "device", "power", "runtime_status", NULL);
+    if (g_file_get_contents (rpm_fname, &rpm_status, NULL, NULL) &&
+        g_str_has_prefix (rpm_status, "suspended"))
+        return BTD_DISK_POWER_STATE_STANDBY;
+
+    return btd_idle_query_ata_power_mode (disk);
+}
@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) Matthias Klumpp <matthias@tenstral.net>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#pragma once
+
+#include <glib-object.h>
+
+#include "btd-topology.h"
+
+G_BEGIN_DECLS
+
+/**
+ * BtdDiskPowerState:
+ * @BTD_DISK_POWER_STATE_UNKNOWN: The power state could not be determined
+ * @BTD_DISK_POWER_STATE_ACTIVE:  The disk is spun up
+ * @BTD_DISK_POWER_STATE_STANDBY: The disk is spun down
+ *
+ * Power state of a disk.
+ **/
+typedef enum {
+    BTD_DISK_POWER_STATE_UNKNOWN,
+    BTD_DISK_POWER_STATE_ACTIVE,
+    BTD_DISK_POWER_STATE_STANDBY,
+} BtdDiskPowerState;
+
+gboolean          btd_idle_parse_loadavg (const gchar *data,
+                                          gdouble     *load1,
+                                          gdouble     *load5,
+                                          gdouble     *load15);
+gboolean          btd_idle_parse_block_stat (const gchar *data,
+                                             guint64     *io_ticks,
+                                             guint64     *io_count);
+
+gboolean          btd_idle_check (GPtrArray *disks, gint64 idle_time, gchar **reason);
+
+gboolean          btd_idle_read_disk_io_count (BtdDisk *disk, guint64 *io_count);
+BtdDiskPowerState btd_idle_get_disk_power_state (BtdDisk *disk);
+
+G_END_DECLS
@@ -0,0 +1,155 @@
+/*
+ * Copyright (C) Matthias Klumpp <matthias@tenstral.net>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+/**
+ * SECTION:btd-kmsg
+ * @short_description: Read Btrfs issues from the kernel log.
+ *
+ * Helpers to read records from /dev/kmsg and to find Btrfs error
+ * messages in them.
+ */
+
+#include "config.h"
+#include "btd-kmsg.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+
+#include "btd-utils.h"
+#include "btd-filesystem.h"
+
+/* the kernel never emits longer records than this */
+#define BTD_KMSG_RECORD_MAX 8192
+
+/* messages that indicate trouble even if they were logged with a low priority */
+static const gchar *btd_kmsg_issue_phrases[] = {
+    "csum failed",
+    "checksum error",
+    "I/O error",
+    "IO failure",
+    "errs:",
+    "forced readonly",
+    "read error corrected",
+    "unable to fixup",
+    "corrupt",
+    NULL
+};
+
+/**
+ * btd_kmsg_parse_btrfs_issue:
+ * @record: A /dev/kmsg record, in the "<prio>,<seq>,<time>,<flags>;<message>" format.
+ * @device_name: (out) (optional): Kernel name of the affected device.
+ *
+ * Check whether a kernel log record reports an issue with a Btrfs filesystem,
+ * e.g. "BTRFS error (device sda1): bdev /dev/sda1 errs: wr 0, rd 1, ...".
+ *
+ * Returns: %TRUE if the record is a Btrfs issue with a known device.
+ */
+gboolean
+btd_kmsg_parse_btrfs_issue (const gchar *record, gchar **device_name)
+{
+    const gchar *message;
+    const gchar *dev_start;
+    gsize dev_len;
+    gint priority;
+    gboolean is_issue = FALSE;
+
+    message = strchr (record, ';');
+    if (message == NULL)
+        return FALSE;
+    message++;
+    if (!g_str_has_prefix (message, "BTRFS"))
+        return FALSE;
+
+    /* the priority field also contains the facility, which we do not care about */
+    priority = (gint) (g_ascii_strtoll (record, NULL, 10) & LOG_PRIMASK);
+    if (priority <= LOG_WARNING) {
+        is_issue = TRUE;
+    } else {
+        for (guint i = 0; btd_kmsg_issue_phrases[i] != NULL; i++) {
+            if (strstr (message, btd_kmsg_issue_phrases[i]) != NULL) {
+                is_issue = TRUE;
+                break;
+            }
+        }
+    }
+    if (!is_issue)
+        return FALSE;
+
+    /* newer kernels may append a state, like "(device sda1 state EA)" */
+    dev_start = strstr (message, "(device ");
+    if (dev_start == NULL)
+        return FALSE;
+    dev_start += strlen ("(device ");
+    dev_len = strcspn (dev_start, " ):");
+    if (dev_len == 0)
+        return FALSE;
+
+    if (device_name != NULL)
+        *device_name = g_strndup (dev_start, dev_len);
+    return TRUE;
+}
+
+/**
+ * btd_kmsg_open:
+ * @error: A #GError
+ *
+ * Open the kernel log for non-blocking reading, positioned after
+ * all records that were already logged.
+ *
+ * Returns: A file descriptor, or -1 on error.
+ */
+gint
+btd_kmsg_open (GError **error)
+{
+    gint fd;
+
+    fd = open ("/dev/kmsg", O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        g_set_error (error,
+                     BTD_BTRFS_ERROR,
+                     BTD_BTRFS_ERROR_FAILED,
+                     "Unable to open kernel log: %s",
+                     g_strerror (errno));
+        return -1;
+    }
+
+    /* we only care about new messages, existing issues are found by the stats action */
+    lseek (fd, 0, SEEK_END);
+
+    return fd;
+}
+
+/**
+ * btd_kmsg_read_record:
+ * @fd: File descriptor of /dev/kmsg.
+ * @again: (out): Set to %TRUE if reading should be retried, e.g. after records were lost.
+ *
+ * Read a single record from the kernel log.
+ *
+ * Returns: (transfer full) (nullable): The record, or %NULL if none is available.
+ */
+gchar *
+btd_kmsg_read_record (gint fd, gboolean *again)
+{
+    gchar buffer[BTD_KMSG_RECORD_MAX];
+    gssize len;
+
+    *again = FALSE;
+    len = read (fd, buffer, sizeof (buffer) - 1);
+    if (len < 0) {
+        /* EPIPE means we were too slow and the ring buffer wrapped around */
+        if (errno == EPIPE || errno == EINTR)
+            *again = TRUE;
+        return NULL;
+    }
+
+    buffer[len] = '\0';
+    return g_strdup (buffer);
+}
@@ -0,0 +1,18 @@
+/*
+ * Copyright (C) Matthias Klumpp <matthias@tenstral.net>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+gboolean btd_kmsg_parse_btrfs_issue (const gchar *record, gchar **device_name);
+
+gint     btd_kmsg_open (GError **error);
+gchar   *btd_kmsg_read_record (gint fd, gboolean *again);
+
+G_END_DECLS
@@ -0,0 +1,246 @@
+/*
+ * Copyright (C) Matthias Klumpp <matthias@tenstral.net>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+/**
+ * SECTION:btd-pressure
+ * @short_description: Watch the I/O pressure of the system.
+ *
+ * Uses pressure stall information (PSI) triggers to get notified when
+ * tasks are stalled on I/O for too long, so running maintenance can
+ * yield to other workloads until the pressure subsides.
+ */
+
+#include "config.h"
+#include "btd-pressure.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "btd-utils.h"
+#include "btd-logging.h"
+#include "btd-filesystem.h"
+
+#define BTD_PRESSURE_IO_FILE "/proc/pressure/io"
+
+/* PSI tracking window in microseconds, unprivileged triggers need a multiple of 2s */
+#define BTD_PRESSURE_WINDOW (10 * G_USEC_PER_SEC)
+
+/* time in seconds without a pressure event before maintenance may continue */
+#define BTD_PRESSURE_CALM_TIME 60
+
+struct _BtdPressureMonitor {
+    gint fd;
+    guint threshold;
+};
+
+/**
+ * btd_pressure_monitor_new:
+ * @threshold: Percentage of time tasks may be stalled on I/O within the tracking window.
+ * @error: A #GError
+ *
+ * Register a PSI trigger which fires whenever some tasks were stalled on
+ * I/O for more than @threshold percent of a ten second window.
+ *
+ * Returns: (transfer full): A new #BtdPressureMonitor, or %NULL on error.
+ */
+BtdPressureMonitor *
+btd_pressure_monitor_new (guint threshold, GError **error)
+{
+    g_autofree gchar *trigger = NULL;
+    BtdPressureMonitor *monitor;
+    gint fd;
+
+    threshold = CLAMP (threshold, 1, 100);
+    fd = open (BTD_PRESSURE_IO_FILE, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        g_set_error (error,
+                     BTD_BTRFS_ERROR,
+                     BTD_BTRFS_ERROR_FAILED,
+                     "Unable to open %s: %s",
+                     BTD_PRESSURE_IO_FILE,
+                     g_strerror (errno));
+        return NULL;
+    }
+
+    /* the kernel expects the trigger including its terminating NUL byte */
+    trigger = g_strdup_printf ("some %" G_GINT64_FORMAT " %" G_GINT64_FORMAT,
+                               (gint64) BTD_PRESSURE_WINDOW * threshold / 100,
+                               (gint64) BTD_PRESSURE_WINDOW);
+    if (write (fd, trigger, strlen (trigger) + 1) < 0) {
+        g_set_error (error,
+                     BTD_BTRFS_ERROR,
+                     BTD_BTRFS_ERROR_FAILED,
+                     "Unable to register I/O pressure trigger: %s",
+                     g_strerror (errno));
+        close (fd);
+        return NULL;
+    }
+
+    monitor = g_new0 (BtdPressureMonitor, 1);
+    monitor->fd = fd;
+    monitor->threshold = threshold;
+    return monitor;
+}
+
+/**
+ * btd_pressure_monitor_free:
+ * @monitor: A #BtdPressureMonitor
+ *
+ * Unregister the trigger and free the monitor.
+ */
+void
+btd_pressure_monitor_free (BtdPressureMonitor *monitor)
+{
+    if (monitor == NULL)
+        return;
+    close (monitor->fd);
+    g_free (monitor);
+}
+
+/**
+ * btd_pressure_monitor_get_threshold:
+ * @monitor: A #BtdPressureMonitor
+ *
+ * Returns: The stall percentage at which the monitor fires.
+ */
+guint
+btd_pressure_monitor_get_threshold (BtdPressureMonitor *monitor)
+{
+    return monitor->threshold;
+}
+
+static gboolean
+btd_pressure_monitor_poll (BtdPressureMonitor *monitor, gint timeout_ms, GCancellable *cancellable)
+{
+    struct pollfd pfds[2] = { { 0 } };
+    GPollFD cancel_pfd = { 0 };
+    nfds_t n_fds = 1;
+    gint ret;
+
+    pfds[0].fd = monitor->fd;
+    pfds[0].events = POLLPRI;
+    if (g_cancellable_make_pollfd (cancellable, &cancel_pfd)) {
+        pfds[1].fd = cancel_pfd.fd;
+        pfds[1].events = POLLIN;
+        n_fds++;
+    }
+    do {
+        ret = poll (pfds, n_fds, timeout_ms);
+    } while (ret < 0 && errno == EINTR);
+    if (n_fds > 1)
+        g_cancellable_release_fd (cancellable);
+
+    /* POLLERR means the trigger went away, which we treat as no pressure */
+    return ret > 0 && (pfds[0].revents & POLLPRI) != 0;
+}
+
+/**
+ * btd_pressure_monitor_check:
+ * @monitor: A #BtdPressureMonitor
+ *
+ * Check whether the I/O pressure exceeded the threshold since the last check.
+ * This function does not block.
+ *
+ * Returns: %TRUE if the trigger fired.
+ */
+gboolean
+btd_pressure_monitor_check (BtdPressureMonitor *monitor)
+{
+    return btd_pressure_monitor_poll (monitor, 0, NULL);
+}
+
+/**
+ * btd_pressure_monitor_wait_calm:
+ * @monitor: A #BtdPressureMonitor
+ * @max_wait: Maximum time to wait in seconds.
+ * @cancellable: (nullable): A #GCancellable to stop waiting early.
+ *
+ * Block until the trigger has not fired for a minute.
+ *
+ * Returns: %TRUE if the pressure subsided, %FALSE if we gave up waiting or were cancelled.
+ */
+gboolean
+btd_pressure_monitor_wait_calm (BtdPressureMonitor *monitor,
+                                gint64 max_wait,
+                                GCancellable *cancellable)
+{
+    gint64 deadline = g_get_monotonic_time () + max_wait * G_USEC_PER_SEC;
+
+    while (g_get_monotonic_time () + BTD_PRESSURE_CALM_TIME * G_USEC_PER_SEC <= deadline) {
+        gboolean fired;
+
+        fired = btd_pressure_monitor_poll (monitor, BTD_PRESSURE_CALM_TIME * 1000, cancellable);
+        if (g_cancellable_is_cancelled (cancellable))
+            return FALSE;
+        if (!fired)
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+/**
+ * btd_pressure_parse:
+ * @data: Contents of a PSI file, like /proc/pressure/io.
+ * @some_avg10: (out) (optional): Share of time some tasks were stalled, in percent.
+ * @full_avg10: (out) (optional): Share of time all tasks were stalled, in percent.
+ *
+ * Parse the ten second averages of pressure stall information.
+ *
+ * Returns: %TRUE if the "some" line was found.
+ */
+gboolean
+btd_pressure_parse (const gchar *data, gdouble *some_avg10, gdouble *full_avg10)
+{
+    g_auto(GStrv) lines = NULL;
+    gboolean found = FALSE;
+
+    if (some_avg10 != NULL)
+        *some_avg10 = 0;
+    if (full_avg10 != NULL)
+        *full_avg10 = 0;
+    if (data == NULL)
+        return FALSE;
+
+    /* lines look like "some avg10=0.12 avg60=0.05 avg300=0.01 total=12345" */
+    lines = g_strsplit (data, "\n", -1);
+    for (guint i = 0; lines[i] != NULL; i++) {
+        const gchar *avg = strstr (lines[i], " avg10=");
+        gdouble value;
+
+        if (avg == NULL)
+            continue;
+        value = g_ascii_strtod (avg + strlen (" avg10="), NULL);
+        if (g_str_has_prefix (lines[i], "some ")) {
+            found = TRUE;
+            if (some_avg10 != NULL)
+                *some_avg10 = value;
+        } else if (g_str_has_prefix (lines[i], "full ") && full_avg10 != NULL) {
+            *full_avg10 = value;
+        }
+    }
+
+    return found;
+}
+
+/**
+ * btd_pressure_get_io_level:
+ *
+ * Returns: The share of the last ten seconds some tasks were stalled on I/O, in percent.
+ */
+gdouble
+btd_pressure_get_io_level (void)
+{
+    g_autofree gchar *data = NULL;
+    gdouble some_avg10 = 0;
+
+    if (g_file_get_contents (BTD_PRESSURE_IO_FILE, &data, NULL, NULL))
+        btd_pressure_parse (data, &some_avg10, NULL);
+    return some_avg10;
+}
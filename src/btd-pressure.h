@@ -0,0 +1,30 @@
+/*
+ * Copyright (C) Matthias Klumpp <matthias@tenstral.net>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+typedef struct _BtdPressureMonitor BtdPressureMonitor;
+
+BtdPressureMonitor *btd_pressure_monitor_new (guint threshold, GError **error);
+void                btd_pressure_monitor_free (BtdPressureMonitor *monitor);
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (BtdPressureMonitor, btd_pressure_monitor_free)
+
+guint               btd_pressure_monitor_get_threshold (BtdPressureMonitor *monitor);
+gboolean            btd_pressure_monitor_check (BtdPressureMonitor *monitor);
+gboolean            btd_pressure_monitor_wait_calm (BtdPressureMonitor *monitor,
+                                                    gint64              max_wait,
+                                                    GCancellable       *cancellable);
+
+gboolean            btd_pressure_parse (const gchar *data,
+                                        gdouble     *some_avg10,
+                                        gdouble     *full_avg10);
+gdouble             btd_pressure_get_io_level (void);
+
+G_END_DECLS
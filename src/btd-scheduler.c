@@ -14,20 +14,54 @@
 #include "config.h"
 #include "btd-scheduler.h"
 
+#include <string.h>
+#include <sys/stat.h>
+#include <glib/gstdio.h>
+#include <linux/btrfs_tree.h>
+#ifdef HAVE_SYSTEMD
+#include <systemd/sd-daemon.h>
+#endif
+
 #include "btd-utils.h"
 #include "btd-logging.h"
 #include "btd-mailer.h"
 #include "btd-filesystem.h"
 #include "btd-fs-record.h"
+#include "btd-scrub.h"
+#include "btd-cgroup.h"
+#include "btd-pressure.h"
+#include "btd-window.h"
+#include "btd-idle.h"
+#include "btd-balance.h"
+#include "btd-topology.h"
+#include "btd-tree-search.h"
 
 typedef struct {
     gboolean loaded;
     GPtrArray *mountpoints;
+    GHashTable *devno_map;
     GKeyFile *config;
     gchar *state_dir;
+    gchar *machine_id;
     time_t reference_time;
 
     gulong default_intervals[BTD_BTRFS_ACTION_LAST];
+
+    guint max_parallel;
+    guint max_controller_jobs;
+    GMutex resource_lock;
+    GCond resource_cond;
+    GHashTable *busy_resources;
+
+    gint heavy_jobs;
+    gboolean running;
+    GCancellable *cancellable;
+    gboolean persistent;
+
+    gboolean watch_kernel_log;
+    gboolean dynamic_timer;
+
+    GHashTable *records;
 } BtdSchedulerPrivate;
 
 G_DEFINE_TYPE_WITH_PRIVATE (BtdScheduler, btd_scheduler, G_TYPE_OBJECT)
@@ -35,6 +69,53 @@ G_DEFINE_TYPE_WITH_PRIVATE (BtdScheduler, btd_scheduler, G_TYPE_OBJECT)
 
 typedef gboolean (*BtdActionFunction) (BtdScheduler *, BtdFilesystem *, BtdFsRecord *);
 
+#define BTD_CONFIG_FNAME SYSCONFDIR "/btrfsd/settings.conf"
+
+/* file caching when the next action is due, so we can exit quickly if nothing is to be done */
+#define BTD_SCHEDULE_FNAME "next-run.schedule"
+
+/* number of filesystems to process concurrently, unless configured otherwise */
+#define BTD_DEFAULT_MAX_PARALLEL_JOBS 4
+
+/* number of I/O heavy actions allowed to run on disks behind the same controller, 0 for no limit */
+#define BTD_DEFAULT_MAX_CONTROLLER_JOBS 0
+
+/* interval in seconds at which cheap actions are rechecked while heavy actions are running */
+#define BTD_LIGHT_LANE_POLL_INTERVAL (5 * 60)
+
+/* time in seconds before an action that did not complete is attempted again, a bit less than the hourly timer */
+#define BTD_ACTION_RETRY_INTERVAL (55 * 60)
+
+/* seconds before an action that was skipped because of the machine's state is checked again */
+#define BTD_ACTION_POSTPONE_INTERVAL (10 * 60)
+
+/* time in seconds after which a heavy action waiting for the system to be idle runs anyway */
+#define BTD_DEFAULT_IDLE_MAX_DELAY SECONDS_IN_A_DAY
+
+/* time in seconds after which a heavy action waiting for sleeping disks to spin up runs anyway */
+#define BTD_DEFAULT_SPINUP_MAX_DELAY SECONDS_IN_A_WEEK
+
+/* seconds without any I/O after which a disk of unknown power state is assumed to be spun down */
+#define BTD_SPINDOWN_IDLE_GUESS (30 * 60)
+
+/* upper bound for the number of slices a rolling scrub pass may be split into */
+#define BTD_MAX_SCRUB_SLICES 1000
+
+/*
+ * Cheap actions like error checks run in the "light" lane, which must never
+ * wait for I/O heavy actions like scrub or balance in the "heavy" lane.
+ */
+typedef enum {
+    BTD_ACTION_LANE_LIGHT,
+    BTD_ACTION_LANE_HEAVY
+} BtdActionLane;
+
+typedef struct {
+    BtdFilesystem *bfs;
+    BtdFsRecord *record;
+    time_t reference_time;
+} BtdSchedulerJob;
+
 static void
 btd_scheduler_init (BtdScheduler *self)
 {
@@ -44,9 +125,29 @@ btd_scheduler_init (BtdScheduler *self)
     priv->config = g_key_file_new ();
     priv->state_dir = btd_get_state_dir ();
 
+    /* identifies this machine when spreading out action times across many hosts */
+    if (g_file_get_contents ("/etc/machine-id", &priv->machine_id, NULL, NULL))
+        g_strstrip (priv->machine_id);
+    else
+        priv->machine_id = g_strdup (g_get_host_name ());
+
     seconds_in_month = btd_parse_duration_string ("1M");
     for (guint i = 0; i < BTD_BTRFS_ACTION_LAST; i++)
         priv->default_intervals[i] = seconds_in_month;
+
+    priv->max_parallel = 1;
+    priv->max_controller_jobs = BTD_DEFAULT_MAX_CONTROLLER_JOBS;
+    g_mutex_init (&priv->resource_lock);
+    g_cond_init (&priv->resource_cond);
+    priv->busy_resources = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    priv->cancellable = g_cancellable_new ();
+
+    priv->records = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_object_unref);
+    priv->mountpoints = g_ptr_array_new_with_free_func (g_object_unref);
+    priv->devno_map = g_hash_table_new_full (g_direct_hash,
+                                             g_direct_equal,
+                                             NULL,
+                                             (GDestroyNotify) g_ptr_array_unref);
 }
 
 static void
@@ -56,9 +157,15 @@ btd_scheduler_finalize (GObject *object)
     BtdSchedulerPrivate *priv = GET_PRIVATE (self);
 
     g_free (priv->state_dir);
+    g_free (priv->machine_id);
     g_key_file_unref (priv->config);
-    if (priv->mountpoints != NULL)
-        g_ptr_array_unref (priv->mountpoints);
+    g_hash_table_unref (priv->busy_resources);
+    g_hash_table_unref (priv->records);
+    g_mutex_clear (&priv->resource_lock);
+    g_cond_clear (&priv->resource_cond);
+    g_object_unref (priv->cancellable);
+    g_hash_table_unref (priv->devno_map);
+    g_ptr_array_unref (priv->mountpoints);
 
     G_OBJECT_CLASS (btd_scheduler_parent_class)->finalize (object);
 }
@@ -88,7 +195,10 @@ btd_scheduler_new ()
 static gchar *
 btd_get_interval_key (BtdBtrfsAction action_kind)
 {
-    return g_strconcat (btd_btrfs_action_to_string (action_kind), "_interval", NULL);
+    gchar *key = g_strconcat (btd_btrfs_action_to_string (action_kind), "_interval", NULL);
+
+    /* configuration keys use underscores, e.g. "verify_recent_interval" */
+    return g_strdelimit (key, "-", '_');
 }
 
 static gulong
@@ -163,6 +273,457 @@ btd_scheduler_get_config_value (BtdScheduler *self,
     return g_steal_pointer (&value);
 }
 
+static gint64
+btd_scheduler_get_config_int (BtdScheduler *self,
+                              BtdFilesystem *bfs,
+                              const gchar *key,
+                              gint64 default_value)
+{
+    g_autofree gchar *value = NULL;
+    gchar *endptr = NULL;
+    gint64 result;
+
+    value = btd_scheduler_get_config_value (self, bfs, key, NULL);
+    if (value == NULL)
+        return default_value;
+    value = g_strstrip (value);
+
+    /* "off" disables a numeric filter */
+    if (btd_str_equal0 (value, "off"))
+        return -1;
+
+    result = g_ascii_strtoll (value, &endptr, 10);
+    if (endptr == value || *endptr != '\0') {
+        btd_warning ("Invalid value '%s' for %s on %s, using default.",
+                     value,
+                     key,
+                     btd_filesystem_get_mountpoint (bfs));
+        return default_value;
+    }
+
+    return result;
+}
+
+static gboolean
+btd_scheduler_get_config_bool (BtdScheduler *self,
+                               BtdFilesystem *bfs,
+                               const gchar *key,
+                               gboolean default_value)
+{
+    g_autofree gchar *value = NULL;
+
+    value = btd_scheduler_get_config_value (self, bfs, key, NULL);
+    if (value == NULL)
+        return default_value;
+    value = g_strstrip (value);
+
+    if (btd_str_equal0 (value, "true") || btd_str_equal0 (value, "1"))
+        return TRUE;
+    if (btd_str_equal0 (value, "false") || btd_str_equal0 (value, "0"))
+        return FALSE;
+
+    btd_warning ("Invalid value '%s' for %s on %s, using default.",
+                 value,
+                 key,
+                 btd_filesystem_get_mountpoint (bfs));
+    return default_value;
+}
+
+static gulong
+btd_scheduler_get_config_duration_value (BtdScheduler *self,
+                                         BtdFilesystem *bfs,
+                                         const gchar *key,
+                                         gulong default_value)
+{
+    g_autofree gchar *value = NULL;
+
+    /* durations may also be set for all filesystems in the default section */
+    value = btd_scheduler_get_config_value (self, bfs, key, NULL);
+    if (value == NULL)
+        return default_value;
+    return btd_parse_duration_string (g_strstrip (value));
+}
+
+static guint
+btd_scheduler_get_scrub_slices (BtdScheduler *self, BtdFilesystem *bfs)
+{
+    /* number of runs a full rolling scrub pass is split into */
+    return (guint) CLAMP (btd_scheduler_get_config_int (self, bfs, "scrub_slices", 1),
+                          1,
+                          BTD_MAX_SCRUB_SLICES);
+}
+
+static guint
+btd_scheduler_get_scrub_concurrency (BtdScheduler *self, BtdFilesystem *bfs)
+{
+    g_autoptr(BtdFsUsage) usage = NULL;
+    g_autofree gchar *value = NULL;
+    guint max_parallel;
+
+    /* an explicitly configured limit always wins over the profile-based choice */
+    value = btd_scheduler_get_config_value (self, bfs, "scrub_parallel_devices", NULL);
+    if (value != NULL && !btd_str_equal0 (g_strstrip (value), "auto")) {
+        gint64 limit = btd_scheduler_get_config_int (self, bfs, "scrub_parallel_devices", 0);
+        if (limit > 0)
+            return (guint) MIN (limit, G_MAXUINT);
+        if (limit < 0)
+            return 0;
+    }
+
+    usage = btd_filesystem_read_usage (bfs, NULL);
+    if (usage == NULL)
+        return 0;
+    max_parallel = btd_fs_usage_get_scrub_concurrency (usage);
+    if (max_parallel > 0)
+        btd_debug ("Filesystem %s uses a parity RAID profile, scrubbing %u device(s) at a time.",
+                   btd_filesystem_get_mountpoint (bfs),
+                   max_parallel);
+
+    return max_parallel;
+}
+
+static guint64
+btd_scheduler_get_scrub_speed_max (BtdScheduler *self, BtdFilesystem *bfs)
+{
+    g_autofree gchar *value = NULL;
+    guint64 speed_max;
+
+    value = btd_scheduler_get_config_value (self, bfs, "scrub_speed_max", NULL);
+    if (value == NULL)
+        return 0;
+    value = g_strstrip (value);
+
+    /* the limit is in bytes per second, so accept a "/s" suffix too */
+    if (g_str_has_suffix (value, "/s"))
+        value[strlen (value) - 2] = '\0';
+    speed_max = btd_parse_size_string (value);
+    if (speed_max == 0 && !btd_str_equal0 (value, "off") && !btd_str_equal0 (value, "0"))
+        btd_warning ("Invalid value '%s' for scrub_speed_max on %s, not limiting scrub speed.",
+                     value,
+                     btd_filesystem_get_mountpoint (bfs));
+
+    return speed_max;
+}
+
+static guint
+btd_scheduler_get_pressure_threshold (BtdScheduler *self, BtdFilesystem *bfs)
+{
+    g_autofree gchar *value = NULL;
+    gchar *endptr = NULL;
+    gint64 percentage;
+
+    value = btd_scheduler_get_config_value (self, bfs, "pause_on_io_pressure", NULL);
+    if (value == NULL)
+        return 0;
+    value = g_strstrip (value);
+    if (btd_str_equal0 (value, "off"))
+        return 0;
+
+    percentage = g_ascii_strtoll (value, &endptr, 10);
+    if (endptr == value || (*endptr != '\0' && !btd_str_equal0 (endptr, "%")) ||
+        percentage <= 0 || percentage > 100) {
+        btd_warning ("Invalid pause_on_io_pressure '%s' for %s, expected a percentage.",
+                     value,
+                     btd_filesystem_get_mountpoint (bfs));
+        return 0;
+    }
+
+    return (guint) percentage;
+}
+
+static BtdPressureMonitor *
+btd_scheduler_new_pressure_monitor (BtdFilesystem *bfs, guint threshold)
+{
+    g_autoptr(GError) error = NULL;
+    BtdPressureMonitor *pressure;
+
+    if (threshold == 0)
+        return NULL;
+
+    /* kernels without PSI support just don't get maintenance paused */
+    pressure = btd_pressure_monitor_new (threshold, &error);
+    if (pressure == NULL)
+        btd_debug ("Not watching I/O pressure for %s: %s",
+                   btd_filesystem_get_mountpoint (bfs),
+                   error->message);
+    return pressure;
+}
+
+static BtdWindow *
+btd_scheduler_get_action_window (BtdScheduler *self, BtdFilesystem *bfs, BtdBtrfsAction action)
+{
+    g_autoptr(GError) error = NULL;
+    g_autofree gchar *key = NULL;
+    g_autofree gchar *value = NULL;
+    BtdWindow *window;
+
+    /* configuration keys use underscores, e.g. "verify_recent_window" */
+    key = g_strconcat (btd_btrfs_action_to_string (action), "_window", NULL);
+    g_strdelimit (key, "-", '_');
+    value = btd_scheduler_get_config_value (self, bfs, key, NULL);
+    if (value == NULL)
+        return NULL;
+
+    window = btd_window_parse (value, &error);
+    if (window == NULL)
+        btd_warning ("Ignoring %s for %s: %s",
+                     key,
+                     btd_filesystem_get_mountpoint (bfs),
+                     error->message);
+    return window;
+}
+
+static gint64
+btd_scheduler_get_window_max_runtime (BtdScheduler *self,
+                                      BtdFilesystem *bfs,
+                                      BtdBtrfsAction action,
+                                      gint64 max_runtime)
+{
+    g_autoptr(BtdWindow) window = NULL;
+    g_autoptr(GDateTime) now = NULL;
+    gint64 remaining;
+
+    /* stop the action when its maintenance window closes, it is resumed in the next one */
+    window = btd_scheduler_get_action_window (self, bfs, action);
+    if (window == NULL)
+        return max_runtime;
+    now = g_date_time_new_now_local ();
+    remaining = btd_window_get_time_to_close (window, now);
+    if (remaining < 0)
+        return max_runtime;
+
+    return max_runtime > 0 ? MIN (max_runtime, MAX (remaining, 1)) : MAX (remaining, 1);
+}
+
+static time_t
+btd_scheduler_get_due_time (BtdScheduler *self,
+                            BtdFilesystem *bfs,
+                            BtdFsRecord *record,
+                            BtdBtrfsAction action,
+                            gint64 last_time,
+                            time_t interval_time)
+{
+    BtdSchedulerPrivate *priv = GET_PRIVATE (self);
+    g_autofree gchar *key = NULL;
+    time_t due_time = (time_t) last_time + interval_time;
+    gint64 first_time;
+    gint64 spread;
+    gint64 offset;
+
+    spread = MIN (
+        (gint64) btd_scheduler_get_config_duration_value (self, bfs, "schedule_spread", 0),
+        (gint64) interval_time);
+    if (spread <= 0)
+        return due_time;
+
+    /* align the due time to a host-specific phase within the spread window */
+    key = g_strdup_printf ("%s:%s:%s",
+                           priv->machine_id,
+                           btd_filesystem_get_fsid (bfs) != NULL
+                               ? btd_filesystem_get_fsid (bfs)
+                               : btd_filesystem_get_mountpoint (bfs),
+                           btd_btrfs_action_to_string (action));
+    offset = (gint64) btd_get_stable_offset (key, (guint64) spread);
+    if (last_time != 0)
+        return (time_t) btd_get_phased_due_time (last_time,
+                                                 (gint64) interval_time,
+                                                 spread,
+                                                 offset);
+
+    /* actions that never ran are due at the next phase point, unless that was already planned */
+    first_time = btd_fs_record_get_value_int (record,
+                                              "first-run",
+                                              btd_btrfs_action_to_string (action),
+                                              0);
+    if (first_time > 0)
+        return (time_t) first_time;
+    return priv->reference_time +
+           ((offset - (gint64) priv->reference_time) % spread + spread) % spread;
+}
+
+static gboolean
+btd_scheduler_action_window_is_open (BtdScheduler *self,
+                                     BtdFilesystem *bfs,
+                                     BtdBtrfsAction action)
+{
+    g_autoptr(BtdWindow) window = NULL;
+    g_autoptr(GDateTime) now = NULL;
+
+    window = btd_scheduler_get_action_window (self, bfs, action);
+    if (window == NULL)
+        return TRUE;
+    now = g_date_time_new_now_local ();
+    return btd_window_is_open (window, now);
+}
+
+static gulong
+btd_scheduler_get_adaptive_scrub_interval (BtdScheduler *self,
+                                           BtdFilesystem *bfs,
+                                           BtdFsRecord *record,
+                                           gulong interval)
+{
+    gulong max_interval;
+    gint64 clean_passes;
+
+    /* the interval only adapts to the health of the filesystem if it may be stretched */
+    max_interval = btd_scheduler_get_config_duration_value (self, bfs, "scrub_interval_max", 0);
+    if (record == NULL || max_interval <= interval)
+        return interval;
+
+    clean_passes = btd_fs_record_get_value_int (record, "scrub-health", "clean_runs", 0) /
+                   btd_scheduler_get_scrub_slices (self, bfs);
+    return btd_get_adaptive_interval (
+        interval,
+        max_interval,
+        clean_passes,
+        btd_fs_record_get_value_int (record, "scrub-health", "last_issue", 0) > 0);
+}
+
+static gulong
+btd_scheduler_get_action_period (BtdScheduler *self,
+                                 BtdFilesystem *bfs,
+                                 BtdFsRecord *record,
+                                 BtdBtrfsAction action_kind)
+{
+    gulong interval;
+
+    interval = btd_scheduler_get_config_duration_for_action (self, bfs, action_kind);
+    if (interval == 0 || action_kind != BTD_BTRFS_ACTION_SCRUB)
+        return interval;
+    interval = btd_scheduler_get_adaptive_scrub_interval (self, bfs, record, interval);
+
+    /* a rolling scrub runs once per slice, to cover every device once per interval */
+    return MAX (interval / btd_scheduler_get_scrub_slices (self, bfs), 1);
+}
+
+static gint
+btd_filesystem_compare (gconstpointer fs_a, gconstpointer fs_b)
+{
+    const gchar *mount_a = btd_filesystem_get_mountpoint (
+        BTD_FILESYSTEM (*(BtdFilesystem **) fs_a));
+    const gchar *mount_b = btd_filesystem_get_mountpoint (
+        BTD_FILESYSTEM (*(BtdFilesystem **) fs_b));
+
+    return g_strcmp0 (mount_a, mount_b);
+}
+
+static void
+btd_scheduler_add_filesystem (BtdScheduler *self, BtdFilesystem *bfs)
+{
+    BtdSchedulerPrivate *priv = GET_PRIVATE (self);
+    dev_t devno = btd_filesystem_get_devno (bfs);
+    GPtrArray *aliases;
+
+    g_ptr_array_add (priv->mountpoints, g_object_ref (bfs));
+
+    /* resolve the fsid now, so worker threads only ever read it */
+    btd_filesystem_get_fsid (bfs);
+
+    aliases = g_hash_table_lookup (priv->devno_map, GUINT_TO_POINTER (devno));
+    if (aliases == NULL) {
+        aliases = g_ptr_array_new_with_free_func (g_object_unref);
+        g_hash_table_insert (priv->devno_map, GUINT_TO_POINTER (devno), aliases);
+    }
+    g_ptr_array_add (aliases, g_object_ref (bfs));
+    g_ptr_array_sort (aliases, btd_filesystem_compare);
+}
+
+static GPtrArray *
+btd_scheduler_get_unique_filesystems (BtdScheduler *self)
+{
+    BtdSchedulerPrivate *priv = GET_PRIVATE (self);
+    GPtrArray *filesystems = g_ptr_array_new ();
+    GHashTableIter ht_iter;
+    gpointer ht_value;
+
+    /* act on the first mountpoint of every filesystem, all others are just aliases */
+    g_hash_table_iter_init (&ht_iter, priv->devno_map);
+    while (g_hash_table_iter_next (&ht_iter, NULL, &ht_value))
+        g_ptr_array_add (filesystems, g_ptr_array_index ((GPtrArray *) ht_value, 0));
+
+    /* sort to get a predictable order */
+    g_ptr_array_sort (filesystems, btd_filesystem_compare);
+
+    return filesystems;
+}
+
+static void
+btd_scheduler_remove_filesystem (BtdScheduler *self, BtdFilesystem *bfs)
+{
+    BtdSchedulerPrivate *priv = GET_PRIVATE (self);
+    dev_t devno = btd_filesystem_get_devno (bfs);
+    GPtrArray *aliases;
+
+    /* the record can not be in use, as mounts only change while no actions are running */
+    g_hash_table_remove (priv->records, btd_filesystem_get_mountpoint (bfs));
+
+    aliases = g_hash_table_lookup (priv->devno_map, GUINT_TO_POINTER (devno));
+    if (aliases != NULL) {
+        g_ptr_array_remove (aliases, bfs);
+        if (aliases->len == 0)
+            g_hash_table_remove (priv->devno_map, GUINT_TO_POINTER (devno));
+    }
+
+    g_ptr_array_remove (priv->mountpoints, bfs);
+}
+
+static BtdFilesystem *
+btd_scheduler_find_filesystem (GPtrArray *filesystems, BtdFilesystem *bfs)
+{
+    for (guint i = 0; i < filesystems->len; i++) {
+        BtdFilesystem *other = g_ptr_array_index (filesystems, i);
+        if (btd_filesystem_get_devno (other) == btd_filesystem_get_devno (bfs) &&
+            btd_str_equal0 (btd_filesystem_get_mountpoint (other),
+                            btd_filesystem_get_mountpoint (bfs)))
+            return other;
+    }
+
+    return NULL;
+}
+
+/**
+ * btd_scheduler_refresh_mounts:
+ * @self: An instance of #BtdScheduler
+ * @error: A #GError
+ *
+ * Re-read the mount table and update the set of known filesystems
+ * in place, adding new and dropping unmounted Btrfs filesystems.
+ *
+ * Returns: %TRUE on success.
+ */
+gboolean
+btd_scheduler_refresh_mounts (BtdScheduler *self, GError **error)
+{
+    BtdSchedulerPrivate *priv = GET_PRIVATE (self);
+    g_autoptr(GPtrArray) current = NULL;
+    g_autoptr(GPtrArray) removed = g_ptr_array_new_with_free_func (g_object_unref);
+
+    current = btd_find_mounted_btrfs_filesystems (error);
+    if (current == NULL)
+        return FALSE;
+
+    for (guint i = 0; i < priv->mountpoints->len; i++) {
+        BtdFilesystem *bfs = g_ptr_array_index (priv->mountpoints, i);
+        if (btd_scheduler_find_filesystem (current, bfs) == NULL)
+            g_ptr_array_add (removed, g_object_ref (bfs));
+    }
+    for (guint i = 0; i < removed->len; i++) {
+        BtdFilesystem *bfs = g_ptr_array_index (removed, i);
+        btd_debug ("Filesystem at %s was unmounted", btd_filesystem_get_mountpoint (bfs));
+        btd_scheduler_remove_filesystem (self, bfs);
+    }
+
+    for (guint i = 0; i < current->len; i++) {
+        BtdFilesystem *bfs = g_ptr_array_index (current, i);
+        if (btd_scheduler_find_filesystem (priv->mountpoints, bfs) != NULL)
+            continue;
+        btd_debug ("Found newly mounted filesystem at %s", btd_filesystem_get_mountpoint (bfs));
+        btd_scheduler_add_filesystem (self, bfs);
+    }
+
+    return TRUE;
+}
+
 /**
  * btd_scheduler_load:
  * @self: An instance of #BtdScheduler
@@ -176,7 +737,8 @@ gboolean
 btd_scheduler_load (BtdScheduler *self, GError **error)
 {
     BtdSchedulerPrivate *priv = GET_PRIVATE (self);
-    const gchar *config_fname = SYSCONFDIR "/btrfsd/settings.conf";
+    const gchar *config_fname = BTD_CONFIG_FNAME;
+    g_autoptr(GKeyFile) config = g_key_file_new ();
     GError *tmp_error = NULL;
 
     if (priv->loaded) {
@@ -192,19 +754,18 @@ btd_scheduler_load (BtdScheduler *self, GError **error)
      * called us, so we for sure run all remaining tasks if we are called again in an hour. */
     priv->reference_time = time (NULL) - 60;
 
-    if (priv->mountpoints != NULL)
-        g_ptr_array_unref (priv->mountpoints);
-    priv->mountpoints = btd_find_mounted_btrfs_filesystems (error);
-    if (priv->mountpoints == NULL)
+    if (!btd_scheduler_refresh_mounts (self, error))
         return FALSE;
 
     if (g_file_test (config_fname, G_FILE_TEST_EXISTS)) {
-        if (!g_key_file_load_from_file (priv->config, config_fname, G_KEY_FILE_NONE, &tmp_error)) {
+        if (!g_key_file_load_from_file (config, config_fname, G_KEY_FILE_NONE, &tmp_error)) {
             g_propagate_prefixed_error (error, tmp_error, "Failed to load configuration:");
             return FALSE;
         }
         btd_debug ("Loaded configuration: %s", config_fname);
     }
+    g_key_file_unref (priv->config);
+    priv->config = g_steal_pointer (&config);
 
     priv->default_intervals[BTD_BTRFS_ACTION_SCRUB] = btd_scheduler_get_config_duration_str (
         self,
@@ -221,11 +782,67 @@ btd_scheduler_load (BtdScheduler *self, GError **error)
         "default",
         btd_get_interval_key (BTD_BTRFS_ACTION_BALANCE),
         "never");
+    priv->default_intervals[BTD_BTRFS_ACTION_VERIFY_RECENT] = btd_scheduler_get_config_duration_str (
+        self,
+        "default",
+        btd_get_interval_key (BTD_BTRFS_ACTION_VERIFY_RECENT),
+        "never");
+    priv->default_intervals[BTD_BTRFS_ACTION_METADATA_SCRUB] = btd_scheduler_get_config_duration_str (
+        self,
+        "default",
+        btd_get_interval_key (BTD_BTRFS_ACTION_METADATA_SCRUB),
+        "never");
+
+    priv->max_parallel = CLAMP (
+        g_key_file_get_integer (priv->config, "default", "max_parallel_jobs", NULL),
+        0,
+        64);
+    if (priv->max_parallel == 0)
+        priv->max_parallel = BTD_DEFAULT_MAX_PARALLEL_JOBS;
+    priv->max_controller_jobs = BTD_DEFAULT_MAX_CONTROLLER_JOBS;
+    if (g_key_file_has_key (priv->config, "default", "max_jobs_per_controller", NULL))
+        priv->max_controller_jobs = MAX (
+            g_key_file_get_integer (priv->config, "default", "max_jobs_per_controller", NULL),
+            0);
+
+    priv->watch_kernel_log = TRUE;
+    if (g_key_file_has_key (priv->config, "default", "watch_kernel_log", NULL))
+        priv->watch_kernel_log = g_key_file_get_boolean (priv->config,
+                                                         "default",
+                                                         "watch_kernel_log",
+                                                         NULL);
+
+    priv->dynamic_timer = g_key_file_get_boolean (priv->config, "default", "dynamic_timer", NULL);
 
     priv->loaded = TRUE;
     return TRUE;
 }
 
+/**
+ * btd_scheduler_reload:
+ * @self: An instance of #BtdScheduler
+ * @error: A #GError
+ *
+ * Reload configuration and the list of mounted filesystems.
+ * State records that were already loaded are kept.
+ * If the new configuration can not be loaded, the previous one stays active.
+ *
+ * Returns: %TRUE on success.
+ */
+gboolean
+btd_scheduler_reload (BtdScheduler *self, GError **error)
+{
+    BtdSchedulerPrivate *priv = GET_PRIVATE (self);
+
+    priv->loaded = FALSE;
+    if (!btd_scheduler_load (self, error)) {
+        priv->loaded = TRUE;
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
 static gboolean
 btd_scheduler_send_error_mail (BtdScheduler *self,
                                BtdFilesystem *bfs,
@@ -240,6 +857,7 @@ btd_scheduler_send_error_mail (BtdScheduler *self,
     g_autofree gchar *formatted_time = NULL;
     g_autofree gchar *mail_body = NULL;
     g_autofree gchar *fs_usage = NULL;
+    g_autoptr(BtdFsUsage) usage = NULL;
     g_autoptr(GError) error = NULL;
     g_autoptr(GDateTime) dt_now = g_date_time_new_now_local ();
     time_t time_last_mail;
@@ -267,9 +885,11 @@ btd_scheduler_send_error_mail (BtdScheduler *self,
         return FALSE;
     }
 
-    fs_usage = btd_filesystem_read_usage (bfs, NULL);
-    if (fs_usage == NULL)
+    usage = btd_filesystem_read_usage (bfs, NULL);
+    if (usage == NULL)
         fs_usage = g_strdup ("⚠ Failed to read usage data.");
+    else
+        fs_usage = btd_fs_usage_to_text (usage);
     mail_body = btd_render_template (g_bytes_get_data (template_bytes, NULL),
                                      "mail_from",
                                      mail_from,
@@ -296,6 +916,72 @@ btd_scheduler_send_error_mail (BtdScheduler *self,
     return TRUE;
 }
 
+static void
+btd_scheduler_record_scrub_health (BtdFsRecord *record, gboolean clean)
+{
+    /* consecutive clean scrub runs since the last issue drive the adaptive scrub interval */
+    if (clean) {
+        btd_fs_record_set_value_int (
+            record,
+            "scrub-health",
+            "clean_runs",
+            btd_fs_record_get_value_int (record, "scrub-health", "clean_runs", 0) + 1);
+    } else {
+        btd_fs_record_set_value_int (record, "scrub-health", "clean_runs", 0);
+        btd_fs_record_set_value_int (record, "scrub-health", "last_issue", (gint64) time (NULL));
+    }
+}
+
+/**
+ * btd_scheduler_sample_disk_activity:
+ * @record: The #BtdFsRecord of the filesystem
+ * @disk: The disk to sample
+ * @now: The current time
+ *
+ * Remember when @disk was last seen doing I/O, so we can guess whether it is
+ * spun down if we can't ask it directly. This is sampled by every error check
+ * as well, so there is a history to compare against once a heavy action is due.
+ *
+ * Returns: UNIX timestamp of the last change in I/O activity, or 0 if unknown.
+ */
+static gint64
+btd_scheduler_sample_disk_activity (BtdFsRecord *record, BtdDisk *disk, gint64 now)
+{
+    g_autofree gchar *changed_key = g_strconcat (disk->name, "_changed", NULL);
+    gint64 changed_time;
+    guint64 io_count;
+
+    if (!btd_idle_read_disk_io_count (disk, &io_count))
+        return 0;
+
+    changed_time = btd_fs_record_get_value_int (record, "disk-activity", changed_key, 0);
+    if (changed_time == 0 ||
+        btd_fs_record_get_value_int (record, "disk-activity", disk->name, -1) !=
+            (gint64) io_count) {
+        btd_fs_record_set_value_int (record, "disk-activity", disk->name, (gint64) io_count);
+        btd_fs_record_set_value_int (record, "disk-activity", changed_key, now);
+        changed_time = now;
+    }
+
+    return changed_time;
+}
+
+/**
+ * btd_scheduler_request_error_check:
+ * @record: The #BtdFsRecord of the filesystem
+ *
+ * Make the stats action due immediately, so errors found by a scrub are
+ * broadcast and mailed like any other filesystem errors.
+ */
+static void
+btd_scheduler_request_error_check (BtdFsRecord *record)
+{
+    btd_fs_record_set_value_int (record,
+                                 "times",
+                                 btd_btrfs_action_to_string (BTD_BTRFS_ACTION_STATS),
+                                 0);
+}
+
 static gboolean
 btd_scheduler_run_stats (BtdScheduler *self, BtdFilesystem *bfs, BtdFsRecord *record)
 {
@@ -308,6 +994,16 @@ btd_scheduler_run_stats (BtdScheduler *self, BtdFilesystem *bfs, BtdFsRecord *re
 
     btd_debug ("Reading stats for %s", btd_filesystem_get_mountpoint (bfs));
 
+    /* track disk activity between heavy actions, to tell whether disks have spun down */
+    if (btd_scheduler_get_config_bool (self, bfs, "avoid_spinup", FALSE)) {
+        g_autoptr(GPtrArray) disks = btd_topology_get_disks (bfs);
+        for (guint i = 0; i < disks->len; i++) {
+            BtdDisk *disk = g_ptr_array_index (disks, i);
+            if (disk->rotational)
+                btd_scheduler_sample_disk_activity (record, disk, (gint64) time (NULL));
+        }
+    }
+
     mail_address = btd_scheduler_get_config_value (self, bfs, "mail_address", NULL);
     if (mail_address != NULL)
         mail_address = g_strstrip (mail_address);
@@ -324,7 +1020,12 @@ btd_scheduler_run_stats (BtdScheduler *self, BtdFilesystem *bfs, BtdFsRecord *re
         btd_fs_record_set_value_int (record, "errors", "total", 0);
         return TRUE;
     }
-    prev_error_count = btd_fs_record_get_value_int (record, "errors", "total", 0);
+    /* errors that were already there when we first looked at the filesystem are no new issue */
+    if (btd_fs_record_get_value_int (record, "errors", "total", -1) >= 0) {
+        prev_error_count = btd_fs_record_get_value_int (record, "errors", "total", 0);
+        if (error_count > prev_error_count)
+            btd_scheduler_record_scrub_health (record, FALSE);
+    }
     btd_fs_record_set_value_int (record, "errors", "total", (gint64) error_count);
 
     btd_debug ("Found %" G_GUINT64_FORMAT " errors for %s",
@@ -362,91 +1063,1401 @@ btd_scheduler_run_stats (BtdScheduler *self, BtdFilesystem *bfs, BtdFsRecord *re
 }
 
 static gboolean
-btd_scheduler_run_scrub (BtdScheduler *self, BtdFilesystem *bfs, BtdFsRecord *record)
+btd_scheduler_spawn_quiet (const gchar **argv)
 {
     g_autoptr(GError) error = NULL;
-
-    btd_debug ("Running scrub on filesystem %s", btd_filesystem_get_mountpoint (bfs));
-    if (!btd_filesystem_scrub (bfs, &error)) {
-        btd_warning ("Scrub on %s failed: %s", btd_filesystem_get_mountpoint (bfs), error->message);
+    g_autofree gchar *cmd_stderr = NULL;
+    gint exit_status;
+
+    if (!g_spawn_sync (NULL,
+                       (gchar **) argv,
+                       NULL,
+                       G_SPAWN_SEARCH_PATH | G_SPAWN_STDOUT_TO_DEV_NULL,
+                       NULL,
+                       NULL,
+                       NULL,
+                       &cmd_stderr,
+                       &exit_status,
+                       &error)) {
+        btd_debug ("Failed to run %s: %s", argv[0], error->message);
+        return FALSE;
+    }
+    if (!g_spawn_check_wait_status (exit_status, &error)) {
+        btd_debug ("%s failed: %s", argv[0], btd_strstripnl (cmd_stderr));
         return FALSE;
     }
 
     return TRUE;
 }
 
-static gboolean
-btd_scheduler_run_balance (BtdScheduler *self, BtdFilesystem *bfs, BtdFsRecord *record)
+static gchar *
+btd_get_scrub_device_group (guint64 devid)
 {
-    g_autoptr(GError) error = NULL;
+    return g_strdup_printf ("scrub-device-%" G_GUINT64_FORMAT, devid);
+}
 
-    btd_debug ("Running balance on filesystem %s", btd_filesystem_get_mountpoint (bfs));
-    if (!btd_filesystem_balance (bfs, &error)) {
-        btd_warning ("Balance on %s failed: %s",
-                     btd_filesystem_get_mountpoint (bfs),
-                     error->message);
-        return FALSE;
+static void
+btd_scheduler_record_scrub_results (BtdFsRecord *record, GPtrArray *scrub_devices)
+{
+    for (guint i = 0; i < scrub_devices->len; i++) {
+        BtdScrubDevice *sdev = g_ptr_array_index (scrub_devices, i);
+        g_autofree gchar *group = btd_get_scrub_device_group (sdev->devid);
+        g_autofree gchar *bytes_str = g_format_size_full (sdev->bytes_scrubbed,
+                                                          G_FORMAT_SIZE_IEC_UNITS);
+        g_autofree gchar *rate_str = NULL;
+        g_autofree gchar *time_str = NULL;
+        gint64 duration_sec = sdev->duration / G_USEC_PER_SEC;
+
+        btd_fs_record_set_value_int (record, group, "bytes_scrubbed", sdev->bytes_scrubbed);
+        btd_fs_record_set_value_int (record, group, "read_errors", sdev->read_errors);
+        btd_fs_record_set_value_int (record, group, "csum_errors", sdev->csum_errors);
+        btd_fs_record_set_value_int (record, group, "verify_errors", sdev->verify_errors);
+        btd_fs_record_set_value_int (record, group, "corrected_errors", sdev->corrected_errors);
+        btd_fs_record_set_value_int (record,
+                                     group,
+                                     "uncorrectable_errors",
+                                     sdev->uncorrectable_errors);
+        btd_fs_record_set_value_int (record, group, "duration", duration_sec);
+
+        rate_str = g_format_size_full (sdev->bytes_scrubbed / MAX (duration_sec, 1),
+                                       G_FORMAT_SIZE_IEC_UNITS);
+        time_str = btd_humanize_time (MAX (duration_sec, 1));
+        btd_info ("Scrubbed %s of %s in %s (%s/s), %" G_GUINT64_FORMAT " errors, %" G_GUINT64_FORMAT
+                  " corrected",
+                  bytes_str,
+                  sdev->path,
+                  time_str,
+                  rate_str,
+                  btd_scrub_device_get_error_count (sdev),
+                  sdev->corrected_errors);
+    }
+}
+
+static void
+btd_scheduler_select_scrub_range (BtdFsRecord *record, GPtrArray *scrub_devices, guint slices)
+{
+    for (guint i = 0; i < scrub_devices->len; i++) {
+        BtdScrubDevice *sdev = g_ptr_array_index (scrub_devices, i);
+        g_autofree gchar *group = btd_get_scrub_device_group (sdev->devid);
+        gint64 cursor;
+
+        if (sdev->device_size == 0)
+            continue;
+
+        /* start where the previous scrub stopped, wrapping around if the device shrunk */
+        cursor = btd_fs_record_get_value_int (record, group, "cursor", 0);
+        if (cursor < 0 || (guint64) cursor >= sdev->device_size)
+            cursor = 0;
+        sdev->start = (guint64) cursor;
+
+        /* in rolling mode, only scrub the next slice of the device */
+        if (slices > 1) {
+            guint64 slice_len = sdev->device_size / slices +
+                                (sdev->device_size % slices > 0 ? 1 : 0);
+            sdev->end = MIN (sdev->start + slice_len, sdev->device_size);
+        }
+
+        /* estimate the allocated bytes within this range, for progress reporting */
+        sdev->size = (guint64) ((gdouble) sdev->size *
+                                (gdouble) (MIN (sdev->end, sdev->device_size) - sdev->start) /
+                                (gdouble) sdev->device_size);
+    }
+}
+
+static void
+btd_scheduler_scrub_checkpoint_cb (GPtrArray *scrub_devices, gpointer user_data)
+{
+    BtdFsRecord *record = BTD_FS_RECORD (user_data);
+    g_autoptr(GError) error = NULL;
+
+    /* persist the position of running scrubs, so we can resume after a crash or reboot */
+    for (guint i = 0; i < scrub_devices->len; i++) {
+        BtdScrubDevice *sdev = g_ptr_array_index (scrub_devices, i);
+        g_autofree gchar *group = NULL;
+
+        if (sdev->finished || sdev->device_size == 0 || sdev->last_physical <= sdev->start)
+            continue;
+        group = btd_get_scrub_device_group (sdev->devid);
+        btd_fs_record_set_value_int (record, group, "cursor", (gint64) sdev->last_physical);
+    }
+
+    if (!btd_fs_record_save (record, &error))
+        btd_warning ("Unable to checkpoint scrub position for mount '%s': %s",
+                     btd_fs_record_get_mountpoint (record),
+                     error->message);
+}
+
+static gboolean
+btd_scheduler_advance_scrub_cursors (BtdFilesystem *bfs,
+                                     BtdFsRecord *record,
+                                     GPtrArray *scrub_devices)
+{
+    gboolean interrupted = FALSE;
+
+    for (guint i = 0; i < scrub_devices->len; i++) {
+        BtdScrubDevice *sdev = g_ptr_array_index (scrub_devices, i);
+        g_autofree gchar *group = btd_get_scrub_device_group (sdev->devid);
+        guint64 cursor;
+
+        /* retry the same range next time if it could not be scrubbed */
+        if (sdev->device_size == 0 || sdev->error_code != 0)
+            continue;
+
+        if (sdev->interrupted) {
+            /* resume from the last position the kernel reached */
+            interrupted = TRUE;
+            btd_fs_record_set_value_int (record,
+                                         group,
+                                         "cursor",
+                                         (gint64) MAX (sdev->start, sdev->last_physical));
+            continue;
+        }
+
+        /* chunks crossing the range end are scrubbed whole, so continue after the last one */
+        cursor = MAX (sdev->end, sdev->last_physical);
+        if (cursor >= sdev->device_size) {
+            cursor = 0;
+            btd_fs_record_set_value_int (record, group, "pass_completed", (gint64) time (NULL));
+            btd_debug ("Completed scrub pass of %s on %s",
+                       sdev->path,
+                       btd_filesystem_get_mountpoint (bfs));
+        }
+        btd_fs_record_set_value_int (record, group, "cursor", (gint64) cursor);
+    }
+
+    return !interrupted;
+}
+
+static gchar *
+btd_scheduler_get_scrub_job_fname (BtdScheduler *self, BtdFilesystem *bfs)
+{
+    BtdSchedulerPrivate *priv = GET_PRIVATE (self);
+    g_autofree gchar *basename = NULL;
+
+    basename = btd_path_to_filename (btd_filesystem_get_mountpoint (bfs));
+    return g_strconcat (priv->state_dir, "/", basename, ".scrub-job", NULL);
+}
+
+static gboolean
+btd_scheduler_has_scrub_job (BtdScheduler *self, BtdFilesystem *bfs)
+{
+    g_autofree gchar *job_fname = btd_scheduler_get_scrub_job_fname (self, bfs);
+    return g_file_test (job_fname, G_FILE_TEST_EXISTS);
+}
+
+static gchar *
+btd_scheduler_get_scrub_unit_name (BtdFilesystem *bfs)
+{
+    return g_strconcat ("btrfsd-scrub-", btd_filesystem_get_fsid (bfs), NULL);
+}
+
+static gboolean
+btd_scheduler_finish_scrub (BtdFilesystem *bfs, BtdFsRecord *record, GPtrArray *scrub_devices)
+{
+    guint64 scrub_errors = 0;
+    guint64 corrected_errors = 0;
+    gboolean completed;
+
+    btd_scheduler_record_scrub_results (record, scrub_devices);
+    completed = btd_scheduler_advance_scrub_cursors (bfs, record, scrub_devices);
+    btd_fs_record_set_value_int (record, "scrub", "interrupted", completed ? 0 : 1);
+
+    for (guint i = 0; i < scrub_devices->len; i++) {
+        BtdScrubDevice *sdev = g_ptr_array_index (scrub_devices, i);
+        scrub_errors += btd_scrub_device_get_error_count (sdev);
+        corrected_errors += sdev->corrected_errors;
+    }
+    if (scrub_errors > 0 || corrected_errors > 0)
+        btd_scheduler_record_scrub_health (record, FALSE);
+    else if (completed)
+        btd_scheduler_record_scrub_health (record, TRUE);
+    if (scrub_errors > 0) {
+        btd_warning ("Scrub found %" G_GUINT64_FORMAT " errors on %s",
+                     scrub_errors,
+                     btd_filesystem_get_mountpoint (bfs));
+        btd_scheduler_request_error_check (record);
+    }
+
+    return completed;
+}
+
+/**
+ * btd_scheduler_get_detached_scrub_limits:
+ * @self: An instance of #BtdScheduler
+ * @bfs: The filesystem to scrub
+ * @limits: (out caller-allocates): Receives the configured limits
+ *
+ * Read the cgroup limits for the unit of a detached scrub. Everything we run
+ * ourselves shares the cgroup of the btrfsd service, as the io and memory
+ * controllers can't be applied to individual threads.
+ */
+static void
+btd_scheduler_get_detached_scrub_limits (BtdScheduler *self,
+                                         BtdFilesystem *bfs,
+                                         BtdCgroupLimits *limits)
+{
+    const gchar *size_keys[] = { "scrub_detached_memory_high",
+                                 "scrub_detached_io_read_max",
+                                 "scrub_detached_io_write_max",
+                                 NULL };
+    guint64 *size_values[] = { &limits->memory_high,
+                               &limits->io_read_max,
+                               &limits->io_write_max };
+
+    memset (limits, 0, sizeof (*limits));
+    limits->io_weight = (guint) CLAMP (
+        btd_scheduler_get_config_int (self, bfs, "scrub_detached_io_weight", 0),
+        0,
+        10000);
+    limits->cpu_weight = (guint) CLAMP (
+        btd_scheduler_get_config_int (self, bfs, "scrub_detached_cpu_weight", 0),
+        0,
+        10000);
+
+    for (guint i = 0; size_keys[i] != NULL; i++) {
+        g_autofree gchar *value = btd_scheduler_get_config_value (self, bfs, size_keys[i], NULL);
+        if (value == NULL)
+            continue;
+        *size_values[i] = btd_parse_size_string (g_strstrip (value));
+        if (*size_values[i] == 0 && !btd_str_equal0 (value, "off"))
+            btd_warning ("Invalid value '%s' for %s on %s, ignoring it.",
+                         value,
+                         size_keys[i],
+                         btd_filesystem_get_mountpoint (bfs));
+    }
+}
+
+static gboolean
+btd_scheduler_spawn_detached_scrub (BtdFilesystem *bfs,
+                                    const gchar *job_fname,
+                                    GPtrArray *unit_args)
+{
+    g_autoptr(GPtrArray) run_argv = NULL;
+    g_autofree gchar *exe_path = NULL;
+    g_autofree gchar *unit_name = NULL;
+
+#ifdef HAVE_SYSTEMD
+    if (sd_booted () <= 0)
+        return FALSE;
+#else
+    return FALSE;
+#endif
+    if (btd_filesystem_get_fsid (bfs) == NULL)
+        return FALSE;
+
+    exe_path = g_file_read_link ("/proc/self/exe", NULL);
+    if (exe_path == NULL)
+        return FALSE;
+
+    /* run the scrub in its own transient unit, so it survives us exiting and has its own cgroup */
+    unit_name = btd_scheduler_get_scrub_unit_name (bfs);
+    run_argv = g_ptr_array_new_with_free_func (g_free);
+    g_ptr_array_add (run_argv, g_strdup ("systemd-run"));
+    g_ptr_array_add (run_argv, g_strdup ("--quiet"));
+    g_ptr_array_add (run_argv, g_strdup ("--collect"));
+    g_ptr_array_add (run_argv, g_strconcat ("--unit=", unit_name, NULL));
+    g_ptr_array_add (run_argv, g_strdup ("--property=Type=exec"));
+    g_ptr_array_add (run_argv, g_strdup ("--property=IOSchedulingClass=idle"));
+    g_ptr_array_add (run_argv, g_strdup ("--property=CPUSchedulingPolicy=idle"));
+    for (guint i = 0; i < unit_args->len; i++)
+        g_ptr_array_add (run_argv, g_strdup (g_ptr_array_index (unit_args, i)));
+    g_ptr_array_add (run_argv, g_steal_pointer (&exe_path));
+    g_ptr_array_add (run_argv, g_strconcat ("--scrub-job=", job_fname, NULL));
+    g_ptr_array_add (run_argv, NULL);
+
+    return btd_scheduler_spawn_quiet ((const gchar **) run_argv->pdata);
+}
+
+static gboolean
+btd_scheduler_detached_scrub_is_running (BtdFilesystem *bfs, GPtrArray *scrub_devices)
+{
+    g_autofree gchar *unit_name = NULL;
+
+    if (btd_scrub_is_running (bfs, scrub_devices))
+        return TRUE;
+
+    /* the helper may not have started scrubbing yet, or not written its results */
+    if (btd_filesystem_get_fsid (bfs) == NULL)
+        return FALSE;
+    unit_name = btd_scheduler_get_scrub_unit_name (bfs);
+    {
+        const gchar *argv[] = { "systemctl", "is-active", "--quiet", unit_name, NULL };
+        return btd_scheduler_spawn_quiet (argv);
+    }
+}
+
+static gboolean
+btd_scheduler_collect_detached_scrub (BtdFilesystem *bfs,
+                                      BtdFsRecord *record,
+                                      const gchar *job_fname)
+{
+    g_autoptr(GPtrArray) scrub_devices = NULL;
+    g_autoptr(GError) error = NULL;
+    g_auto(BtdScrubJob) job = { 0 };
+    gboolean failed = FALSE;
+    gboolean completed;
+
+    scrub_devices = btd_scrub_job_load (job_fname, &job, &error);
+    if (scrub_devices == NULL) {
+        btd_warning ("Unable to read detached scrub state for %s: %s",
+                     btd_filesystem_get_mountpoint (bfs),
+                     error->message);
+        g_unlink (job_fname);
+        return FALSE;
+    }
+
+    if (job.finish_time == 0) {
+        if (btd_scheduler_detached_scrub_is_running (bfs, scrub_devices)) {
+            btd_debug ("Detached scrub on %s is still running.",
+                       btd_filesystem_get_mountpoint (bfs));
+            return FALSE;
+        }
+
+        /* the helper went away, continue from its last checkpoint next time */
+        btd_warning ("Detached scrub on %s ended unexpectedly, it will be resumed.",
+                     btd_filesystem_get_mountpoint (bfs));
+        for (guint i = 0; i < scrub_devices->len; i++) {
+            BtdScrubDevice *sdev = g_ptr_array_index (scrub_devices, i);
+            if (!sdev->finished)
+                sdev->interrupted = TRUE;
+        }
+    }
+
+    completed = btd_scheduler_finish_scrub (bfs, record, scrub_devices);
+    g_unlink (job_fname);
+
+    for (guint i = 0; i < scrub_devices->len; i++) {
+        BtdScrubDevice *sdev = g_ptr_array_index (scrub_devices, i);
+        if (sdev->error_code == 0)
+            continue;
+        btd_warning ("Scrub of %s on %s failed: %s",
+                     sdev->path,
+                     btd_filesystem_get_mountpoint (bfs),
+                     g_strerror (sdev->error_code));
+        failed = TRUE;
+    }
+
+    if (job.finish_time != 0) {
+        g_autofree gchar *read_str = g_format_size_full (job.io_read_bytes,
+                                                         G_FORMAT_SIZE_IEC_UNITS);
+        g_autofree gchar *write_str = g_format_size_full (job.io_write_bytes,
+                                                          G_FORMAT_SIZE_IEC_UNITS);
+
+        /* the I/O the scrub unit's cgroup caused, as accounted by the kernel */
+        btd_fs_record_set_value_int (record, "scrub", "io_read_bytes", job.io_read_bytes);
+        btd_fs_record_set_value_int (record, "scrub", "io_write_bytes", job.io_write_bytes);
+        btd_info ("Detached scrub on %s has finished%s, it read %s and wrote %s.",
+                  btd_filesystem_get_mountpoint (bfs),
+                  completed ? "" : " before covering all devices",
+                  read_str,
+                  write_str);
+    }
+
+    return completed && !failed;
+}
+
+static gboolean
+btd_scheduler_run_scrub (BtdScheduler *self, BtdFilesystem *bfs, BtdFsRecord *record)
+{
+    BtdSchedulerPrivate *priv = GET_PRIVATE (self);
+    g_autoptr(GPtrArray) scrub_devices = NULL;
+    g_autoptr(GError) error = NULL;
+    g_autofree gchar *job_fname = NULL;
+    g_autoptr(BtdPressureMonitor) pressure = NULL;
+    gint64 max_runtime;
+    guint max_parallel;
+    guint64 speed_max;
+    guint pressure_threshold;
+    gboolean completed;
+    gboolean ret;
+
+    /* a scrub started by a previous run may still be going on, or has results for us */
+    job_fname = btd_scheduler_get_scrub_job_fname (self, bfs);
+    if (g_file_test (job_fname, G_FILE_TEST_EXISTS))
+        return btd_scheduler_collect_detached_scrub (bfs, record, job_fname);
+
+    scrub_devices = btd_filesystem_get_scrub_devices (bfs, &error);
+    if (scrub_devices == NULL) {
+        btd_warning ("Scrub on %s failed: %s", btd_filesystem_get_mountpoint (bfs), error->message);
+        return FALSE;
+    }
+    if (btd_scrub_is_running (bfs, scrub_devices)) {
+        btd_info ("A scrub is already running on %s, not starting another one.",
+                  btd_filesystem_get_mountpoint (bfs));
+        return FALSE;
+    }
+
+    /* continue an interrupted scrub, or scrub the next slice in rolling mode */
+    btd_scheduler_select_scrub_range (record,
+                                      scrub_devices,
+                                      btd_scheduler_get_scrub_slices (self, bfs));
+    max_runtime = btd_scheduler_get_config_duration_value (self, bfs, "scrub_max_runtime", 0);
+    max_runtime = btd_scheduler_get_window_max_runtime (self,
+                                                        bfs,
+                                                        BTD_BTRFS_ACTION_SCRUB,
+                                                        max_runtime);
+    max_parallel = btd_scheduler_get_scrub_concurrency (self, bfs);
+    speed_max = btd_scheduler_get_scrub_speed_max (self, bfs);
+    pressure_threshold = btd_scheduler_get_pressure_threshold (self, bfs);
+    for (guint i = 0; i < scrub_devices->len; i++)
+        ((BtdScrubDevice *) g_ptr_array_index (scrub_devices, i))->speed_max = speed_max;
+
+    /* when running once, hand the scrub to a helper so we can exit before it is done */
+    if (!priv->persistent && btd_scheduler_get_config_bool (self, bfs, "scrub_detached", TRUE)) {
+        BtdScrubJob job = { 0 };
+        BtdCgroupLimits limits;
+        g_autoptr(GPtrArray) devices = g_ptr_array_new ();
+        g_autoptr(GPtrArray) unit_args = NULL;
+
+        job.mountpoint = (gchar *) btd_filesystem_get_mountpoint (bfs);
+        job.max_runtime = max_runtime;
+        job.max_parallel = max_parallel;
+        job.pressure_threshold = pressure_threshold;
+
+        btd_scheduler_get_detached_scrub_limits (self, bfs, &limits);
+        for (guint i = 0; i < scrub_devices->len; i++)
+            g_ptr_array_add (devices,
+                             ((BtdScrubDevice *) g_ptr_array_index (scrub_devices, i))->path);
+        unit_args = btd_cgroup_limits_to_unit_args (&limits, devices);
+
+        if (!btd_scrub_job_save (job_fname, &job, scrub_devices, &error)) {
+            btd_warning ("Unable to write scrub job for %s: %s",
+                         btd_filesystem_get_mountpoint (bfs),
+                         error->message);
+            g_clear_error (&error);
+        } else if (btd_scheduler_spawn_detached_scrub (bfs, job_fname, unit_args)) {
+            btd_info ("Started detached scrub on %s", btd_filesystem_get_mountpoint (bfs));
+            return FALSE;
+        } else {
+            btd_debug ("Unable to detach scrub on %s, running it directly.",
+                       btd_filesystem_get_mountpoint (bfs));
+            g_unlink (job_fname);
+        }
+    }
+
+    btd_debug ("Running scrub on filesystem %s", btd_filesystem_get_mountpoint (bfs));
+    pressure = btd_scheduler_new_pressure_monitor (bfs, pressure_threshold);
+    ret = btd_filesystem_scrub (bfs,
+                                scrub_devices,
+                                max_runtime,
+                                max_parallel,
+                                pressure,
+                                btd_scheduler_scrub_checkpoint_cb,
+                                record,
+                                priv->cancellable,
+                                &error);
+    completed = btd_scheduler_finish_scrub (bfs, record, scrub_devices);
+
+    if (!ret) {
+        btd_warning ("Scrub on %s failed: %s", btd_filesystem_get_mountpoint (bfs), error->message);
+        return FALSE;
+    }
+
+    if (!completed) {
+        /* don't record a completed run, so the scrub is resumed the next time we run */
+        btd_debug ("Scrub on %s was interrupted and will be resumed later.",
+                   btd_filesystem_get_mountpoint (bfs));
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static gboolean
+btd_scheduler_get_balance_params (BtdScheduler *self,
+                                  BtdFilesystem *bfs,
+                                  BtdBalanceParams *params)
+{
+    g_autofree gchar *vrange = NULL;
+    g_autofree gchar *io_max = NULL;
+    gint64 limit;
+
+    btd_balance_params_init (params);
+    params->data_usage = CLAMP (
+        btd_scheduler_get_config_int (self, bfs, "balance_data_usage", params->data_usage),
+        -1,
+        100);
+    params->metadata_usage = CLAMP (btd_scheduler_get_config_int (self,
+                                                                  bfs,
+                                                                  "balance_metadata_usage",
+                                                                  params->metadata_usage),
+                                    -1,
+                                    100);
+    limit = btd_scheduler_get_config_int (self, bfs, "balance_limit", 0);
+    params->limit = limit > 0 ? (guint64) limit : 0;
+
+    vrange = btd_scheduler_get_config_value (self, bfs, "balance_vrange", NULL);
+    if (vrange != NULL) {
+        g_auto(GStrv) parts = g_strsplit (g_strstrip (vrange), "..", 2);
+        gchar *start_end = NULL;
+        gchar *end_end = NULL;
+
+        if (g_strv_length (parts) == 2) {
+            params->vrange_start = g_ascii_strtoull (parts[0], &start_end, 10);
+            params->vrange_end = g_ascii_strtoull (parts[1], &end_end, 10);
+        }
+        /* a range we can't parse must not widen the balance to the whole filesystem */
+        if (start_end == NULL || start_end == parts[0] || *start_end != '\0' ||
+            end_end == parts[1] || *end_end != '\0' ||
+            params->vrange_end <= params->vrange_start) {
+            btd_warning ("Invalid balance_vrange '%s' for %s, expected <start>..<end>.",
+                         vrange,
+                         btd_filesystem_get_mountpoint (bfs));
+            return FALSE;
+        }
+    }
+
+    params->max_runtime = btd_scheduler_get_config_duration_value (self,
+                                                                   bfs,
+                                                                   "balance_max_runtime",
+                                                                   0);
+    params->max_runtime = btd_scheduler_get_window_max_runtime (self,
+                                                                bfs,
+                                                                BTD_BTRFS_ACTION_BALANCE,
+                                                                params->max_runtime);
+
+    /* balance can't be throttled by bandwidth, so we limit the share of time it may run instead */
+    io_max = btd_scheduler_get_config_value (self, bfs, "balance_io_max", NULL);
+    if (io_max != NULL) {
+        gchar *endptr = NULL;
+        gint64 percentage;
+
+        io_max = g_strstrip (io_max);
+        percentage = g_ascii_strtoll (io_max, &endptr, 10);
+        if (endptr != io_max && (*endptr == '\0' || btd_str_equal0 (endptr, "%")) &&
+            percentage > 0 && percentage <= 100) {
+            params->duty_cycle = (guint) percentage;
+        } else if (!btd_str_equal0 (io_max, "off")) {
+            btd_warning ("Invalid balance_io_max '%s' for %s, expected a percentage.",
+                         io_max,
+                         btd_filesystem_get_mountpoint (bfs));
+        }
+    }
+
+    return TRUE;
+}
+
+static gboolean
+btd_scheduler_run_balance (BtdScheduler *self, BtdFilesystem *bfs, BtdFsRecord *record)
+{
+    BtdSchedulerPrivate *priv = GET_PRIVATE (self);
+    BtdBalanceParams params;
+    g_autoptr(BtdPressureMonitor) pressure = NULL;
+    g_autoptr(GError) error = NULL;
+    g_autofree gchar *job_fname = NULL;
+    gboolean paused = FALSE;
+
+    /* don't compete with a scrub that is still running in the background */
+    job_fname = btd_scheduler_get_scrub_job_fname (self, bfs);
+    if (g_file_test (job_fname, G_FILE_TEST_EXISTS)) {
+        btd_debug ("Postponing balance on %s, a detached scrub is in progress.",
+                   btd_filesystem_get_mountpoint (bfs));
+        return FALSE;
+    }
+
+    if (!btd_scheduler_get_balance_params (self, bfs, &params))
+        return FALSE;
+    params.resume = btd_fs_record_get_value_int (record, "balance", "paused", 0) != 0;
+    pressure = btd_scheduler_new_pressure_monitor (
+        bfs,
+        btd_scheduler_get_pressure_threshold (self, bfs));
+    params.pressure = pressure;
+    params.cancellable = priv->cancellable;
+
+    /* the balance may be paused while it runs, e.g. to throttle it, so mark it as ours
+     * first, in case we don't get to record its state after it has ended */
+    btd_fs_record_set_value_int (record, "balance", "paused", 1);
+    if (!btd_fs_record_save (record, &error)) {
+        btd_warning ("Unable to save state record for mount '%s': %s",
+                     btd_filesystem_get_mountpoint (bfs),
+                     error->message);
+        g_clear_error (&error);
+    }
+
+    btd_debug ("Running balance on filesystem %s", btd_filesystem_get_mountpoint (bfs));
+    if (!btd_filesystem_balance (bfs, &params, &paused, &error)) {
+        btd_warning ("Balance on %s failed: %s",
+                     btd_filesystem_get_mountpoint (bfs),
+                     error->message);
+        btd_fs_record_set_value_int (record, "balance", "paused", 0);
+        return FALSE;
+    }
+
+    btd_fs_record_set_value_int (record, "balance", "paused", paused ? 1 : 0);
+    if (paused) {
+        /* don't record a completed run, so the balance is resumed the next time we run */
+        btd_debug ("Balance on %s was paused and will be resumed later.",
+                   btd_filesystem_get_mountpoint (bfs));
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static gboolean
+btd_scheduler_record_range_scrub (BtdFilesystem *bfs,
+                                  BtdFsRecord *record,
+                                  const gchar *group,
+                                  const gchar *what,
+                                  GPtrArray *results)
+{
+    g_autofree gchar *bytes_str = NULL;
+    g_autofree gchar *time_str = NULL;
+    guint64 bytes_verified = 0;
+    guint64 errors_found = 0;
+    gint64 duration = 0;
+    gboolean interrupted = FALSE;
+
+    if (results == NULL)
+        return FALSE;
+
+    /* devices are scrubbed in parallel, so the slowest one determines the duration */
+    for (guint i = 0; i < results->len; i++) {
+        BtdScrubDevice *sdev = g_ptr_array_index (results, i);
+        bytes_verified += sdev->bytes_scrubbed;
+        errors_found += btd_scrub_device_get_error_count (sdev);
+        duration = MAX (duration, sdev->duration / G_USEC_PER_SEC);
+        interrupted = interrupted || sdev->interrupted;
+    }
+
+    btd_fs_record_set_value_int (record, group, "bytes_verified", bytes_verified);
+    btd_fs_record_set_value_int (record, group, "errors", errors_found);
+    btd_fs_record_set_value_int (record, group, "duration", duration);
+
+    bytes_str = g_format_size_full (bytes_verified, G_FORMAT_SIZE_IEC_UNITS);
+    time_str = btd_humanize_time (MAX (duration, 1));
+    btd_info ("Scrubbed %s of %s on %s in %s, %" G_GUINT64_FORMAT " errors",
+              bytes_str,
+              what,
+              btd_filesystem_get_mountpoint (bfs),
+              time_str,
+              errors_found);
+    if (errors_found > 0) {
+        btd_warning ("Scrub of %s found %" G_GUINT64_FORMAT " errors on %s",
+                     what,
+                     errors_found,
+                     btd_filesystem_get_mountpoint (bfs));
+        btd_scheduler_record_scrub_health (record, FALSE);
+        btd_scheduler_request_error_check (record);
+    }
+    if (interrupted)
+        btd_info ("Scrub of %s on %s was stopped before all ranges were covered.",
+                  what,
+                  btd_filesystem_get_mountpoint (bfs));
+
+    return !interrupted;
+}
+
+static gboolean
+btd_scheduler_run_verify_recent (BtdScheduler *self, BtdFilesystem *bfs, BtdFsRecord *record)
+{
+    BtdSchedulerPrivate *priv = GET_PRIVATE (self);
+    g_autoptr(BtdPressureMonitor) pressure = NULL;
+    g_autoptr(GHashTable) chunks = NULL;
+    g_autoptr(GPtrArray) dev_extents = NULL;
+    g_autoptr(GPtrArray) results = NULL;
+    g_autoptr(GPtrArray) devices = NULL;
+    g_autoptr(GError) error = NULL;
+    guint64 last_generation;
+    guint64 fs_generation;
+    guint64 newest_generation = 0;
+    gboolean completed;
+    gboolean ret;
+
+    /* extents of the still running transaction are picked up next time */
+    fs_generation = btd_filesystem_get_generation (bfs);
+    last_generation = (guint64) MAX (
+        btd_fs_record_get_value_int (record, "verify-recent", "generation", 0),
+        0);
+
+    if (last_generation == 0) {
+        /* first run, older data is covered by regular scrubs */
+        if (fs_generation == 0) {
+            chunks = btd_tree_search_new_data_chunks (bfs, 0, G_MAXUINT64, &fs_generation, &error);
+            if (chunks == NULL) {
+                btd_warning ("Unable to search for data on %s: %s",
+                             btd_filesystem_get_mountpoint (bfs),
+                             error->message);
+                return FALSE;
+            }
+            fs_generation++;
+        }
+        btd_debug ("Verifying data written to %s after generation %" G_GUINT64_FORMAT
+                   " from now on.",
+                   btd_filesystem_get_mountpoint (bfs),
+                   fs_generation - 1);
+        btd_fs_record_set_value_int (record,
+                                     "verify-recent",
+                                     "generation",
+                                     (gint64) fs_generation - 1);
+        return TRUE;
+    }
+
+    chunks = btd_tree_search_new_data_chunks (bfs,
+                                              last_generation,
+                                              fs_generation > 0 ? fs_generation : G_MAXUINT64,
+                                              &newest_generation,
+                                              &error);
+    if (chunks == NULL) {
+        btd_warning ("Unable to search for recently written data on %s: %s",
+                     btd_filesystem_get_mountpoint (bfs),
+                     error->message);
+        return FALSE;
+    }
+    if (fs_generation > 0)
+        newest_generation = fs_generation - 1;
+
+    if (g_hash_table_size (chunks) == 0) {
+        btd_debug ("No data was written to %s since the last verification.",
+                   btd_filesystem_get_mountpoint (bfs));
+        btd_fs_record_set_value_int (record,
+                                     "verify-recent",
+                                     "generation",
+                                     (gint64) newest_generation);
+        return TRUE;
+    }
+
+    dev_extents = btd_tree_search_dev_extents (bfs, 0, chunks, &error);
+    if (dev_extents == NULL) {
+        btd_warning ("Unable to map recently written data on %s: %s",
+                     btd_filesystem_get_mountpoint (bfs),
+                     error->message);
+        return FALSE;
+    }
+
+    devices = btd_filesystem_get_scrub_devices (bfs, NULL);
+    if (devices != NULL && btd_scrub_is_running (bfs, devices)) {
+        btd_debug ("A scrub is running on %s, postponing verification of recent data.",
+                   btd_filesystem_get_mountpoint (bfs));
+        return FALSE;
+    }
+
+    btd_info ("Verifying %u recently written chunks on %s",
+              g_hash_table_size (chunks),
+              btd_filesystem_get_mountpoint (bfs));
+    pressure = btd_scheduler_new_pressure_monitor (
+        bfs,
+        btd_scheduler_get_pressure_threshold (self, bfs));
+    ret = btd_scrub_run_extents (
+        bfs,
+        dev_extents,
+        btd_scheduler_get_window_max_runtime (self, bfs, BTD_BTRFS_ACTION_VERIFY_RECENT, 0),
+        btd_scheduler_get_scrub_concurrency (self, bfs),
+        btd_scheduler_get_scrub_speed_max (self, bfs),
+        pressure,
+        &results,
+        priv->cancellable,
+        &error);
+    completed = btd_scheduler_record_range_scrub (bfs,
+                                                  record,
+                                                  "verify-recent",
+                                                  "recently written data",
+                                                  results);
+
+    if (!ret) {
+        btd_warning ("Verification of recent data on %s failed: %s",
+                     btd_filesystem_get_mountpoint (bfs),
+                     error->message);
+        return FALSE;
+    }
+
+    /* only move on once everything up to this generation was checked */
+    if (!completed)
+        return FALSE;
+    btd_fs_record_set_value_int (record,
+                                 "verify-recent",
+                                 "generation",
+                                 (gint64) MAX (newest_generation, last_generation));
+    return TRUE;
+}
+
+static gboolean
+btd_scheduler_run_metadata_scrub (BtdScheduler *self, BtdFilesystem *bfs, BtdFsRecord *record)
+{
+    BtdSchedulerPrivate *priv = GET_PRIVATE (self);
+    g_autoptr(BtdPressureMonitor) pressure = NULL;
+    g_autoptr(GPtrArray) dev_extents = NULL;
+    g_autoptr(GPtrArray) results = NULL;
+    g_autoptr(GPtrArray) devices = NULL;
+    g_autoptr(GError) error = NULL;
+    gboolean completed;
+    gboolean ret;
+
+    /* metadata is a small part of the filesystem, but losing it is fatal */
+    dev_extents = btd_tree_search_dev_extents (bfs,
+                                               BTRFS_BLOCK_GROUP_METADATA |
+                                                   BTRFS_BLOCK_GROUP_SYSTEM,
+                                               NULL,
+                                               &error);
+    if (dev_extents == NULL) {
+        btd_warning ("Unable to find metadata chunks on %s: %s",
+                     btd_filesystem_get_mountpoint (bfs),
+                     error->message);
+        return FALSE;
+    }
+
+    devices = btd_filesystem_get_scrub_devices (bfs, NULL);
+    if (devices != NULL && btd_scrub_is_running (bfs, devices)) {
+        btd_debug ("A scrub is running on %s, postponing metadata scrub.",
+                   btd_filesystem_get_mountpoint (bfs));
+        return FALSE;
+    }
+
+    btd_debug ("Running metadata scrub on filesystem %s", btd_filesystem_get_mountpoint (bfs));
+    pressure = btd_scheduler_new_pressure_monitor (
+        bfs,
+        btd_scheduler_get_pressure_threshold (self, bfs));
+    ret = btd_scrub_run_extents (
+        bfs,
+        dev_extents,
+        btd_scheduler_get_window_max_runtime (self, bfs, BTD_BTRFS_ACTION_METADATA_SCRUB, 0),
+        btd_scheduler_get_scrub_concurrency (self, bfs),
+        btd_scheduler_get_scrub_speed_max (self, bfs),
+        pressure,
+        &results,
+        priv->cancellable,
+        &error);
+    completed = btd_scheduler_record_range_scrub (bfs,
+                                                  record,
+                                                  "metadata-scrub",
+                                                  "metadata",
+                                                  results);
+
+    if (!ret) {
+        btd_warning ("Metadata scrub on %s failed: %s",
+                     btd_filesystem_get_mountpoint (bfs),
+                     error->message);
+        return FALSE;
+    }
+
+    /* an interrupted metadata scrub is repeated as a whole, it is quick anyway */
+    return completed;
+}
+
+static gboolean
+btd_scheduler_resources_available (BtdScheduler *self,
+                                   GPtrArray *resources,
+                                   GHashTable *busy_resources,
+                                   GHashTable *reserved_resources)
+{
+    BtdSchedulerPrivate *priv = GET_PRIVATE (self);
+
+    for (guint i = 0; i < resources->len; i++) {
+        const gchar *resource = g_ptr_array_index (resources, i);
+        guint jobs = 0;
+
+        if (busy_resources != NULL)
+            jobs += GPOINTER_TO_UINT (g_hash_table_lookup (busy_resources, resource));
+        if (reserved_resources != NULL)
+            jobs += GPOINTER_TO_UINT (g_hash_table_lookup (reserved_resources, resource));
+
+        if (btd_topology_is_controller_resource (resource)) {
+            /* a limit of zero means we do not limit jobs per controller */
+            if (priv->max_controller_jobs > 0 && jobs >= priv->max_controller_jobs)
+                return FALSE;
+        } else if (jobs > 0) {
+            /* never put two heavy jobs on the same disk */
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+/**
+ * btd_scheduler_get_detached_scrub_resources:
+ * @self: An instance of #BtdScheduler
+ * @bfs: The filesystem that is about to acquire resources
+ *
+ * Count the hardware resources used by detached scrubs on other filesystems,
+ * which keep running outside of this process for as long as their job file
+ * says they haven't finished.
+ *
+ * Returns: (transfer full): A table of resource names mapped to job counts.
+ */
+static GHashTable *
+btd_scheduler_get_detached_scrub_resources (BtdScheduler *self, BtdFilesystem *bfs)
+{
+    g_autoptr(GPtrArray) filesystems = NULL;
+    GHashTable *reserved;
+
+    reserved = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    filesystems = btd_scheduler_get_unique_filesystems (self);
+    for (guint i = 0; i < filesystems->len; i++) {
+        BtdFilesystem *other_bfs = g_ptr_array_index (filesystems, i);
+        g_autofree gchar *job_fname = NULL;
+        g_autoptr(GPtrArray) scrub_devices = NULL;
+        g_autoptr(GPtrArray) resources = NULL;
+        g_auto(BtdScrubJob) job = { 0 };
+
+        if (other_bfs == bfs || !btd_scheduler_has_scrub_job (self, other_bfs))
+            continue;
+        job_fname = btd_scheduler_get_scrub_job_fname (self, other_bfs);
+        scrub_devices = btd_scrub_job_load (job_fname, &job, NULL);
+        if (scrub_devices == NULL || job.finish_time != 0)
+            continue;
+
+        resources = btd_topology_get_resources (other_bfs);
+        for (guint j = 0; j < resources->len; j++) {
+            const gchar *resource = g_ptr_array_index (resources, j);
+            guint jobs = GPOINTER_TO_UINT (g_hash_table_lookup (reserved, resource));
+            g_hash_table_insert (reserved, g_strdup (resource), GUINT_TO_POINTER (jobs + 1));
+        }
+    }
+
+    return reserved;
+}
+
+/**
+ * btd_scheduler_acquire_resources:
+ * @self: An instance of #BtdScheduler
+ * @bfs: The filesystem to run a heavy action on
+ * @resources: The hardware resources the action needs
+ *
+ * Reserve the hardware behind @bfs for a heavy action, waiting for other
+ * actions of this process to release it if necessary.
+ *
+ * Returns: %FALSE if the resources are held by a detached scrub, which
+ *          may keep them for hours, so the action should be retried later.
+ */
+static gboolean
+btd_scheduler_acquire_resources (BtdScheduler *self, BtdFilesystem *bfs, GPtrArray *resources)
+{
+    BtdSchedulerPrivate *priv = GET_PRIVATE (self);
+    g_autoptr(GHashTable) reserved = NULL;
+    gboolean waited = FALSE;
+
+    reserved = btd_scheduler_get_detached_scrub_resources (self, bfs);
+    if (!btd_scheduler_resources_available (self, resources, NULL, reserved))
+        return FALSE;
+
+    /* take all resources at once, so jobs can never deadlock by holding a part of them */
+    g_mutex_lock (&priv->resource_lock);
+    while (!btd_scheduler_resources_available (self, resources, priv->busy_resources, reserved)) {
+        if (!waited)
+            btd_debug ("Waiting for disks of %s to become idle",
+                       btd_filesystem_get_mountpoint (bfs));
+        waited = TRUE;
+        g_cond_wait (&priv->resource_cond, &priv->resource_lock);
+    }
+
+    for (guint i = 0; i < resources->len; i++) {
+        const gchar *resource = g_ptr_array_index (resources, i);
+        guint jobs = GPOINTER_TO_UINT (g_hash_table_lookup (priv->busy_resources, resource));
+        g_hash_table_insert (priv->busy_resources, g_strdup (resource), GUINT_TO_POINTER (jobs + 1));
+    }
+    g_mutex_unlock (&priv->resource_lock);
+
+    return TRUE;
+}
+
+static void
+btd_scheduler_release_resources (BtdScheduler *self, GPtrArray *resources)
+{
+    BtdSchedulerPrivate *priv = GET_PRIVATE (self);
+
+    g_mutex_lock (&priv->resource_lock);
+    for (guint i = 0; i < resources->len; i++) {
+        const gchar *resource = g_ptr_array_index (resources, i);
+        guint jobs = GPOINTER_TO_UINT (g_hash_table_lookup (priv->busy_resources, resource));
+
+        if (jobs <= 1)
+            g_hash_table_remove (priv->busy_resources, resource);
+        else
+            g_hash_table_insert (priv->busy_resources,
+                                 g_strdup (resource),
+                                 GUINT_TO_POINTER (jobs - 1));
+    }
+    g_cond_broadcast (&priv->resource_cond);
+    g_mutex_unlock (&priv->resource_lock);
+}
+
+/**
+ * btd_scheduler_postpone_action:
+ * @record: The #BtdFsRecord of the filesystem
+ * @action: The action to postpone
+ *
+ * Don't check @action again for a while, as it was skipped for a reason that is
+ * unlikely to go away within the next few seconds. Without this, a due action
+ * would keep the next run time in the past and we would retry it continuously.
+ */
+static void
+btd_scheduler_postpone_action (BtdFsRecord *record, BtdBtrfsAction action)
+{
+    btd_fs_record_set_value_int (record,
+                                 "postponed",
+                                 btd_btrfs_action_to_string (action),
+                                 (gint64) time (NULL) + BTD_ACTION_POSTPONE_INTERVAL);
+}
+
+/**
+ * btd_scheduler_defer_action:
+ * @self: An instance of #BtdScheduler
+ * @bfs: The filesystem the action is deferred on
+ * @record: The #BtdFsRecord of @bfs
+ * @group: Record group remembering when the action was first deferred
+ * @action: The action to defer
+ * @max_delay_key: Configuration key of the maximum delay
+ * @default_max_delay: Maximum delay in seconds if none is configured
+ *
+ * Note that @action is being deferred for the reason tracked in record group
+ * @group, so it does not starve on a machine where that reason never goes away.
+ *
+ * Returns: %TRUE if the action was deferred for longer than the configured
+ *          maximum delay and should run now.
+ */
+static gboolean
+btd_scheduler_defer_action (BtdScheduler *self,
+                            BtdFilesystem *bfs,
+                            BtdFsRecord *record,
+                            const gchar *group,
+                            BtdBtrfsAction action,
+                            const gchar *max_delay_key,
+                            gint64 default_max_delay)
+{
+    const gchar *action_name = btd_btrfs_action_to_string (action);
+    gint64 max_delay;
+    gint64 deferred_since;
+    gint64 now = (gint64) time (NULL);
+
+    deferred_since = btd_fs_record_get_value_int (record, group, action_name, 0);
+    max_delay = (gint64) btd_scheduler_get_config_duration_value (self,
+                                                                  bfs,
+                                                                  max_delay_key,
+                                                                  (gulong) default_max_delay);
+    if (deferred_since > 0 && max_delay > 0 && now - deferred_since > max_delay) {
+        btd_fs_record_set_value_int (record, group, action_name, 0);
+        return TRUE;
+    }
+
+    if (deferred_since == 0)
+        btd_fs_record_set_value_int (record, group, action_name, now);
+    return FALSE;
+}
+
+static gboolean
+btd_scheduler_admit_heavy_action (BtdScheduler *self,
+                                  BtdFilesystem *bfs,
+                                  BtdFsRecord *record,
+                                  BtdBtrfsAction action)
+{
+    g_autoptr(GPtrArray) disks = NULL;
+    g_autofree gchar *reason = NULL;
+    const gchar *action_name = btd_btrfs_action_to_string (action);
+    gint64 idle_time;
+
+    idle_time = btd_scheduler_get_config_duration_value (self, bfs, "require_idle", 0);
+    if (idle_time == 0)
+        return TRUE;
+
+    disks = btd_topology_get_disks (bfs);
+    if (btd_idle_check (disks, idle_time, &reason)) {
+        btd_fs_record_set_value_int (record, "deferred", action_name, 0);
+        return TRUE;
+    }
+
+    /* don't let an action starve on a machine that is never quiet */
+    if (btd_scheduler_defer_action (self,
+                                    bfs,
+                                    record,
+                                    "deferred",
+                                    action,
+                                    "idle_max_delay",
+                                    BTD_DEFAULT_IDLE_MAX_DELAY)) {
+        btd_info ("Running %s on %s although the system is not idle (%s), "
+                  "it was deferred for too long.",
+                  action_name,
+                  btd_filesystem_get_mountpoint (bfs),
+                  reason);
+        return TRUE;
+    }
+
+    btd_debug ("Deferring %s on %s, the system is not idle: %s",
+               action_name,
+               btd_filesystem_get_mountpoint (bfs),
+               reason);
+    btd_scheduler_postpone_action (record, action);
+    return FALSE;
+}
+
+static gchar *
+btd_scheduler_get_busy_reason (BtdFilesystem *bfs, BtdFsRecord *record, BtdBtrfsAction action)
+{
+    g_autoptr(GPtrArray) scrub_devices = NULL;
+    g_autofree gchar *exclop = NULL;
+
+    /* a balance we paused ourselves is resumed by the balance action, and a paused
+     * balance doesn't get in the way of anything else */
+    exclop = btd_filesystem_get_exclusive_operation (bfs);
+    if (btd_str_equal0 (exclop, "balance paused") &&
+        (action != BTD_BTRFS_ACTION_BALANCE ||
+         btd_fs_record_get_value_int (record, "balance", "paused", 0) != 0))
+        g_clear_pointer (&exclop, g_free);
+    if (exclop != NULL)
+        return g_strdup_printf ("%s is in progress", exclop);
+
+    scrub_devices = btd_filesystem_get_scrub_devices (bfs, NULL);
+    if (scrub_devices != NULL && btd_scrub_is_running (bfs, scrub_devices))
+        return g_strdup ("scrub is in progress");
+
+    return NULL;
+}
+
+static gboolean
+btd_scheduler_admit_on_busy_fs (BtdScheduler *self,
+                                BtdFilesystem *bfs,
+                                BtdFsRecord *record,
+                                BtdBtrfsAction action)
+{
+    g_autofree gchar *reason = NULL;
+    g_autofree gchar *prev_reason = NULL;
+    const gchar *action_name = btd_btrfs_action_to_string (action);
+
+    /* operations started by an administrator take precedence, the action
+     * is retried once they are done instead of waiting for them in the kernel */
+    reason = btd_scheduler_get_busy_reason (bfs, record, action);
+    prev_reason = btd_fs_record_get_value_str (record, "busy", action_name);
+    btd_fs_record_set_value_str (record, "busy", action_name, reason);
+    if (reason == NULL)
+        return TRUE;
+
+    if (!btd_str_equal0 (reason, prev_reason))
+        btd_info ("Deferring %s on %s, %s.",
+                  action_name,
+                  btd_filesystem_get_mountpoint (bfs),
+                  reason);
+    else
+        btd_debug ("Deferring %s on %s, %s.",
+                   action_name,
+                   btd_filesystem_get_mountpoint (bfs),
+                   reason);
+    btd_scheduler_postpone_action (record, action);
+    return FALSE;
+}
+
+static gboolean
+btd_scheduler_disk_is_spun_down (BtdFsRecord *record, BtdDisk *disk, gint64 now)
+{
+    BtdDiskPowerState state;
+    gint64 changed_time;
+
+    changed_time = btd_scheduler_sample_disk_activity (record, disk, now);
+    state = btd_idle_get_disk_power_state (disk);
+    if (state != BTD_DISK_POWER_STATE_UNKNOWN)
+        return state == BTD_DISK_POWER_STATE_STANDBY;
+
+    /* most disks spin down after a period without I/O, so assume this one did too */
+    return changed_time > 0 && now - changed_time >= BTD_SPINDOWN_IDLE_GUESS;
+}
+
+static gboolean
+btd_scheduler_admit_on_spindown (BtdScheduler *self,
+                                 BtdFilesystem *bfs,
+                                 BtdFsRecord *record,
+                                 BtdBtrfsAction action)
+{
+    g_autoptr(GPtrArray) disks = NULL;
+    const gchar *action_name = btd_btrfs_action_to_string (action);
+    const gchar *sleeping_disk = NULL;
+    gint64 now;
+
+    if (!btd_scheduler_get_config_bool (self, bfs, "avoid_spinup", FALSE))
+        return TRUE;
+
+    /* check every disk, so the activity of each one is tracked */
+    now = (gint64) time (NULL);
+    disks = btd_topology_get_disks (bfs);
+    for (guint i = 0; i < disks->len; i++) {
+        BtdDisk *disk = g_ptr_array_index (disks, i);
+
+        if (!disk->rotational)
+            continue;
+        if (btd_scheduler_disk_is_spun_down (record, disk, now) && sleeping_disk == NULL)
+            sleeping_disk = disk->name;
     }
 
-    return TRUE;
+    if (sleeping_disk == NULL) {
+        btd_fs_record_set_value_int (record, "spindown-deferred", action_name, 0);
+        return TRUE;
+    }
+
+    if (btd_scheduler_defer_action (self,
+                                    bfs,
+                                    record,
+                                    "spindown-deferred",
+                                    action,
+                                    "spinup_max_delay",
+                                    BTD_DEFAULT_SPINUP_MAX_DELAY)) {
+        btd_info ("Running %s on %s although disk %s is spun down, "
+                  "it was deferred for too long.",
+                  action_name,
+                  btd_filesystem_get_mountpoint (bfs),
+                  sleeping_disk);
+        return TRUE;
+    }
+
+    btd_debug ("Deferring %s on %s until disk %s is spun up.",
+               action_name,
+               btd_filesystem_get_mountpoint (bfs),
+               sleeping_disk);
+    btd_scheduler_postpone_action (record, action);
+    return FALSE;
 }
 
-static gboolean
-btd_scheduler_run_for_mount (BtdScheduler *self, BtdFilesystem *bfs)
+static const struct {
+    BtdBtrfsAction action;
+    BtdActionFunction func;
+    gboolean allow_on_battery;
+    gboolean heavy_io;
+} btd_action_functions[] = {
+    { BTD_BTRFS_ACTION_STATS, btd_scheduler_run_stats, TRUE, FALSE },
+    { BTD_BTRFS_ACTION_SCRUB, btd_scheduler_run_scrub, FALSE, TRUE },
+    { BTD_BTRFS_ACTION_BALANCE, btd_scheduler_run_balance, FALSE, TRUE },
+    { BTD_BTRFS_ACTION_VERIFY_RECENT, btd_scheduler_run_verify_recent, FALSE, TRUE },
+    { BTD_BTRFS_ACTION_METADATA_SCRUB, btd_scheduler_run_metadata_scrub, FALSE, TRUE },
+
+    { BTD_BTRFS_ACTION_UNKNOWN, NULL },
+};
+
+static void
+btd_scheduler_run_for_mount (BtdScheduler *self,
+                             BtdFilesystem *bfs,
+                             BtdFsRecord *record,
+                             BtdActionLane lane,
+                             time_t reference_time)
 {
     BtdSchedulerPrivate *priv = GET_PRIVATE (self);
-    g_autoptr(BtdFsRecord) record = NULL;
     g_autoptr(GError) error = NULL;
     gint64 last_time;
     time_t interval_time;
-    struct {
-        BtdBtrfsAction action;
-        BtdActionFunction func;
-        gboolean allow_on_battery;
-    } action_fn[] = {
-        { BTD_BTRFS_ACTION_STATS, btd_scheduler_run_stats, TRUE },
-        { BTD_BTRFS_ACTION_SCRUB, btd_scheduler_run_scrub, FALSE },
-        { BTD_BTRFS_ACTION_BALANCE, btd_scheduler_run_balance, FALSE },
-
-        { BTD_BTRFS_ACTION_UNKNOWN, NULL },
-    };
-
-    record = btd_fs_record_new (btd_filesystem_get_mountpoint (bfs));
-    if (!btd_fs_record_load (record, &error)) {
-        btd_warning ("Unable to load record for mount '%s': %s",
-                     btd_filesystem_get_mountpoint (bfs),
-                     error->message);
-        g_clear_error (&error);
-    }
+    time_t due_time;
+    gboolean action_ran = FALSE;
+    gboolean record_changed = FALSE;
+    g_autoptr(GPtrArray) resources = NULL;
+
+    /* run all actions belonging to this lane */
+    for (guint i = 0; btd_action_functions[i].func != NULL; i++) {
+        BtdBtrfsAction action = btd_action_functions[i].action;
+        gboolean heavy_io = btd_action_functions[i].heavy_io;
 
-    /* run all actions */
-    for (guint i = 0; action_fn[i].func != NULL; i++) {
-        interval_time = (time_t) btd_scheduler_get_config_duration_for_action (self,
-                                                                               bfs,
-                                                                               action_fn[i].action);
+        if (heavy_io != (lane == BTD_ACTION_LANE_HEAVY))
+            continue;
+        if (heavy_io && g_cancellable_is_cancelled (priv->cancellable))
+            continue;
+
+        interval_time = (time_t) btd_scheduler_get_action_period (self, bfs, record, action);
         if (interval_time == 0) {
             btd_debug ("Skipping %s on %s, action is disabled.",
-                       btd_btrfs_action_to_string (action_fn[i].action),
+                       btd_btrfs_action_to_string (action),
                        btd_filesystem_get_mountpoint (bfs));
             continue;
         }
 
-        last_time = btd_fs_record_get_last_action_time (record, action_fn[i].action);
-        if (priv->reference_time - last_time > interval_time) {
+        last_time = btd_fs_record_get_last_action_time (record, action);
+        due_time = btd_scheduler_get_due_time (self, bfs, record, action, last_time, interval_time);
+        if (last_time == 0 && due_time >= reference_time &&
+            btd_fs_record_get_value_int (record,
+                                         "first-run",
+                                         btd_btrfs_action_to_string (action),
+                                         0) == 0) {
+            /* remember the first due time, so it does not move along with the reference time */
+            btd_fs_record_set_value_int (record,
+                                         "first-run",
+                                         btd_btrfs_action_to_string (action),
+                                         due_time);
+            record_changed = TRUE;
+        }
+        if (reference_time > due_time) {
+            /* actions that are still in progress or failed are only retried after a while */
+            if (reference_time - btd_fs_record_get_value_int (record,
+                                                              "attempts",
+                                                              btd_btrfs_action_to_string (action),
+                                                              0) <
+                BTD_ACTION_RETRY_INTERVAL) {
+                btd_debug ("Skipping %s on %s, it was attempted recently.",
+                           btd_btrfs_action_to_string (action),
+                           btd_filesystem_get_mountpoint (bfs));
+                continue;
+            }
+            if (time (NULL) < btd_fs_record_get_value_int (record,
+                                                           "postponed",
+                                                           btd_btrfs_action_to_string (action),
+                                                           0)) {
+                btd_debug ("Skipping %s on %s, it was postponed.",
+                           btd_btrfs_action_to_string (action),
+                           btd_filesystem_get_mountpoint (bfs));
+                continue;
+            }
+
+            /* actions restricted to a maintenance window wait until it opens,
+             * but the results of a detached scrub can be collected at any time */
+            if (!btd_scheduler_action_window_is_open (self, bfs, action) &&
+                !(action == BTD_BTRFS_ACTION_SCRUB && btd_scheduler_has_scrub_job (self, bfs))) {
+                btd_debug ("Deferring %s on %s, its maintenance window is closed.",
+                           btd_btrfs_action_to_string (action),
+                           btd_filesystem_get_mountpoint (bfs));
+                continue;
+            }
+
             /* first check if this action is even allowed to be run if we are on batter power */
-            if (!action_fn[i].allow_on_battery && btd_machine_is_on_battery ()) {
+            if (!btd_action_functions[i].allow_on_battery && btd_machine_is_on_battery ()) {
                 btd_debug ("Skipping %s on %s, we are running on battery power.",
-                           btd_btrfs_action_to_string (action_fn[i].action),
+                           btd_btrfs_action_to_string (action),
                            btd_filesystem_get_mountpoint (bfs));
+                btd_scheduler_postpone_action (record, action);
+                action_ran = TRUE;
+                continue;
+            }
+
+            /* heavy actions wait for running operations to finish, for sleeping disks to
+             * wake up and for a quiet moment, unless a detached scrub is to be collected */
+            if (heavy_io &&
+                !(action == BTD_BTRFS_ACTION_SCRUB && btd_scheduler_has_scrub_job (self, bfs)) &&
+                (!btd_scheduler_admit_on_busy_fs (self, bfs, record, action) ||
+                 !btd_scheduler_admit_on_spindown (self, bfs, record, action) ||
+                 !btd_scheduler_admit_heavy_action (self, bfs, record, action))) {
+                action_ran = TRUE;
                 continue;
             }
 
+            /* I/O heavy actions must not compete with others for the same hardware */
+            if (heavy_io) {
+                if (resources == NULL)
+                    resources = btd_topology_get_resources (bfs);
+                if (!btd_scheduler_acquire_resources (self, bfs, resources)) {
+                    btd_debug ("Deferring %s on %s, a detached scrub is using its disks.",
+                               btd_btrfs_action_to_string (action),
+                               btd_filesystem_get_mountpoint (bfs));
+                    btd_scheduler_postpone_action (record, action);
+                    action_ran = TRUE;
+                    continue;
+                }
+
+                /* we may have been stopped while waiting for the hardware to become free */
+                if (g_cancellable_is_cancelled (priv->cancellable)) {
+                    btd_scheduler_release_resources (self, resources);
+                    continue;
+                }
+            }
+
             /* run the action and record that we ran it, if it didn't fail to be launched */
-            if (action_fn[i].func (self, bfs, record))
-                btd_fs_record_set_last_action_time_now (record, action_fn[i].action);
+            if (btd_action_functions[i].func (self, bfs, record))
+                btd_fs_record_set_last_action_time_now (record, action);
+            else
+                btd_fs_record_set_value_int (record,
+                                             "attempts",
+                                             btd_btrfs_action_to_string (action),
+                                             reference_time);
+            action_ran = TRUE;
+
+            if (heavy_io)
+                btd_scheduler_release_resources (self, resources);
         }
     }
 
+    if (!action_ran && !record_changed && !btd_fs_record_is_new (record))
+        return;
+
     /* save record & finish */
     if (!btd_fs_record_save (record, &error)) {
         btd_warning ("Unable to save state record for mount '%s': %s",
@@ -454,18 +2465,66 @@ btd_scheduler_run_for_mount (BtdScheduler *self, BtdFilesystem *bfs)
                      error->message);
         g_clear_error (&error);
     }
-    return TRUE;
 }
 
-static gint
-btd_filesystem_compare (gconstpointer fs_a, gconstpointer fs_b)
+static void
+btd_scheduler_run_light_lane (BtdScheduler *self, GPtrArray *filesystems, GPtrArray *records)
 {
-    const gchar *mount_a = btd_filesystem_get_mountpoint (
-        BTD_FILESYSTEM (*(BtdFilesystem **) fs_a));
-    const gchar *mount_b = btd_filesystem_get_mountpoint (
-        BTD_FILESYSTEM (*(BtdFilesystem **) fs_b));
+    BtdSchedulerPrivate *priv = GET_PRIVATE (self);
 
-    return g_strcmp0 (mount_a, mount_b);
+    for (guint i = 0; i < filesystems->len; i++)
+        btd_scheduler_run_for_mount (self,
+                                     g_ptr_array_index (filesystems, i),
+                                     g_ptr_array_index (records, i),
+                                     BTD_ACTION_LANE_LIGHT,
+                                     priv->reference_time);
+}
+
+static BtdFsRecord *
+btd_scheduler_get_record (BtdScheduler *self, BtdFilesystem *bfs)
+{
+    BtdSchedulerPrivate *priv = GET_PRIVATE (self);
+    const gchar *mountpoint = btd_filesystem_get_mountpoint (bfs);
+    g_autoptr(GError) error = NULL;
+    BtdFsRecord *record;
+
+    /* records are kept in memory, so we only read them once when running persistently */
+    record = g_hash_table_lookup (priv->records, mountpoint);
+    if (record != NULL)
+        return record;
+
+    record = btd_fs_record_new (mountpoint);
+    if (!btd_fs_record_load (record, &error))
+        btd_warning ("Unable to load record for mount '%s': %s", mountpoint, error->message);
+    g_hash_table_insert (priv->records, g_strdup (mountpoint), record);
+
+    return record;
+}
+
+static void
+btd_scheduler_pool_run_func (gpointer data, gpointer user_data)
+{
+    BtdScheduler *self = BTD_SCHEDULER (user_data);
+    BtdSchedulerPrivate *priv = GET_PRIVATE (self);
+    BtdSchedulerJob *job = data;
+
+    btd_scheduler_run_for_mount (self,
+                                 job->bfs,
+                                 job->record,
+                                 BTD_ACTION_LANE_HEAVY,
+                                 job->reference_time);
+    g_free (job);
+
+    g_atomic_int_add (&priv->heavy_jobs, -1);
+    g_main_context_wakeup (NULL);
+}
+
+static gboolean
+btd_scheduler_light_lane_tick_cb (gpointer user_data)
+{
+    gboolean *tick_pending = user_data;
+    *tick_pending = TRUE;
+    return G_SOURCE_CONTINUE;
 }
 
 /**
@@ -481,7 +2540,12 @@ gboolean
 btd_scheduler_run (BtdScheduler *self, GError **error)
 {
     BtdSchedulerPrivate *priv = GET_PRIVATE (self);
-    g_autoptr(GHashTable) known_devices = g_hash_table_new (g_direct_hash, g_direct_equal);
+    g_autoptr(GPtrArray) filesystems = NULL;
+    g_autoptr(GPtrArray) records = g_ptr_array_new_with_free_func (g_object_unref);
+    g_autoptr(GError) tmp_error = NULL;
+    GThreadPool *pool;
+    guint tick_source_id;
+    gboolean tick_pending = FALSE;
 
     /* load configuration in case we haven't loaded it yet */
     if (!priv->loaded) {
@@ -498,33 +2562,573 @@ btd_scheduler_run (BtdScheduler *self, GError **error)
         return FALSE;
     }
 
+    /* refresh the reference time, as we may be running persistently */
+    priv->reference_time = MAX (priv->reference_time, time (NULL) - 60);
+
     /* check if there is anything for us to do */
     if (priv->mountpoints->len == 0) {
         g_debug ("No mounted Btrfs filesystems found.");
         return TRUE;
     }
 
-    /* sort mountpoints to get a predictable order */
-    g_ptr_array_sort (priv->mountpoints, btd_filesystem_compare);
-
-    /* run tasks */
-    for (guint i = 0; i < priv->mountpoints->len; i++) {
-        BtdFilesystem *bfs = g_ptr_array_index (priv->mountpoints, i);
-        dev_t devno = btd_filesystem_get_devno (bfs);
+    /* find the filesystems to act on, and load their state */
+    filesystems = btd_scheduler_get_unique_filesystems (self);
+    for (guint i = 0; i < filesystems->len; i++)
+        g_ptr_array_add (records,
+                         g_object_ref (
+                             btd_scheduler_get_record (self, g_ptr_array_index (filesystems, i))));
+
+    /* cheap checks run first, so errors get reported before any long-running action starts */
+    priv->running = TRUE;
+    btd_scheduler_run_light_lane (self, filesystems, records);
+
+    /* run heavy tasks, independent filesystems are processed in parallel */
+    pool = g_thread_pool_new (btd_scheduler_pool_run_func,
+                              self,
+                              MIN (priv->max_parallel, filesystems->len),
+                              FALSE,
+                              error);
+    if (pool == NULL) {
+        priv->running = FALSE;
+        return FALSE;
+    }
+    for (guint i = 0; i < filesystems->len; i++) {
+        BtdSchedulerJob *job = g_new0 (BtdSchedulerJob, 1);
+        job->bfs = g_ptr_array_index (filesystems, i);
+        job->record = g_ptr_array_index (records, i);
+        job->reference_time = priv->reference_time;
+
+        g_atomic_int_inc (&priv->heavy_jobs);
+        if (!g_thread_pool_push (pool, job, &tmp_error)) {
+            btd_warning ("Unable to queue maintenance of %s: %s",
+                         btd_filesystem_get_mountpoint (job->bfs),
+                         tmp_error->message);
+            g_clear_error (&tmp_error);
+            g_atomic_int_add (&priv->heavy_jobs, -1);
+            g_free (job);
+        }
+    }
 
-        if (g_hash_table_contains (known_devices, GUINT_TO_POINTER (devno))) {
-            btd_debug ("Skipping %s, filesystem was already handled via a previous mount.",
-                       btd_filesystem_get_mountpoint (bfs));
+    /* keep checking for errors while heavy actions are running, and keep
+     * the main loop responsive for events in case we are running as daemon */
+    tick_source_id = g_timeout_add_seconds (BTD_LIGHT_LANE_POLL_INTERVAL,
+                                            btd_scheduler_light_lane_tick_cb,
+                                            &tick_pending);
+    while (g_atomic_int_get (&priv->heavy_jobs) > 0) {
+        g_main_context_iteration (NULL, TRUE);
+        if (!tick_pending)
             continue;
+
+        tick_pending = FALSE;
+        /* only the light lane reads the reference time from here on, see btd_scheduler_load() */
+        priv->reference_time = time (NULL) - 60;
+        btd_scheduler_run_light_lane (self, filesystems, records);
+    }
+    g_source_remove (tick_source_id);
+
+    /* wait for all jobs to complete */
+    g_thread_pool_free (pool, FALSE, TRUE);
+
+    /* report errors the heavy actions found right away */
+    priv->reference_time = MAX (priv->reference_time, time (NULL) - 60);
+    btd_scheduler_run_light_lane (self, filesystems, records);
+    priv->running = FALSE;
+
+    return TRUE;
+}
+
+/**
+ * btd_scheduler_get_next_run_time:
+ * @self: An instance of #BtdScheduler
+ *
+ * Find the time at which the next maintenance action becomes due.
+ * Actions that failed or were postponed, e.g. because the system was busy,
+ * only count once they may be retried, so the result is only in the past
+ * if an action is actually overdue.
+ *
+ * Returns: UNIX timestamp of the next due action, or 0 if no action is scheduled.
+ */
+time_t
+btd_scheduler_get_next_run_time (BtdScheduler *self)
+{
+    BtdSchedulerPrivate *priv = GET_PRIVATE (self);
+    g_autoptr(GPtrArray) filesystems = NULL;
+    time_t next_time = 0;
+
+    if (!priv->loaded || priv->mountpoints->len == 0)
+        return 0;
+
+    filesystems = btd_scheduler_get_unique_filesystems (self);
+    for (guint i = 0; i < filesystems->len; i++) {
+        BtdFilesystem *bfs = g_ptr_array_index (filesystems, i);
+        BtdFsRecord *record = btd_scheduler_get_record (self, bfs);
+
+        for (guint j = 0; btd_action_functions[j].func != NULL; j++) {
+            BtdBtrfsAction action = btd_action_functions[j].action;
+            g_autoptr(BtdWindow) window = NULL;
+            gint64 last_time;
+            time_t interval_time;
+            time_t due_time;
+
+            interval_time = (time_t) btd_scheduler_get_action_period (self, bfs, record, action);
+            if (interval_time == 0)
+                continue;
+
+            /* an action is run once the reference time, which lags a minute behind, exceeds the interval */
+            last_time = btd_fs_record_get_last_action_time (record, action);
+            due_time = btd_scheduler_get_due_time (self,
+                                                   bfs,
+                                                   record,
+                                                   action,
+                                                   last_time,
+                                                   interval_time);
+            due_time += 61;
+            due_time = MAX (due_time,
+                            btd_fs_record_get_value_int (record,
+                                                         "attempts",
+                                                         btd_btrfs_action_to_string (action),
+                                                         0) +
+                                BTD_ACTION_RETRY_INTERVAL + 61);
+            due_time = MAX (due_time,
+                            btd_fs_record_get_value_int (record,
+                                                         "postponed",
+                                                         btd_btrfs_action_to_string (action),
+                                                         0));
+
+            /* actions with a maintenance window only become due once it opens */
+            window = btd_scheduler_get_action_window (self, bfs, action);
+            if (window != NULL) {
+                g_autoptr(GDateTime) due_dt = NULL;
+
+                due_time = MAX (due_time, time (NULL));
+                due_dt = g_date_time_new_from_unix_local (due_time);
+                due_time += btd_window_get_time_to_open (window, due_dt);
+            }
+            if (next_time == 0 || due_time < next_time)
+                next_time = due_time;
+        }
+    }
+
+    return next_time;
+}
+
+static gint64
+btd_get_config_mtime (void)
+{
+    struct stat sb;
+
+    if (stat (BTD_CONFIG_FNAME, &sb) != 0)
+        return 0;
+    return (gint64) sb.st_mtime;
+}
+
+/**
+ * btd_scheduler_is_idle:
+ * @self: An instance of #BtdScheduler
+ *
+ * Check the cached schedule written by the last run to find out whether
+ * any action could be due, without loading the configuration, the mount
+ * table or any state records.
+ * The cache is invalid if the configuration or the set of mounted Btrfs
+ * filesystems changed since it was written.
+ *
+ * The cached time is the one of btd_scheduler_get_next_run_time(), so it
+ * already accounts for actions that were postponed or failed and are only
+ * retried later. If it lies in the past, an action is overdue and a full run
+ * is needed. The daemon never consults this, as it keeps the state records
+ * in memory and arms its timer from btd_scheduler_get_next_run_time().
+ *
+ * Returns: %TRUE if we know for certain that no action is due yet.
+ */
+gboolean
+btd_scheduler_is_idle (BtdScheduler *self)
+{
+    BtdSchedulerPrivate *priv = GET_PRIVATE (self);
+    g_autoptr(GKeyFile) schedule = g_key_file_new ();
+    g_autofree gchar *schedule_fname = NULL;
+    g_autofree gchar *version = NULL;
+    g_autofree gchar *mounts = NULL;
+    g_autofree gchar *current_mounts = NULL;
+    gint64 next_run;
+
+    schedule_fname = g_build_filename (priv->state_dir, BTD_SCHEDULE_FNAME, NULL);
+    if (!g_key_file_load_from_file (schedule, schedule_fname, G_KEY_FILE_NONE, NULL))
+        return FALSE;
+
+    version = g_key_file_get_string (schedule, "schedule", "version", NULL);
+    if (!btd_str_equal0 (version, PACKAGE_VERSION))
+        return FALSE;
+    if (g_key_file_get_int64 (schedule, "schedule", "config_mtime", NULL) !=
+        btd_get_config_mtime ())
+        return FALSE;
+
+    mounts = g_key_file_get_string (schedule, "schedule", "mounts", NULL);
+    current_mounts = btd_get_btrfs_mounts_fingerprint ();
+    if (current_mounts == NULL || !btd_str_equal0 (mounts, current_mounts))
+        return FALSE;
+
+    /* a next run time of zero means there is nothing scheduled at all, one in the past
+     * that an action is overdue, e.g. because the machine was powered off */
+    next_run = g_key_file_get_int64 (schedule, "schedule", "next_run", NULL);
+    return next_run == 0 || next_run > (gint64) time (NULL);
+}
+
+static gchar *
+btd_scheduler_reschedule_timer (BtdScheduler *self, time_t next_time, const gchar *prev_unit)
+{
+    g_autofree gchar *unit_name = NULL;
+    g_autofree gchar *exe_path = NULL;
+    g_autofree gchar *calendar_arg = NULL;
+    g_autofree gchar *unit_arg = NULL;
+    g_autoptr(GDateTime) next_dt = NULL;
+
+#ifdef HAVE_SYSTEMD
+    if (sd_booted () <= 0)
+        return NULL;
+#else
+    return NULL;
+#endif
+
+    exe_path = g_file_read_link ("/proc/self/exe", NULL);
+    if (exe_path == NULL)
+        return NULL;
+
+    /* drop a previously scheduled wakeup that is no longer needed */
+    unit_name = g_strdup_printf ("btrfsd-at-%" G_GINT64_FORMAT, (gint64) next_time);
+    if (prev_unit != NULL && !btd_str_equal0 (prev_unit, unit_name)) {
+        g_autofree gchar *timer_name = g_strconcat (prev_unit, ".timer", NULL);
+        const gchar *stop_argv[] = { "systemctl", "stop", "--quiet", timer_name, NULL };
+        btd_scheduler_spawn_quiet (stop_argv);
+    }
+
+    /* this fails harmlessly if the timer already exists */
+    next_dt = g_date_time_new_from_unix_utc (next_time);
+    calendar_arg = g_date_time_format (next_dt, "--on-calendar=%Y-%m-%d %H:%M:%S UTC");
+    unit_arg = g_strconcat ("--unit=", unit_name, NULL);
+    {
+        const gchar *run_argv[] = { "systemd-run",
+                                    "--quiet",
+                                    "--collect",
+                                    unit_arg,
+                                    calendar_arg,
+                                    "--timer-property=AccuracySec=1min",
+                                    "--timer-property=RemainAfterElapse=no",
+                                    "--property=IOSchedulingClass=idle",
+                                    "--property=CPUSchedulingPolicy=idle",
+                                    exe_path,
+                                    NULL };
+        btd_scheduler_spawn_quiet (run_argv);
+    }
+    btd_debug ("Scheduled next wakeup via %s.timer", unit_name);
+
+    return g_steal_pointer (&unit_name);
+}
+
+/**
+ * btd_scheduler_update_schedule:
+ * @self: An instance of #BtdScheduler
+ *
+ * Write the cached schedule used by btd_scheduler_is_idle(), and
+ * schedule a transient systemd timer for the next due action if
+ * the "dynamic_timer" setting is enabled.
+ */
+void
+btd_scheduler_update_schedule (BtdScheduler *self)
+{
+    BtdSchedulerPrivate *priv = GET_PRIVATE (self);
+    g_autoptr(GKeyFile) schedule = g_key_file_new ();
+    g_autoptr(GError) error = NULL;
+    g_autofree gchar *schedule_fname = NULL;
+    g_autofree gchar *mounts = NULL;
+    g_autofree gchar *prev_unit = NULL;
+    g_autofree gchar *timer_unit = NULL;
+    time_t next_time;
+
+    schedule_fname = g_build_filename (priv->state_dir, BTD_SCHEDULE_FNAME, NULL);
+    if (g_key_file_load_from_file (schedule, schedule_fname, G_KEY_FILE_NONE, NULL))
+        prev_unit = g_key_file_get_string (schedule, "schedule", "timer_unit", NULL);
+
+    mounts = btd_get_btrfs_mounts_fingerprint ();
+    if (mounts == NULL) {
+        g_unlink (schedule_fname);
+        return;
+    }
+
+    next_time = btd_scheduler_get_next_run_time (self);
+    if (priv->dynamic_timer && next_time > 0)
+        timer_unit = btd_scheduler_reschedule_timer (self, next_time, prev_unit);
+
+    g_key_file_set_string (schedule, "schedule", "version", PACKAGE_VERSION);
+    g_key_file_set_int64 (schedule, "schedule", "config_mtime", btd_get_config_mtime ());
+    g_key_file_set_string (schedule, "schedule", "mounts", mounts);
+    g_key_file_set_int64 (schedule, "schedule", "next_run", (gint64) next_time);
+    if (timer_unit != NULL)
+        g_key_file_set_string (schedule, "schedule", "timer_unit", timer_unit);
+    else
+        g_key_file_remove_key (schedule, "schedule", "timer_unit", NULL);
+
+    if (!g_key_file_save_to_file (schedule, schedule_fname, &error))
+        btd_warning ("Unable to save schedule: %s", error->message);
+}
+
+/**
+ * btd_scheduler_is_running:
+ * @self: An instance of #BtdScheduler
+ *
+ * Returns: %TRUE if maintenance actions are currently being run.
+ */
+gboolean
+btd_scheduler_is_running (BtdScheduler *self)
+{
+    BtdSchedulerPrivate *priv = GET_PRIVATE (self);
+    return priv->running;
+}
+
+/**
+ * btd_scheduler_stop:
+ * @self: An instance of #BtdScheduler
+ *
+ * Cancel running scrubs and pause running balance operations, so they
+ * can be resumed from where they stopped later, and don't start any
+ * other I/O heavy actions. btd_scheduler_run() returns once all
+ * actions have wound down.
+ */
+void
+btd_scheduler_stop (BtdScheduler *self)
+{
+    BtdSchedulerPrivate *priv = GET_PRIVATE (self);
+    g_cancellable_cancel (priv->cancellable);
+}
+
+/**
+ * btd_scheduler_set_persistent:
+ * @self: An instance of #BtdScheduler
+ * @persistent: %TRUE if the scheduler is kept running by a daemon.
+ *
+ * Tell the scheduler whether it is run persistently. Scrubs are only
+ * handed to detached helper processes if btrfsd exits after a run.
+ */
+void
+btd_scheduler_set_persistent (BtdScheduler *self, gboolean persistent)
+{
+    BtdSchedulerPrivate *priv = GET_PRIVATE (self);
+    priv->persistent = persistent;
+}
+
+typedef struct {
+    const gchar *fname;
+    BtdScrubJob *job;
+} BtdScrubJobCheckpoint;
+
+static void
+btd_scheduler_scrub_job_checkpoint_cb (GPtrArray *scrub_devices, gpointer user_data)
+{
+    BtdScrubJobCheckpoint *checkpoint = user_data;
+    g_autoptr(GError) error = NULL;
+
+    if (!btd_scrub_job_save (checkpoint->fname, checkpoint->job, scrub_devices, &error))
+        btd_warning ("Unable to checkpoint scrub job for %s: %s",
+                     checkpoint->job->mountpoint,
+                     error->message);
+}
+
+/**
+ * btd_scheduler_run_scrub_job:
+ * @self: An instance of #BtdScheduler
+ * @job_fname: Path to the scrub job file.
+ * @error: A #GError
+ *
+ * Run a scrub described by a job file in the foreground, and store its
+ * progress and results in that file. This is used by the helper process
+ * that runs detached scrubs, the results are picked up by the next
+ * regular scheduler run.
+ *
+ * Returns: %TRUE if the scrub ran without errors.
+ */
+gboolean
+btd_scheduler_run_scrub_job (BtdScheduler *self, const gchar *job_fname, GError **error)
+{
+    BtdSchedulerPrivate *priv = GET_PRIVATE (self);
+    g_autoptr(GPtrArray) scrub_devices = NULL;
+    g_autoptr(GError) tmp_error = NULL;
+    g_auto(BtdScrubJob) job = { 0 };
+    g_autoptr(BtdPressureMonitor) pressure = NULL;
+    BtdScrubJobCheckpoint checkpoint = { 0 };
+    BtdFilesystem *bfs = NULL;
+    gboolean ret;
+
+    scrub_devices = btd_scrub_job_load (job_fname, &job, error);
+    if (scrub_devices == NULL)
+        return FALSE;
+
+    for (guint i = 0; i < priv->mountpoints->len; i++) {
+        BtdFilesystem *mount_bfs = g_ptr_array_index (priv->mountpoints, i);
+        if (btd_str_equal0 (btd_filesystem_get_mountpoint (mount_bfs), job.mountpoint)) {
+            bfs = mount_bfs;
+            break;
         }
+    }
+    if (bfs == NULL) {
+        g_set_error (error,
+                     BTD_BTRFS_ERROR,
+                     BTD_BTRFS_ERROR_SCRUB_FAILED,
+                     "No Btrfs filesystem is mounted at '%s'.",
+                     job.mountpoint);
+        return FALSE;
+    }
+
+    checkpoint.fname = job_fname;
+    checkpoint.job = &job;
+    pressure = btd_scheduler_new_pressure_monitor (bfs, job.pressure_threshold);
+    ret = btd_filesystem_scrub (bfs,
+                                scrub_devices,
+                                job.max_runtime,
+                                job.max_parallel,
+                                pressure,
+                                btd_scheduler_scrub_job_checkpoint_cb,
+                                &checkpoint,
+                                priv->cancellable,
+                                &tmp_error);
+
+    /* we run in a transient unit of our own, so its cgroup accounts exactly for the scrub */
+    if (!btd_cgroup_read_own_io_stat (&job.io_read_bytes, &job.io_write_bytes))
+        btd_debug ("Unable to determine the I/O caused by the scrub of %s", job.mountpoint);
+
+    /* always store the results, even if scrubbing some devices failed */
+    job.finish_time = (gint64) time (NULL);
+    if (!btd_scrub_job_save (job_fname, &job, scrub_devices, error))
+        return FALSE;
 
-        g_hash_table_add (known_devices, GUINT_TO_POINTER (devno));
-        btd_scheduler_run_for_mount (self, bfs);
+    if (!ret) {
+        g_propagate_error (error, g_steal_pointer (&tmp_error));
+        return FALSE;
     }
 
     return TRUE;
 }
 
+/**
+ * btd_scheduler_get_watch_kernel_log:
+ * @self: An instance of #BtdScheduler
+ *
+ * Returns: %TRUE if the kernel log should be watched for Btrfs errors.
+ */
+gboolean
+btd_scheduler_get_watch_kernel_log (BtdScheduler *self)
+{
+    BtdSchedulerPrivate *priv = GET_PRIVATE (self);
+    return priv->watch_kernel_log;
+}
+
+/**
+ * btd_scheduler_find_filesystem_for_device:
+ * @self: An instance of #BtdScheduler
+ * @device_name: Kernel name of a block device, e.g. "sda1".
+ *
+ * Find the filesystem a block device belongs to.
+ *
+ * Returns: (transfer none) (nullable): The #BtdFilesystem, or %NULL if none was found.
+ */
+BtdFilesystem *
+btd_scheduler_find_filesystem_for_device (BtdScheduler *self, const gchar *device_name)
+{
+    g_autoptr(GPtrArray) filesystems = btd_scheduler_get_unique_filesystems (self);
+
+    for (guint i = 0; i < filesystems->len; i++) {
+        BtdFilesystem *bfs = g_ptr_array_index (filesystems, i);
+        if (btd_filesystem_has_device_name (bfs, device_name))
+            return bfs;
+    }
+
+    return NULL;
+}
+
+/**
+ * btd_scheduler_check_errors:
+ * @self: An instance of #BtdScheduler
+ * @bfs: The #BtdFilesystem to check.
+ *
+ * Run the stats action on a filesystem immediately, independent of its
+ * schedule, and notify about any errors found.
+ * This must be called from the thread that runs the scheduler.
+ */
+void
+btd_scheduler_check_errors (BtdScheduler *self, BtdFilesystem *bfs)
+{
+    BtdSchedulerPrivate *priv = GET_PRIVATE (self);
+    BtdFsRecord *record;
+    g_autoptr(GError) error = NULL;
+
+    record = btd_scheduler_get_record (self, bfs);
+    priv->reference_time = MAX (priv->reference_time, time (NULL) - 60);
+
+    if (btd_scheduler_run_stats (self, bfs, record))
+        btd_fs_record_set_last_action_time_now (record, BTD_BTRFS_ACTION_STATS);
+    if (!btd_fs_record_save (record, &error))
+        btd_warning ("Unable to save state record for mount '%s': %s",
+                     btd_filesystem_get_mountpoint (bfs),
+                     error->message);
+}
+
+static void
+btd_scheduler_print_scrub_results (BtdFilesystem *bfs, BtdFsRecord *record)
+{
+    g_autoptr(GPtrArray) devices = NULL;
+
+    devices = btd_filesystem_get_devices (bfs, NULL);
+    if (devices == NULL)
+        return;
+
+    for (guint i = 0; i < devices->len; i++) {
+        BtdDeviceInfo *dinfo = g_ptr_array_index (devices, i);
+        g_autofree gchar *group = btd_get_scrub_device_group (dinfo->devid);
+        g_autofree gchar *bytes_str = NULL;
+        g_autofree gchar *rate_str = NULL;
+        gint64 bytes_scrubbed;
+        gint64 duration;
+        gint64 errors;
+        gint64 cursor;
+
+        bytes_scrubbed = btd_fs_record_get_value_int (record, group, "bytes_scrubbed", -1);
+        if (bytes_scrubbed < 0)
+            continue;
+        duration = btd_fs_record_get_value_int (record, group, "duration", 0);
+        errors = btd_fs_record_get_value_int (record, group, "read_errors", 0) +
+                 btd_fs_record_get_value_int (record, group, "csum_errors", 0) +
+                 btd_fs_record_get_value_int (record, group, "verify_errors", 0) +
+                 btd_fs_record_get_value_int (record, group, "uncorrectable_errors", 0);
+
+        bytes_str = g_format_size_full (bytes_scrubbed, G_FORMAT_SIZE_IEC_UNITS);
+        rate_str = g_format_size_full (bytes_scrubbed / MAX (duration, 1),
+                                       G_FORMAT_SIZE_IEC_UNITS);
+        g_print ("    %s: %s at %s/s, %" G_GINT64_FORMAT " errors, %" G_GINT64_FORMAT
+                 " corrected\n",
+                 dinfo->path,
+                 bytes_str,
+                 rate_str,
+                 errors,
+                 btd_fs_record_get_value_int (record, group, "corrected_errors", 0));
+
+        cursor = btd_fs_record_get_value_int (record, group, "cursor", 0);
+        if (cursor > 0 && dinfo->total_bytes > 0)
+            g_print ("      Scrub position: %.1f%%\n",
+                     MIN (100.0, (gdouble) cursor * 100.0 / (gdouble) dinfo->total_bytes));
+    }
+
+    if (btd_fs_record_get_value_int (record, "scrub", "io_read_bytes", 0) > 0) {
+        g_autofree gchar *read_str = NULL;
+        g_autofree gchar *write_str = NULL;
+
+        read_str = g_format_size_full (
+            btd_fs_record_get_value_int (record, "scrub", "io_read_bytes", 0),
+            G_FORMAT_SIZE_IEC_UNITS);
+        write_str = g_format_size_full (
+            btd_fs_record_get_value_int (record, "scrub", "io_write_bytes", 0),
+            G_FORMAT_SIZE_IEC_UNITS);
+        g_print ("    Total I/O: %s read, %s written\n", read_str, write_str);
+    }
+}
+
 /**
  * btd_scheduler_print_fs_status_entry:
  * @self: An instance of #BtdScheduler
@@ -540,6 +3144,8 @@ btd_scheduler_print_fs_status_entry (BtdScheduler *self, GPtrArray *mountpoints)
 {
     BtdFilesystem *bfs;
     gboolean errors_found = FALSE;
+    g_autoptr(BtdFsUsage) usage = NULL;
+    g_autoptr(GPtrArray) disks = NULL;
     g_autoptr(GError) error = NULL;
 
     if (mountpoints->len == 0)
@@ -575,16 +3181,49 @@ btd_scheduler_print_fs_status_entry (BtdScheduler *self, GPtrArray *mountpoints)
                  0);
     }
 
+    usage = btd_filesystem_read_usage (bfs, &error);
+    if (usage == NULL) {
+        g_print ("  Usage: Unknown (%s)\n", error->message);
+        g_clear_error (&error);
+    } else {
+        g_autofree gchar *usage_text = btd_fs_usage_to_text (usage);
+        g_auto(GStrv) usage_lines = g_strsplit (usage_text, "\n", -1);
+
+        g_print ("  Usage:\n");
+        for (guint i = 0; usage_lines[i] != NULL; i++)
+            g_print ("    %s\n", usage_lines[i]);
+    }
+
+    disks = btd_topology_get_disks (bfs);
+    if (disks != NULL && disks->len > 0) {
+        g_print ("  Disks:\n");
+        for (guint i = 0; i < disks->len; i++) {
+            BtdDisk *disk = g_ptr_array_index (disks, i);
+            g_print ("    %s (%s, controller: %s)\n",
+                     disk->name,
+                     disk->rotational ? "HDD" : "SSD",
+                     disk->controller != NULL ? disk->controller : "unknown");
+        }
+    }
+
     for (guint j = BTD_BTRFS_ACTION_UNKNOWN + 1; j < BTD_BTRFS_ACTION_LAST; j++) {
         g_autoptr(BtdFsRecord) record = NULL;
         g_autofree gchar *last_action_time_str = NULL;
+        g_autofree gchar *busy_reason = NULL;
         gint64 last_action_timestamp;
         g_autofree gchar *interval_time = btd_humanize_time (
-            (gint64) btd_scheduler_get_config_duration_for_action (self, bfs, j));
+            (gint64) btd_scheduler_get_action_period (self, bfs, NULL, j));
         g_print ("  • %s\n"
                  "    Runs every %s\n",
                  btd_btrfs_action_to_human_string (j),
                  interval_time);
+        if (j == BTD_BTRFS_ACTION_SCRUB && btd_scheduler_get_scrub_slices (self, bfs) > 1) {
+            g_autofree gchar *pass_time = btd_humanize_time (
+                (gint64) btd_scheduler_get_config_duration_for_action (self, bfs, j));
+            g_print ("    Rolling mode, full pass every %s in %u slices\n",
+                     pass_time,
+                     btd_scheduler_get_scrub_slices (self, bfs));
+        }
 
         record = btd_fs_record_new (btd_filesystem_get_mountpoint (bfs));
         if (!btd_fs_record_load (record, &error)) {
@@ -605,6 +3244,44 @@ btd_scheduler_print_fs_status_entry (BtdScheduler *self, GPtrArray *mountpoints)
             last_action_time_str = g_date_time_format (last_action_dt, "%Y-%m-%d %H:%M:%S");
         }
         g_print ("    Last run: %s\n", last_action_time_str);
+        busy_reason = btd_fs_record_get_value_str (record, "busy", btd_btrfs_action_to_string (j));
+        if (busy_reason != NULL)
+            g_print ("    Deferred: %s\n", busy_reason);
+
+        if (j == BTD_BTRFS_ACTION_SCRUB && last_action_timestamp != 0)
+            btd_scheduler_print_scrub_results (bfs, record);
+        if (j == BTD_BTRFS_ACTION_SCRUB &&
+            btd_scheduler_get_action_period (self, bfs, record, j) !=
+                btd_scheduler_get_action_period (self, bfs, NULL, j)) {
+            g_autofree gchar *adapted_time = btd_humanize_time (
+                (gint64) btd_scheduler_get_action_period (self, bfs, record, j));
+            g_print ("    Adapted to scrub history, currently runs every %s\n", adapted_time);
+        }
+        if (j == BTD_BTRFS_ACTION_SCRUB) {
+            g_autofree gchar *job_fname = btd_scheduler_get_scrub_job_fname (self, bfs);
+            if (g_file_test (job_fname, G_FILE_TEST_EXISTS))
+                g_print ("    State: running in the background\n");
+            else if (btd_fs_record_get_value_int (record, "scrub", "interrupted", 0) != 0)
+                g_print ("    State: interrupted, will be resumed\n");
+        }
+        if ((j == BTD_BTRFS_ACTION_VERIFY_RECENT || j == BTD_BTRFS_ACTION_METADATA_SCRUB) &&
+            last_action_timestamp != 0) {
+            const gchar *group = btd_btrfs_action_to_string (j);
+            gint64 bytes_verified = btd_fs_record_get_value_int (record,
+                                                                 group,
+                                                                 "bytes_verified",
+                                                                 -1);
+            if (bytes_verified >= 0) {
+                g_autofree gchar *bytes_str = g_format_size_full (bytes_verified,
+                                                                  G_FORMAT_SIZE_IEC_UNITS);
+                g_print ("    Last verified: %s, %" G_GINT64_FORMAT " errors\n",
+                         bytes_str,
+                         btd_fs_record_get_value_int (record, group, "errors", 0));
+            }
+        }
+        if (j == BTD_BTRFS_ACTION_BALANCE &&
+            btd_fs_record_get_value_int (record, "balance", "paused", 0) != 0)
+            g_print ("    State: paused, will be resumed\n");
 
         if (j == BTD_BTRFS_ACTION_STATS) {
             g_autofree gchar *mail_address = btd_scheduler_get_config_value (self,
@@ -634,7 +3311,6 @@ btd_scheduler_print_status (BtdScheduler *self)
 {
     BtdSchedulerPrivate *priv = GET_PRIVATE (self);
     gboolean errors_found = FALSE;
-    g_autoptr(GHashTable) devno_map = NULL;
     GHashTableIter ht_iter;
     gpointer ht_value;
 
@@ -643,34 +3319,13 @@ btd_scheduler_print_status (BtdScheduler *self)
         return TRUE;
     }
 
-    /* create a map of devno -> mountpoints */
-    devno_map = g_hash_table_new_full (g_direct_hash,
-                                       g_direct_equal,
-                                       NULL,
-                                       (GDestroyNotify) g_ptr_array_unref);
-    for (guint i = 0; i < priv->mountpoints->len; i++) {
-        BtdFilesystem *bfs = BTD_FILESYSTEM (g_ptr_array_index (priv->mountpoints, i));
-        GPtrArray *array = NULL;
-        dev_t devno = btd_filesystem_get_devno (bfs);
-
-        array = g_hash_table_lookup (devno_map, GUINT_TO_POINTER (devno));
-        if (!array) {
-            array = g_ptr_array_new_with_free_func (g_object_unref);
-            g_hash_table_insert (devno_map, GUINT_TO_POINTER (devno), array);
-        }
-        g_ptr_array_add (array, g_object_ref (bfs));
-    }
-
     g_print ("Running on battery: %s\n", btd_machine_is_on_battery () ? "yes" : "no");
 
     g_print ("Status:\n");
-    g_hash_table_iter_init (&ht_iter, devno_map);
+    g_hash_table_iter_init (&ht_iter, priv->devno_map);
     while (g_hash_table_iter_next (&ht_iter, NULL, &ht_value)) {
         GPtrArray *mps = (GPtrArray *) ht_value;
 
-        /* sort mountpoints to get a predictable order */
-        g_ptr_array_sort (mps, btd_filesystem_compare);
-
         if (!btd_scheduler_print_fs_status_entry (self, mps))
             errors_found = TRUE;
     }
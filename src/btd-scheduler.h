@@ -7,6 +7,9 @@
 #pragma once
 
 #include <glib-object.h>
+#include <time.h>
+
+#include "btd-filesystem.h"
 
 G_BEGIN_DECLS
 
@@ -24,11 +27,27 @@ struct _BtdSchedulerClass {
     void (*_as_reserved6) (void);
 };
 
-BtdScheduler *btd_scheduler_new (void);
-gboolean      btd_scheduler_load (BtdScheduler *self, GError **error);
-
-gboolean      btd_scheduler_run (BtdScheduler *self, GError **error);
-
-gboolean      btd_scheduler_print_status (BtdScheduler *self);
+BtdScheduler  *btd_scheduler_new (void);
+gboolean       btd_scheduler_load (BtdScheduler *self, GError **error);
+gboolean       btd_scheduler_reload (BtdScheduler *self, GError **error);
+gboolean       btd_scheduler_refresh_mounts (BtdScheduler *self, GError **error);
+
+gboolean       btd_scheduler_run (BtdScheduler *self, GError **error);
+time_t         btd_scheduler_get_next_run_time (BtdScheduler *self);
+gboolean       btd_scheduler_is_running (BtdScheduler *self);
+void           btd_scheduler_stop (BtdScheduler *self);
+gboolean       btd_scheduler_is_idle (BtdScheduler *self);
+void           btd_scheduler_update_schedule (BtdScheduler *self);
+void           btd_scheduler_set_persistent (BtdScheduler *self, gboolean persistent);
+gboolean       btd_scheduler_run_scrub_job (BtdScheduler *self,
+                                            const gchar  *job_fname,
+                                            GError      **error);
+
+gboolean       btd_scheduler_get_watch_kernel_log (BtdScheduler *self);
+BtdFilesystem *btd_scheduler_find_filesystem_for_device (BtdScheduler *self,
+                                                         const gchar  *device_name);
+void           btd_scheduler_check_errors (BtdScheduler *self, BtdFilesystem *bfs);
+
+gboolean       btd_scheduler_print_status (BtdScheduler *self);
 
 G_END_DECLS
@@ -0,0 +1,855 @@
+/*
+ * Copyright (C) Matthias Klumpp <matthias@tenstral.net>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+/**
+ * SECTION:btd-scrub
+ * @short_description: Native scrub engine.
+ *
+ * Runs scrub operations on the devices of a Btrfs filesystem directly via
+ * the kernel's scrub ioctls, so we can observe their progress while they run.
+ */
+
+#include "config.h"
+#include "btd-scrub.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/btrfs.h>
+
+#include "btd-utils.h"
+#include "btd-logging.h"
+#include "btd-tree-search.h"
+#include "btd-pressure.h"
+
+/* interval in seconds at which we query the kernel for scrub progress */
+#define BTD_SCRUB_POLL_INTERVAL 10
+
+/* interval in seconds at which the scrub position is checkpointed */
+#define BTD_SCRUB_CHECKPOINT_INTERVAL 60
+
+/* maximum time in seconds to wait for high I/O pressure to subside before giving up */
+#define BTD_SCRUB_MAX_PRESSURE_WAIT (60 * 60)
+
+typedef struct {
+    GMutex lock;
+    GCond cond;
+    gint fd;
+    const gchar *fsid;
+    guint n_running;
+    gboolean cancel_requested;
+    gboolean pressure_paused;
+} BtdScrubContext;
+
+typedef struct {
+    BtdScrubContext *ctx;
+    BtdScrubDevice *sdev;
+    GThread *thread;
+    gboolean pending;
+
+    /* results of earlier runs on this device, if it is resumed after a pause */
+    BtdScrubDevice base;
+} BtdScrubWorker;
+
+/**
+ * btd_scrub_device_new:
+ * @devid: The Btrfs device ID.
+ * @path: Path to the device.
+ *
+ * Create a new scrub unit for the whole device.
+ *
+ * Returns: (transfer full): a new #BtdScrubDevice
+ */
+BtdScrubDevice *
+btd_scrub_device_new (guint64 devid, const gchar *path)
+{
+    BtdScrubDevice *sdev = g_new0 (BtdScrubDevice, 1);
+    sdev->devid = devid;
+    sdev->path = g_strdup (path);
+    sdev->start = 0;
+    sdev->end = G_MAXUINT64;
+    return sdev;
+}
+
+/**
+ * btd_scrub_device_free:
+ * @sdev: A #BtdScrubDevice
+ *
+ * Free a scrub device struct.
+ */
+void
+btd_scrub_device_free (BtdScrubDevice *sdev)
+{
+    if (sdev == NULL)
+        return;
+    g_free (sdev->path);
+    g_free (sdev);
+}
+
+/**
+ * btd_scrub_device_get_error_count:
+ * @sdev: A #BtdScrubDevice
+ *
+ * Returns: The number of issues that were found while scrubbing this device.
+ */
+guint64
+btd_scrub_device_get_error_count (BtdScrubDevice *sdev)
+{
+    return sdev->read_errors + sdev->csum_errors + sdev->verify_errors +
+           sdev->uncorrectable_errors;
+}
+
+static void
+btd_scrub_device_update (BtdScrubDevice *sdev,
+                         const BtdScrubDevice *base,
+                         struct btrfs_scrub_progress *progress)
+{
+    sdev->bytes_scrubbed = base->bytes_scrubbed + progress->data_bytes_scrubbed +
+                           progress->tree_bytes_scrubbed;
+    sdev->read_errors = base->read_errors + progress->read_errors;
+    sdev->csum_errors = base->csum_errors + progress->csum_errors;
+    sdev->verify_errors = base->verify_errors + progress->verify_errors;
+    sdev->corrected_errors = base->corrected_errors + progress->corrected_errors;
+    sdev->uncorrectable_errors = base->uncorrectable_errors + progress->uncorrectable_errors;
+    sdev->last_physical = MAX (base->last_physical, progress->last_physical);
+}
+
+static gboolean
+btd_scrub_set_speed_max (const gchar *fsid,
+                         guint64 devid,
+                         guint64 speed_max,
+                         guint64 *old_speed_max)
+{
+    g_autofree gchar *fname = NULL;
+    g_autofree gchar *value = NULL;
+    gssize written;
+    gint fd;
+
+    /* the per-device scrub throttle exists since Linux 5.14 */
+    fname = g_strdup_printf ("/sys/fs/btrfs/%s/devinfo/%" G_GUINT64_FORMAT "/scrub_speed_max",
+                             fsid,
+                             devid);
+    if (old_speed_max != NULL) {
+        g_autofree gchar *contents = NULL;
+        if (!g_file_get_contents (fname, &contents, NULL, NULL))
+            return FALSE;
+        *old_speed_max = g_ascii_strtoull (contents, NULL, 10);
+    }
+
+    /* sysfs attributes have to be written in place, so we can't use g_file_set_contents() */
+    fd = open (fname, O_WRONLY | O_CLOEXEC);
+    if (fd < 0)
+        return FALSE;
+    value = g_strdup_printf ("%" G_GUINT64_FORMAT "\n", speed_max);
+    written = write (fd, value, strlen (value));
+    close (fd);
+
+    return written == (gssize) strlen (value);
+}
+
+static gpointer
+btd_scrub_device_thread (gpointer data)
+{
+    BtdScrubWorker *worker = data;
+    BtdScrubContext *ctx = worker->ctx;
+    BtdScrubDevice *sdev = worker->sdev;
+    struct btrfs_ioctl_scrub_args args = { 0 };
+    gboolean speed_set = FALSE;
+    guint64 old_speed_max = 0;
+    gint64 time_start;
+    gint ret;
+    gint errsv;
+
+    args.devid = sdev->devid;
+    args.start = MAX (sdev->start, worker->base.last_physical);
+    args.end = sdev->end;
+
+    if (sdev->speed_max > 0 && ctx->fsid != NULL) {
+        speed_set = btd_scrub_set_speed_max (ctx->fsid,
+                                             sdev->devid,
+                                             sdev->speed_max,
+                                             &old_speed_max);
+        if (!speed_set)
+            btd_debug ("Unable to limit scrub speed of %s, the kernel may be too old.",
+                       sdev->path);
+    }
+
+    time_start = g_get_monotonic_time ();
+    ret = ioctl (ctx->fd, BTRFS_IOC_SCRUB, &args);
+    errsv = errno;
+
+    /* restore the limit the administrator may have configured */
+    if (speed_set && !btd_scrub_set_speed_max (ctx->fsid, sdev->devid, old_speed_max, NULL))
+        btd_warning ("Unable to restore scrub speed limit of %s.", sdev->path);
+
+    /* the kernel returns the scrub progress even if the scrub was aborted */
+    g_mutex_lock (&ctx->lock);
+    btd_scrub_device_update (sdev, &worker->base, &args.progress);
+    sdev->duration = worker->base.duration + g_get_monotonic_time () - time_start;
+    if (ret < 0 && errsv == ECANCELED && ctx->cancel_requested) {
+        /* we cancelled the scrub ourselves, it can be resumed from its last position */
+        sdev->interrupted = TRUE;
+        sdev->error_code = 0;
+    } else {
+        sdev->error_code = ret < 0 ? errsv : 0;
+    }
+    sdev->finished = TRUE;
+    ctx->n_running--;
+    g_cond_signal (&ctx->cond);
+    g_mutex_unlock (&ctx->lock);
+
+    return NULL;
+}
+
+static void
+btd_scrub_poll_progress (BtdScrubContext *ctx, BtdScrubWorker *workers, guint n_workers)
+{
+    for (guint i = 0; i < n_workers; i++) {
+        BtdScrubDevice *sdev = workers[i].sdev;
+        struct btrfs_ioctl_scrub_args args = { 0 };
+
+        if (sdev->finished || workers[i].pending)
+            continue;
+
+        args.devid = sdev->devid;
+        if (ioctl (ctx->fd, BTRFS_IOC_SCRUB_PROGRESS, &args) < 0) {
+            /* the scrub may not have been started yet, or has just finished */
+            continue;
+        }
+        btd_scrub_device_update (sdev, &workers[i].base, &args.progress);
+
+        if (sdev->size > 0)
+            btd_debug ("Scrub of %s: %.1f%% done, %" G_GUINT64_FORMAT " errors",
+                       sdev->path,
+                       MIN (100.0, (gdouble) sdev->bytes_scrubbed * 100.0 / (gdouble) sdev->size),
+                       btd_scrub_device_get_error_count (sdev));
+    }
+}
+
+static GPtrArray *
+btd_scrub_devices_copy (GPtrArray *scrub_devices)
+{
+    GPtrArray *copy = g_ptr_array_new_full (scrub_devices->len,
+                                            (GDestroyNotify) btd_scrub_device_free);
+
+    for (guint i = 0; i < scrub_devices->len; i++) {
+        BtdScrubDevice *sdev = g_ptr_array_index (scrub_devices, i);
+        BtdScrubDevice *sdev_copy = g_memdup2 (sdev, sizeof (BtdScrubDevice));
+        sdev_copy->path = g_strdup (sdev->path);
+        g_ptr_array_add (copy, sdev_copy);
+    }
+
+    return copy;
+}
+
+static void
+btd_scrub_join_workers (BtdScrubWorker *workers, guint n_workers)
+{
+    for (guint i = 0; i < n_workers; i++)
+        g_clear_pointer (&workers[i].thread, g_thread_join);
+}
+
+static gboolean
+btd_scrub_resume_after_pressure (BtdFilesystem *bfs,
+                                 BtdScrubWorker *workers,
+                                 guint n_workers,
+                                 BtdPressureMonitor *pressure,
+                                 gint64 max_runtime,
+                                 gint64 time_start,
+                                 GCancellable *cancellable)
+{
+    const gchar *mountpoint = btd_filesystem_get_mountpoint (bfs);
+    gint64 max_wait = BTD_SCRUB_MAX_PRESSURE_WAIT;
+
+    if (max_runtime > 0)
+        max_wait = MIN (max_wait,
+                        max_runtime - (g_get_monotonic_time () - time_start) / G_USEC_PER_SEC);
+    btd_info ("Paused scrub on %s, I/O pressure is at %.1f%%.",
+              mountpoint,
+              btd_pressure_get_io_level ());
+    if (max_wait <= 0 || !btd_pressure_monitor_wait_calm (pressure, max_wait, cancellable)) {
+        btd_info ("I/O pressure on %s did not subside in time, the scrub will be resumed later.",
+                  mountpoint);
+        return FALSE;
+    }
+
+    /* continue every interrupted device from where it stopped, adding up the results */
+    btd_info ("Resuming scrub on %s", mountpoint);
+    for (guint i = 0; i < n_workers; i++) {
+        BtdScrubWorker *worker = &workers[i];
+        BtdScrubDevice *sdev = worker->sdev;
+
+        if (!sdev->interrupted)
+            continue;
+        worker->base = *sdev;
+        worker->base.path = NULL;
+        worker->base.last_physical = MAX (sdev->start, sdev->last_physical);
+        sdev->interrupted = FALSE;
+        sdev->finished = FALSE;
+        worker->pending = TRUE;
+    }
+
+    return TRUE;
+}
+
+/**
+ * btd_scrub_run:
+ * @bfs: The #BtdFilesystem to scrub.
+ * @scrub_devices: (element-type BtdScrubDevice): The devices to scrub.
+ * @max_runtime: Time in seconds after which the scrub is cancelled, or 0 for no limit.
+ * @max_parallel: Maximum number of devices to scrub at the same time, or 0 for no limit.
+ * @pressure: (nullable): Monitor for the I/O pressure at which the scrub is paused.
+ * @checkpoint_func: (scope call) (nullable): Function to persist the scrub progress periodically.
+ * @user_data: Data to pass to @checkpoint_func.
+ * @cancellable: (nullable): A #GCancellable to stop the scrub early, e.g. on shutdown.
+ * @error: A #GError, set if scrub failed.
+ *
+ * Scrub the selected devices, each on its own thread, and poll the kernel
+ * for their progress until all of them have finished. Up to @max_parallel
+ * devices are scrubbed concurrently, the next one is started as soon as
+ * another device is done.
+ * The results are stored in the #BtdScrubDevice elements, even if
+ * scrubbing some of the devices failed.
+ *
+ * If the scrub runs for longer than @max_runtime or @cancellable is triggered,
+ * it is cancelled and devices that were not fully scrubbed are marked as
+ * interrupted, so the scrub can be resumed from their last physical position later.
+ *
+ * If @pressure fires while the scrub is running, the scrub is cancelled
+ * and continued from the same position once the I/O pressure has subsided.
+ *
+ * Returns: %TRUE if no device failed to be scrubbed.
+ */
+gboolean
+btd_scrub_run (BtdFilesystem *bfs,
+               GPtrArray *scrub_devices,
+               gint64 max_runtime,
+               guint max_parallel,
+               BtdPressureMonitor *pressure,
+               BtdScrubCheckpointFunc checkpoint_func,
+               gpointer user_data,
+               GCancellable *cancellable,
+               GError **error)
+{
+    BtdScrubContext ctx = { 0 };
+    g_autofree BtdScrubWorker *workers = NULL;
+    g_autoptr(GString) failures = NULL;
+    gint64 time_start;
+    gint64 last_checkpoint;
+
+    if (scrub_devices->len == 0)
+        return TRUE;
+
+    ctx.fd = btd_filesystem_open (bfs, error);
+    if (ctx.fd < 0)
+        return FALSE;
+    ctx.fsid = btd_filesystem_get_fsid (bfs);
+    g_mutex_init (&ctx.lock);
+    g_cond_init (&ctx.cond);
+
+    workers = g_new0 (BtdScrubWorker, scrub_devices->len);
+    for (guint i = 0; i < scrub_devices->len; i++) {
+        workers[i].ctx = &ctx;
+        workers[i].sdev = g_ptr_array_index (scrub_devices, i);
+        workers[i].pending = TRUE;
+    }
+
+    time_start = g_get_monotonic_time ();
+    last_checkpoint = time_start;
+    g_mutex_lock (&ctx.lock);
+    while (TRUE) {
+        gint64 deadline;
+        gint64 now;
+
+        /* start a worker per device as slots become free, each blocks until its device is done */
+        for (guint i = 0; i < scrub_devices->len && !ctx.cancel_requested; i++) {
+            BtdScrubWorker *worker = &workers[i];
+
+            if (!worker->pending)
+                continue;
+            if (max_parallel > 0 && ctx.n_running >= max_parallel)
+                break;
+            btd_debug ("Starting scrub of device %s on %s",
+                       worker->sdev->path,
+                       btd_filesystem_get_mountpoint (bfs));
+            g_clear_pointer (&worker->thread, g_thread_join);
+            worker->pending = FALSE;
+            ctx.n_running++;
+            worker->thread = g_thread_new ("btd-scrub", btd_scrub_device_thread, worker);
+        }
+
+        /* watch the progress until all scrub jobs have ended */
+        if (ctx.n_running == 0) {
+            gboolean resume;
+
+            if (!ctx.pressure_paused)
+                break;
+
+            /* all workers have stopped, save their position and wait for the pressure to go down */
+            g_mutex_unlock (&ctx.lock);
+            btd_scrub_join_workers (workers, scrub_devices->len);
+            if (checkpoint_func != NULL)
+                checkpoint_func (scrub_devices, user_data);
+            resume = btd_scrub_resume_after_pressure (bfs,
+                                                      workers,
+                                                      scrub_devices->len,
+                                                      pressure,
+                                                      max_runtime,
+                                                      time_start,
+                                                      cancellable);
+            g_mutex_lock (&ctx.lock);
+            if (!resume)
+                break;
+            ctx.cancel_requested = FALSE;
+            ctx.pressure_paused = FALSE;
+            continue;
+        }
+        deadline = g_get_monotonic_time () + BTD_SCRUB_POLL_INTERVAL * G_TIME_SPAN_SECOND;
+        if (g_cond_wait_until (&ctx.cond, &ctx.lock, deadline))
+            continue;
+        btd_scrub_poll_progress (&ctx, workers, scrub_devices->len);
+
+        now = g_get_monotonic_time ();
+        if (checkpoint_func != NULL &&
+            now - last_checkpoint > BTD_SCRUB_CHECKPOINT_INTERVAL * G_TIME_SPAN_SECOND) {
+            g_autoptr(GPtrArray) progress = btd_scrub_devices_copy (scrub_devices);
+
+            /* saving the checkpoint does file I/O, which must not stall the device threads */
+            g_mutex_unlock (&ctx.lock);
+            checkpoint_func (progress, user_data);
+            g_mutex_lock (&ctx.lock);
+            last_checkpoint = now;
+        }
+
+        if (g_cancellable_is_cancelled (cancellable) &&
+            (!ctx.cancel_requested || ctx.pressure_paused)) {
+            btd_info ("Cancelling scrub on %s.", btd_filesystem_get_mountpoint (bfs));
+            ctx.cancel_requested = TRUE;
+            ctx.pressure_paused = FALSE;
+        } else if (max_runtime > 0 && now - time_start > max_runtime * G_TIME_SPAN_SECOND &&
+                   (!ctx.cancel_requested || ctx.pressure_paused)) {
+            btd_info ("Scrub on %s exceeded its maximum runtime, cancelling it.",
+                      btd_filesystem_get_mountpoint (bfs));
+            ctx.cancel_requested = TRUE;
+            ctx.pressure_paused = FALSE;
+        } else if (pressure != NULL && !ctx.cancel_requested &&
+                   btd_pressure_monitor_check (pressure)) {
+            btd_debug ("I/O pressure exceeded %u%%, pausing scrub on %s",
+                       btd_pressure_monitor_get_threshold (pressure),
+                       btd_filesystem_get_mountpoint (bfs));
+            ctx.cancel_requested = TRUE;
+            ctx.pressure_paused = TRUE;
+        }
+
+        /* repeat the request, in case a worker only started its scrub after we cancelled */
+        if (ctx.cancel_requested && ioctl (ctx.fd, BTRFS_IOC_SCRUB_CANCEL, NULL) < 0 &&
+            errno != ENOTCONN)
+            btd_warning ("Failed to cancel scrub on %s: %s",
+                         btd_filesystem_get_mountpoint (bfs),
+                         g_strerror (errno));
+    }
+    g_mutex_unlock (&ctx.lock);
+
+    btd_scrub_join_workers (workers, scrub_devices->len);
+
+    /* devices we did not get to before the scrub was cancelled are resumed from where they are */
+    for (guint i = 0; i < scrub_devices->len; i++) {
+        BtdScrubDevice *sdev = workers[i].sdev;
+        if (!workers[i].pending)
+            continue;
+        sdev->last_physical = MAX (sdev->start, workers[i].base.last_physical);
+        sdev->interrupted = TRUE;
+        sdev->finished = TRUE;
+    }
+
+    close (ctx.fd);
+    g_cond_clear (&ctx.cond);
+    g_mutex_clear (&ctx.lock);
+
+    /* check if any device failed */
+    for (guint i = 0; i < scrub_devices->len; i++) {
+        BtdScrubDevice *sdev = g_ptr_array_index (scrub_devices, i);
+        if (sdev->error_code == 0)
+            continue;
+        if (failures == NULL)
+            failures = g_string_new (NULL);
+        else
+            g_string_append (failures, ", ");
+        g_string_append_printf (failures, "%s: %s", sdev->path, g_strerror (sdev->error_code));
+    }
+
+    if (failures != NULL) {
+        g_set_error (error,
+                     BTD_BTRFS_ERROR,
+                     BTD_BTRFS_ERROR_SCRUB_FAILED,
+                     "Scrub action failed: %s",
+                     failures->str);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static void
+btd_scrub_device_add_results (BtdScrubDevice *total, BtdScrubDevice *sdev)
+{
+    total->bytes_scrubbed += sdev->bytes_scrubbed;
+    total->read_errors += sdev->read_errors;
+    total->csum_errors += sdev->csum_errors;
+    total->verify_errors += sdev->verify_errors;
+    total->corrected_errors += sdev->corrected_errors;
+    total->uncorrectable_errors += sdev->uncorrectable_errors;
+    total->last_physical = sdev->last_physical;
+    total->duration += sdev->duration;
+    if (sdev->error_code != 0)
+        total->error_code = sdev->error_code;
+    if (sdev->interrupted)
+        total->interrupted = TRUE;
+}
+
+/**
+ * btd_scrub_device_merge_extents:
+ * @total: The #BtdScrubDevice of the whole device, whose size is increased by the ranges found.
+ * @dev_extents: (element-type BtdDevExtent): Device extents, sorted by device and offset.
+ * @speed_max: Scrub bandwidth limit for the ranges in bytes per second, or 0 for no limit.
+ *
+ * Collect the extents of @dev_extents that are located on the device of @total,
+ * merging adjacent extents into a single range.
+ *
+ * Returns: (transfer full) (element-type BtdScrubDevice): The ranges to scrub, in physical order.
+ */
+GPtrArray *
+btd_scrub_device_merge_extents (BtdScrubDevice *total, GPtrArray *dev_extents, guint64 speed_max)
+{
+    GPtrArray *dev_ranges = g_ptr_array_new_with_free_func ((GDestroyNotify) btd_scrub_device_free);
+
+    for (guint i = 0; i < dev_extents->len; i++) {
+        BtdDevExtent *dext = g_ptr_array_index (dev_extents, i);
+        BtdScrubDevice *last = NULL;
+
+        if (dext->devid != total->devid)
+            continue;
+        if (dev_ranges->len > 0)
+            last = g_ptr_array_index (dev_ranges, dev_ranges->len - 1);
+        if (last != NULL && last->end == dext->physical) {
+            last->end += dext->length;
+            last->size += dext->length;
+        } else {
+            BtdScrubDevice *range = btd_scrub_device_new (total->devid, total->path);
+            range->start = dext->physical;
+            range->end = dext->physical + dext->length;
+            range->size = dext->length;
+            range->device_size = total->device_size;
+            range->speed_max = speed_max;
+            g_ptr_array_add (dev_ranges, range);
+        }
+        total->size += dext->length;
+    }
+
+    return dev_ranges;
+}
+
+/**
+ * btd_scrub_run_extents:
+ * @bfs: The #BtdFilesystem to scrub.
+ * @dev_extents: (element-type BtdDevExtent): The device extents to scrub, sorted by device and offset.
+ * @max_runtime: Time in seconds after which the scrub is cancelled, or 0 for no limit.
+ * @max_parallel: Maximum number of devices to scrub at the same time, or 0 for no limit.
+ * @speed_max: Scrub bandwidth limit per device in bytes per second, or 0 for no limit.
+ * @pressure: (nullable): Monitor for the I/O pressure at which the scrub is paused.
+ * @results: (out) (optional) (element-type BtdScrubDevice): Accumulated results per device.
+ * @cancellable: (nullable): A #GCancellable to stop the scrub early, e.g. on shutdown.
+ * @error: A #GError, set if scrub failed.
+ *
+ * Scrub only the given physical ranges of the devices of a filesystem.
+ * As the kernel scrubs one range per device at a time, adjacent extents
+ * are merged and the remaining ranges are scrubbed in consecutive rounds,
+ * with up to @max_parallel devices being scrubbed in parallel in every round.
+ *
+ * If the scrub is cancelled or runs for longer than @max_runtime, the
+ * remaining ranges are skipped and the results of the affected devices
+ * are marked as interrupted.
+ *
+ * Returns: %TRUE if all ranges that were scrubbed had no failures.
+ */
+gboolean
+btd_scrub_run_extents (BtdFilesystem *bfs,
+                       GPtrArray *dev_extents,
+                       gint64 max_runtime,
+                       guint max_parallel,
+                       guint64 speed_max,
+                       BtdPressureMonitor *pressure,
+                       GPtrArray **results,
+                       GCancellable *cancellable,
+                       GError **error)
+{
+    g_autoptr(GPtrArray) devices = NULL;
+    g_autoptr(GPtrArray) totals = NULL;
+    g_autoptr(GHashTable) ranges = NULL;
+    gint64 time_start = g_get_monotonic_time ();
+    gboolean interrupted = FALSE;
+    gboolean ret = TRUE;
+
+    devices = btd_filesystem_get_devices (bfs, error);
+    if (devices == NULL)
+        return FALSE;
+
+    /* collect the merged ranges for every device, in physical order */
+    ranges = g_hash_table_new_full (g_int64_hash,
+                                    g_int64_equal,
+                                    NULL,
+                                    (GDestroyNotify) g_ptr_array_unref);
+    totals = g_ptr_array_new_with_free_func ((GDestroyNotify) btd_scrub_device_free);
+    for (guint i = 0; i < devices->len; i++) {
+        BtdDeviceInfo *dinfo = g_ptr_array_index (devices, i);
+        BtdScrubDevice *total = btd_scrub_device_new (dinfo->devid, dinfo->path);
+
+        total->device_size = dinfo->total_bytes;
+        g_hash_table_insert (ranges,
+                             &total->devid,
+                             btd_scrub_device_merge_extents (total, dev_extents, speed_max));
+        g_ptr_array_add (totals, total);
+    }
+
+    for (guint round = 0;; round++) {
+        g_autoptr(GPtrArray) sdevs = g_ptr_array_new ();
+        g_autoptr(GError) tmp_error = NULL;
+        gint64 remaining = 0;
+
+        for (guint i = 0; i < totals->len; i++) {
+            BtdScrubDevice *total = g_ptr_array_index (totals, i);
+            GPtrArray *dev_ranges = g_hash_table_lookup (ranges, &total->devid);
+            if (round < dev_ranges->len)
+                g_ptr_array_add (sdevs, g_ptr_array_index (dev_ranges, round));
+        }
+        if (sdevs->len == 0)
+            break;
+
+        /* the time limit applies to all rounds together, and ranges we skip remain unscrubbed */
+        if (max_runtime > 0)
+            remaining = max_runtime - (g_get_monotonic_time () - time_start) / G_USEC_PER_SEC;
+        if (interrupted || (max_runtime > 0 && remaining <= 0) ||
+            g_cancellable_is_cancelled (cancellable)) {
+            for (guint i = 0; i < sdevs->len; i++)
+                ((BtdScrubDevice *) g_ptr_array_index (sdevs, i))->interrupted = TRUE;
+        } else if (!btd_scrub_run (bfs,
+                                   sdevs,
+                                   remaining,
+                                   max_parallel,
+                                   pressure,
+                                   NULL,
+                                   NULL,
+                                   cancellable,
+                                   &tmp_error)) {
+            /* keep scrubbing the remaining ranges, but report the first failure */
+            if (ret)
+                g_propagate_error (error, g_steal_pointer (&tmp_error));
+            ret = FALSE;
+        }
+
+        for (guint i = 0; i < sdevs->len; i++) {
+            BtdScrubDevice *sdev = g_ptr_array_index (sdevs, i);
+            for (guint j = 0; j < totals->len; j++) {
+                BtdScrubDevice *total = g_ptr_array_index (totals, j);
+                if (total->devid == sdev->devid)
+                    btd_scrub_device_add_results (total, sdev);
+            }
+            interrupted = interrupted || sdev->interrupted;
+        }
+    }
+
+    for (guint i = 0; i < totals->len; i++)
+        ((BtdScrubDevice *) g_ptr_array_index (totals, i))->finished = TRUE;
+    if (results != NULL)
+        *results = g_steal_pointer (&totals);
+
+    return ret;
+}
+
+/**
+ * btd_scrub_is_running:
+ * @bfs: The #BtdFilesystem to check.
+ * @scrub_devices: (element-type BtdScrubDevice): The devices to check.
+ *
+ * Ask the kernel whether a scrub is currently running on any of the given devices.
+ *
+ * Returns: %TRUE if a scrub is in progress.
+ */
+gboolean
+btd_scrub_is_running (BtdFilesystem *bfs, GPtrArray *scrub_devices)
+{
+    gboolean running = FALSE;
+    gint fd;
+
+    fd = btd_filesystem_open (bfs, NULL);
+    if (fd < 0)
+        return FALSE;
+
+    for (guint i = 0; i < scrub_devices->len && !running; i++) {
+        BtdScrubDevice *sdev = g_ptr_array_index (scrub_devices, i);
+        struct btrfs_ioctl_scrub_args args = { 0 };
+
+        /* the kernel returns ENOTCONN if no scrub is running on the device */
+        args.devid = sdev->devid;
+        running = ioctl (fd, BTRFS_IOC_SCRUB_PROGRESS, &args) == 0;
+    }
+    close (fd);
+
+    return running;
+}
+
+/**
+ * btd_scrub_job_clear:
+ * @job: A #BtdScrubJob
+ *
+ * Free the contents of a scrub job struct.
+ */
+void
+btd_scrub_job_clear (BtdScrubJob *job)
+{
+    g_clear_pointer (&job->mountpoint, g_free);
+}
+
+static gchar *
+btd_scrub_job_device_group (guint64 devid)
+{
+    return g_strdup_printf ("device-%" G_GUINT64_FORMAT, devid);
+}
+
+/**
+ * btd_scrub_job_save:
+ * @fname: The job file to write.
+ * @job: The #BtdScrubJob parameters and state.
+ * @scrub_devices: (element-type BtdScrubDevice): The scrub parameters and results.
+ * @error: A #GError
+ *
+ * Write a scrub job file, which describes a scrub to be run by a detached
+ * helper process and receives its progress and results.
+ *
+ * Returns: %TRUE on success.
+ */
+gboolean
+btd_scrub_job_save (const gchar *fname,
+                    const BtdScrubJob *job,
+                    GPtrArray *scrub_devices,
+                    GError **error)
+{
+    g_autoptr(GKeyFile) kf = g_key_file_new ();
+
+    g_key_file_set_string (kf, "job", "mountpoint", job->mountpoint);
+    g_key_file_set_int64 (kf, "job", "max_runtime", job->max_runtime);
+    g_key_file_set_uint64 (kf, "job", "max_parallel", job->max_parallel);
+    g_key_file_set_int64 (kf, "job", "finished", job->finish_time);
+    g_key_file_set_uint64 (kf, "job", "io_read_bytes", job->io_read_bytes);
+    g_key_file_set_uint64 (kf, "job", "io_write_bytes", job->io_write_bytes);
+    g_key_file_set_uint64 (kf, "job", "pressure_threshold", job->pressure_threshold);
+
+    for (guint i = 0; i < scrub_devices->len; i++) {
+        BtdScrubDevice *sdev = g_ptr_array_index (scrub_devices, i);
+        g_autofree gchar *group = btd_scrub_job_device_group (sdev->devid);
+
+        g_key_file_set_uint64 (kf, group, "devid", sdev->devid);
+        g_key_file_set_string (kf, group, "path", sdev->path);
+        g_key_file_set_uint64 (kf, group, "start", sdev->start);
+        g_key_file_set_uint64 (kf, group, "end", sdev->end);
+        g_key_file_set_uint64 (kf, group, "size", sdev->size);
+        g_key_file_set_uint64 (kf, group, "device_size", sdev->device_size);
+        g_key_file_set_uint64 (kf, group, "speed_max", sdev->speed_max);
+        g_key_file_set_uint64 (kf, group, "bytes_scrubbed", sdev->bytes_scrubbed);
+        g_key_file_set_uint64 (kf, group, "read_errors", sdev->read_errors);
+        g_key_file_set_uint64 (kf, group, "csum_errors", sdev->csum_errors);
+        g_key_file_set_uint64 (kf, group, "verify_errors", sdev->verify_errors);
+        g_key_file_set_uint64 (kf, group, "corrected_errors", sdev->corrected_errors);
+        g_key_file_set_uint64 (kf, group, "uncorrectable_errors", sdev->uncorrectable_errors);
+        g_key_file_set_uint64 (kf, group, "last_physical", sdev->last_physical);
+        g_key_file_set_int64 (kf, group, "duration", sdev->duration);
+        g_key_file_set_integer (kf, group, "error_code", sdev->error_code);
+        g_key_file_set_boolean (kf, group, "finished", sdev->finished);
+        g_key_file_set_boolean (kf, group, "interrupted", sdev->interrupted);
+    }
+
+    return g_key_file_save_to_file (kf, fname, error);
+}
+
+/**
+ * btd_scrub_job_load:
+ * @fname: The job file to read.
+ * @job: (out caller-allocates) (optional): Receives the #BtdScrubJob parameters and state.
+ * @error: A #GError
+ *
+ * Read a scrub job file written by btd_scrub_job_save().
+ *
+ * Returns: (transfer full) (element-type BtdScrubDevice): The scrub units, or %NULL on error.
+ */
+GPtrArray *
+btd_scrub_job_load (const gchar *fname, BtdScrubJob *job, GError **error)
+{
+    g_autoptr(GKeyFile) kf = g_key_file_new ();
+    g_autoptr(GPtrArray) sdevs = NULL;
+    g_auto(GStrv) groups = NULL;
+
+    if (!g_key_file_load_from_file (kf, fname, G_KEY_FILE_NONE, error))
+        return NULL;
+    if (!g_key_file_has_group (kf, "job")) {
+        g_set_error (error,
+                     BTD_BTRFS_ERROR,
+                     BTD_BTRFS_ERROR_SCRUB_FAILED,
+                     "Scrub job file '%s' is invalid.",
+                     fname);
+        return NULL;
+    }
+
+    sdevs = g_ptr_array_new_with_free_func ((GDestroyNotify) btd_scrub_device_free);
+    groups = g_key_file_get_groups (kf, NULL);
+    for (guint i = 0; groups[i] != NULL; i++) {
+        const gchar *group = groups[i];
+        g_autofree gchar *path = NULL;
+        BtdScrubDevice *sdev;
+
+        if (!g_str_has_prefix (group, "device-"))
+            continue;
+
+        path = g_key_file_get_string (kf, group, "path", NULL);
+        sdev = btd_scrub_device_new (g_key_file_get_uint64 (kf, group, "devid", NULL), path);
+        sdev->start = g_key_file_get_uint64 (kf, group, "start", NULL);
+        sdev->end = g_key_file_get_uint64 (kf, group, "end", NULL);
+        sdev->size = g_key_file_get_uint64 (kf, group, "size", NULL);
+        sdev->device_size = g_key_file_get_uint64 (kf, group, "device_size", NULL);
+        sdev->speed_max = g_key_file_get_uint64 (kf, group, "speed_max", NULL);
+        sdev->bytes_scrubbed = g_key_file_get_uint64 (kf, group, "bytes_scrubbed", NULL);
+        sdev->read_errors = g_key_file_get_uint64 (kf, group, "read_errors", NULL);
+        sdev->csum_errors = g_key_file_get_uint64 (kf, group, "csum_errors", NULL);
+        sdev->verify_errors = g_key_file_get_uint64 (kf, group, "verify_errors", NULL);
+        sdev->corrected_errors = g_key_file_get_uint64 (kf, group, "corrected_errors", NULL);
+        sdev->uncorrectable_errors = g_key_file_get_uint64 (kf,
+                                                            group,
+                                                            "uncorrectable_errors",
+                                                            NULL);
+        sdev->last_physical = g_key_file_get_uint64 (kf, group, "last_physical", NULL);
+        sdev->duration = g_key_file_get_int64 (kf, group, "duration", NULL);
+        sdev->error_code = g_key_file_get_integer (kf, group, "error_code", NULL);
+        sdev->finished = g_key_file_get_boolean (kf, group, "finished", NULL);
+        sdev->interrupted = g_key_file_get_boolean (kf, group, "interrupted", NULL);
+        g_ptr_array_add (sdevs, sdev);
+    }
+
+    if (job != NULL) {
+        job->mountpoint = g_key_file_get_string (kf, "job", "mountpoint", NULL);
+        job->max_runtime = g_key_file_get_int64 (kf, "job", "max_runtime", NULL);
+        job->max_parallel = (guint) g_key_file_get_uint64 (kf, "job", "max_parallel", NULL);
+        job->finish_time = g_key_file_get_int64 (kf, "job", "finished", NULL);
+        job->io_read_bytes = g_key_file_get_uint64 (kf, "job", "io_read_bytes", NULL);
+        job->io_write_bytes = g_key_file_get_uint64 (kf, "job", "io_write_bytes", NULL);
+        job->pressure_threshold = (guint) g_key_file_get_uint64 (kf,
+                                                                 "job",
+                                                                 "pressure_threshold",
+                                                                 NULL);
+    }
+
+    return g_steal_pointer (&sdevs);
+}
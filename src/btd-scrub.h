@@ -0,0 +1,122 @@
+/*
+ * Copyright (C) Matthias Klumpp <matthias@tenstral.net>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#pragma once
+
+#include <glib-object.h>
+
+#include "btd-filesystem.h"
+
+G_BEGIN_DECLS
+
+/**
+ * BtdScrubDevice:
+ * @devid:                The Btrfs device ID to scrub
+ * @path:                 Path to the block device
+ * @start:                Physical start offset of the scrubbed range
+ * @end:                  Physical end offset of the scrubbed range
+ * @size:                 Amount of allocated bytes we expect to scrub
+ * @device_size:          Size of the device that is usable by the filesystem
+ * @speed_max:            Scrub bandwidth limit in bytes per second, or 0 to leave it unchanged
+ * @bytes_scrubbed:       Data and metadata bytes scrubbed so far
+ * @read_errors:          Read errors encountered
+ * @csum_errors:          Checksum mismatches encountered
+ * @verify_errors:        Metadata verification errors encountered
+ * @corrected_errors:     Errors that could be repaired
+ * @uncorrectable_errors: Errors that could not be repaired
+ * @last_physical:        Last physical offset that was scrubbed
+ * @duration:             Time the scrub took, in microseconds
+ * @error_code:           The errno value if scrubbing the device failed, 0 otherwise
+ * @finished:             %TRUE if the scrub of this device has ended
+ * @interrupted:          %TRUE if the scrub was cancelled before the end of the range was reached
+ *
+ * Scrub parameters and results for a single device.
+ **/
+typedef struct {
+    guint64  devid;
+    gchar   *path;
+    guint64  start;
+    guint64  end;
+    guint64  size;
+    guint64  device_size;
+    guint64  speed_max;
+
+    guint64  bytes_scrubbed;
+    guint64  read_errors;
+    guint64  csum_errors;
+    guint64  verify_errors;
+    guint64  corrected_errors;
+    guint64  uncorrectable_errors;
+    guint64  last_physical;
+    gint64   duration;
+    gint     error_code;
+    gboolean finished;
+    gboolean interrupted;
+} BtdScrubDevice;
+
+/**
+ * BtdScrubJob:
+ * @mountpoint:         Mountpoint of the filesystem to scrub
+ * @max_runtime:        Time in seconds after which the scrub is cancelled, or 0 for no limit
+ * @max_parallel:       Maximum number of devices to scrub at the same time, or 0 for no limit
+ * @finish_time:        UNIX timestamp at which the scrub ended, or 0 if it has not ended yet
+ * @io_read_bytes:      Bytes read by the process running the scrub, if known
+ * @io_write_bytes:     Bytes written by the process running the scrub, if known
+ * @pressure_threshold: I/O pressure in percent at which the scrub is paused, or 0 to never pause
+ *
+ * Parameters and state of a scrub run by a detached helper process.
+ **/
+typedef struct {
+    gchar   *mountpoint;
+    gint64   max_runtime;
+    guint    max_parallel;
+    gint64   finish_time;
+    guint64  io_read_bytes;
+    guint64  io_write_bytes;
+    guint    pressure_threshold;
+} BtdScrubJob;
+
+void            btd_scrub_job_clear (BtdScrubJob *job);
+G_DEFINE_AUTO_CLEANUP_CLEAR_FUNC (BtdScrubJob, btd_scrub_job_clear)
+
+BtdScrubDevice *btd_scrub_device_new (guint64 devid, const gchar *path);
+void            btd_scrub_device_free (BtdScrubDevice *sdev);
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (BtdScrubDevice, btd_scrub_device_free)
+
+guint64         btd_scrub_device_get_error_count (BtdScrubDevice *sdev);
+GPtrArray      *btd_scrub_device_merge_extents (BtdScrubDevice *total,
+                                                GPtrArray      *dev_extents,
+                                                guint64         speed_max);
+
+gboolean        btd_scrub_run (BtdFilesystem         *bfs,
+                               GPtrArray             *scrub_devices,
+                               gint64                 max_runtime,
+                               guint                  max_parallel,
+                               BtdPressureMonitor    *pressure,
+                               BtdScrubCheckpointFunc checkpoint_func,
+                               gpointer               user_data,
+                               GCancellable          *cancellable,
+                               GError               **error);
+gboolean        btd_scrub_run_extents (BtdFilesystem      *bfs,
+                                       GPtrArray          *dev_extents,
+                                       gint64              max_runtime,
+                                       guint               max_parallel,
+                                       guint64             speed_max,
+                                       BtdPressureMonitor *pressure,
+                                       GPtrArray         **results,
+                                       GCancellable       *cancellable,
+                                       GError            **error);
+gboolean        btd_scrub_is_running (BtdFilesystem *bfs, GPtrArray *scrub_devices);
+
+gboolean        btd_scrub_job_save (const gchar       *fname,
+                                    const BtdScrubJob *job,
+                                    GPtrArray         *scrub_devices,
+                                    GError           **error);
+GPtrArray      *btd_scrub_job_load (const gchar *fname,
+                                    BtdScrubJob *job,
+                                    GError     **error);
+
+G_END_DECLS
@@ -0,0 +1,239 @@
+/*
+ * Copyright (C) Matthias Klumpp <matthias@tenstral.net>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+/**
+ * SECTION:btd-topology
+ * @short_description: Map Btrfs filesystems to their physical disks.
+ *
+ * Resolves the member devices of a Btrfs filesystem to the physical disks
+ * and controllers backing them, so I/O heavy actions on disjoint hardware
+ * can run concurrently.
+ */
+
+#include "config.h"
+#include "btd-topology.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "btd-utils.h"
+#include "btd-logging.h"
+
+#define BTD_RESOURCE_DISK_PREFIX       "disk:"
+#define BTD_RESOURCE_CONTROLLER_PREFIX "controller:"
+
+/* limit for resolving stacked block devices (dm-crypt on md on ...) */
+#define BTD_TOPOLOGY_MAX_DEPTH 8
+
+/**
+ * btd_disk_free:
+ * @disk: The #BtdDisk to free.
+ *
+ * Free a disk description.
+ */
+void
+btd_disk_free (BtdDisk *disk)
+{
+    if (disk == NULL)
+        return;
+    g_free (disk->name);
+    g_free (disk->sysfs_path);
+    g_free (disk->controller);
+    g_free (disk);
+}
+
+static gchar *
+btd_topology_resolve_path (const gchar *path)
+{
+    /* GLib allocates with the system allocator, so this can be released with g_free() */
+    return realpath (path, NULL);
+}
+
+static gboolean
+btd_is_pci_address (const gchar *str)
+{
+    /* PCI addresses look like "0000:00:17.0" */
+    if (strlen (str) != 12)
+        return FALSE;
+    return str[4] == ':' && str[7] == ':' && str[10] == '.' && g_ascii_isxdigit (str[0]) &&
+           g_ascii_isxdigit (str[11]);
+}
+
+static gchar *
+btd_topology_find_controller (const gchar *disk_sysfs_path)
+{
+    g_autofree gchar *dev_link = g_build_filename (disk_sysfs_path, "device", NULL);
+    g_autofree gchar *dev_path = NULL;
+    g_auto(GStrv) parts = NULL;
+    const gchar *controller = NULL;
+
+    dev_path = btd_topology_resolve_path (dev_link);
+    if (dev_path == NULL)
+        return NULL;
+
+    /* the last PCI device in the chain is the HBA, NVMe or USB controller the disk hangs off */
+    parts = g_strsplit (dev_path, "/", -1);
+    for (guint i = 0; parts[i] != NULL; i++) {
+        if (btd_is_pci_address (parts[i]))
+            controller = parts[i];
+    }
+
+    return g_strdup (controller);
+}
+
+static void
+btd_topology_add_disks (const gchar *sysfs_path, GPtrArray *disks, GHashTable *seen, guint depth)
+{
+    g_autofree gchar *slaves_dir = NULL;
+    g_autofree gchar *partition_fname = NULL;
+    g_autofree gchar *disk_path = NULL;
+    g_autofree gchar *rotational_fname = NULL;
+    g_autofree gchar *rotational_str = NULL;
+    g_autoptr(GDir) dir = NULL;
+    BtdDisk *disk;
+
+    if (depth > BTD_TOPOLOGY_MAX_DEPTH)
+        return;
+
+    /* stacked devices (dm, md, ...) list the devices they are built from as slaves */
+    slaves_dir = g_build_filename (sysfs_path, "slaves", NULL);
+    dir = g_dir_open (slaves_dir, 0, NULL);
+    if (dir != NULL) {
+        const gchar *entry;
+        gboolean has_slaves = FALSE;
+
+        while ((entry = g_dir_read_name (dir)) != NULL) {
+            g_autofree gchar *link = g_build_filename (slaves_dir, entry, NULL);
+            g_autofree gchar *slave_path = btd_topology_resolve_path (link);
+
+            if (slave_path == NULL)
+                continue;
+            has_slaves = TRUE;
+            btd_topology_add_disks (slave_path, disks, seen, depth + 1);
+        }
+        if (has_slaves)
+            return;
+    }
+
+    /* partitions live below their whole disk */
+    partition_fname = g_build_filename (sysfs_path, "partition", NULL);
+    if (g_file_test (partition_fname, G_FILE_TEST_EXISTS))
+        disk_path = g_path_get_dirname (sysfs_path);
+    else
+        disk_path = g_strdup (sysfs_path);
+
+    if (g_hash_table_contains (seen, disk_path))
+        return;
+    g_hash_table_add (seen, g_strdup (disk_path));
+
+    disk = g_new0 (BtdDisk, 1);
+    disk->name = g_path_get_basename (disk_path);
+    disk->controller = btd_topology_find_controller (disk_path);
+
+    rotational_fname = g_build_filename (disk_path, "queue", "rotational", NULL);
+    if (g_file_get_contents (rotational_fname, &rotational_str, NULL, NULL))
+        disk->rotational = g_ascii_strtoll (rotational_str, NULL, 10) != 0;
+
+    disk->sysfs_path = g_steal_pointer (&disk_path);
+    g_ptr_array_add (disks, disk);
+}
+
+/**
+ * btd_topology_get_disks:
+ * @bfs: The #BtdFilesystem to inspect.
+ *
+ * Find the physical disks a filesystem is stored on, resolving partitions
+ * and stacked block devices such as dm-crypt or md.
+ *
+ * Returns: (transfer full) (element-type BtdDisk): The disks, or %NULL if the topology could not be read.
+ */
+GPtrArray *
+btd_topology_get_disks (BtdFilesystem *bfs)
+{
+    const gchar *fsid;
+    const gchar *entry;
+    g_autofree gchar *devices_dir = NULL;
+    g_autoptr(GDir) dir = NULL;
+    g_autoptr(GPtrArray) disks = NULL;
+    g_autoptr(GHashTable) seen = NULL;
+
+    fsid = btd_filesystem_get_fsid (bfs);
+    if (fsid == NULL)
+        return NULL;
+
+    devices_dir = g_build_filename ("/sys/fs/btrfs", fsid, "devices", NULL);
+    dir = g_dir_open (devices_dir, 0, NULL);
+    if (dir == NULL) {
+        btd_debug ("Unable to read device topology of %s", btd_filesystem_get_mountpoint (bfs));
+        return NULL;
+    }
+
+    disks = g_ptr_array_new_with_free_func ((GDestroyNotify) btd_disk_free);
+    seen = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+    while ((entry = g_dir_read_name (dir)) != NULL) {
+        g_autofree gchar *link = g_build_filename (devices_dir, entry, NULL);
+        g_autofree gchar *sysfs_path = btd_topology_resolve_path (link);
+
+        if (sysfs_path == NULL)
+            continue;
+        btd_topology_add_disks (sysfs_path, disks, seen, 0);
+    }
+
+    return g_steal_pointer (&disks);
+}
+
+/**
+ * btd_topology_get_resources:
+ * @bfs: The #BtdFilesystem to inspect.
+ *
+ * Get identifiers for all hardware resources (disks and their controllers)
+ * an I/O heavy action on this filesystem will put load on.
+ * If the topology can not be determined, the filesystem's device number is
+ * used as the only resource.
+ *
+ * Returns: (transfer full) (element-type utf8): Resource identifiers.
+ */
+GPtrArray *
+btd_topology_get_resources (BtdFilesystem *bfs)
+{
+    g_autoptr(GPtrArray) disks = NULL;
+    g_autoptr(GPtrArray) resources = g_ptr_array_new_with_free_func (g_free);
+
+    disks = btd_topology_get_disks (bfs);
+    if (disks == NULL || disks->len == 0) {
+        g_ptr_array_add (resources,
+                         g_strdup_printf (BTD_RESOURCE_DISK_PREFIX "devno-%lu",
+                                          (gulong) btd_filesystem_get_devno (bfs)));
+        return g_steal_pointer (&resources);
+    }
+
+    for (guint i = 0; i < disks->len; i++) {
+        BtdDisk *disk = g_ptr_array_index (disks, i);
+        g_autofree gchar *controller_res = NULL;
+
+        g_ptr_array_add (resources, g_strconcat (BTD_RESOURCE_DISK_PREFIX, disk->name, NULL));
+        if (disk->controller == NULL)
+            continue;
+
+        controller_res = g_strconcat (BTD_RESOURCE_CONTROLLER_PREFIX, disk->controller, NULL);
+        if (!g_ptr_array_find_with_equal_func (resources, controller_res, g_str_equal, NULL))
+            g_ptr_array_add (resources, g_steal_pointer (&controller_res));
+    }
+
+    return g_steal_pointer (&resources);
+}
+
+/**
+ * btd_topology_is_controller_resource:
+ * @resource: A resource identifier.
+ *
+ * Returns: %TRUE if the resource identifier refers to a disk controller.
+ */
+gboolean
+btd_topology_is_controller_resource (const gchar *resource)
+{
+    return g_str_has_prefix (resource, BTD_RESOURCE_CONTROLLER_PREFIX);
+}
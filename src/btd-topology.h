@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) Matthias Klumpp <matthias@tenstral.net>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#pragma once
+
+#include <glib-object.h>
+
+#include "btd-filesystem.h"
+
+G_BEGIN_DECLS
+
+/**
+ * BtdDisk:
+ * @name:       Kernel name of the physical disk, e.g. "sda"
+ * @sysfs_path: Resolved sysfs path of the disk
+ * @controller: Identifier of the controller the disk is attached to, or %NULL if unknown
+ * @rotational: %TRUE if the disk has rotating media
+ *
+ * A physical disk backing a Btrfs filesystem.
+ **/
+typedef struct {
+    gchar   *name;
+    gchar   *sysfs_path;
+    gchar   *controller;
+    gboolean rotational;
+} BtdDisk;
+
+void       btd_disk_free (BtdDisk *disk);
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (BtdDisk, btd_disk_free)
+
+GPtrArray *btd_topology_get_disks (BtdFilesystem *bfs);
+GPtrArray *btd_topology_get_resources (BtdFilesystem *bfs);
+
+gboolean   btd_topology_is_controller_resource (const gchar *resource);
+
+G_END_DECLS
@@ -0,0 +1,405 @@
+/*
+ * Copyright (C) Matthias Klumpp <matthias@tenstral.net>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+/**
+ * SECTION:btd-tree-search
+ * @short_description: Query Btrfs metadata trees.
+ *
+ * Reads items from the chunk, device and extent trees of a mounted Btrfs
+ * filesystem via the tree search ioctl, so we can map chunks to the
+ * physical ranges that back them and find recently written data.
+ */
+
+#include "config.h"
+#include "btd-tree-search.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/btrfs_tree.h>
+
+#include "btd-utils.h"
+#include "btd-logging.h"
+
+/* size of the buffer the kernel copies tree items into */
+#define BTD_TREE_SEARCH_BUF_SIZE (64 * 1024)
+
+/**
+ * btd_tree_search_parse_items:
+ * @buf: The search result buffer filled by the kernel.
+ * @nr_items: Number of items in @buf.
+ * @item_type: Type of the items to pass to @func.
+ * @func: Function called for every item of type @item_type.
+ * @user_data: Data passed to @func.
+ * @key: The search key, advanced to the key right after the last item in @buf.
+ *
+ * Walk the items of one TREE_SEARCH_V2 result buffer and prepare @key
+ * for fetching the next batch of items.
+ *
+ * Returns: %TRUE if the search should be continued with @key.
+ */
+gboolean
+btd_tree_search_parse_items (const guint8 *buf,
+                             guint32 nr_items,
+                             guint32 item_type,
+                             BtdTreeItemFunc func,
+                             gpointer user_data,
+                             struct btrfs_ioctl_search_key *key)
+{
+    struct btrfs_ioctl_search_header sh = { 0 };
+    gsize pos = 0;
+
+    if (nr_items == 0)
+        return FALSE;
+
+    for (guint32 i = 0; i < nr_items; i++) {
+        memcpy (&sh, buf + pos, sizeof (sh));
+        pos += sizeof (sh);
+
+        /* the search covers a key range, so items of other types may be returned too */
+        if (sh.type == item_type)
+            func (&sh, buf + pos, user_data);
+        pos += sh.len;
+    }
+
+    /* continue with the key right after the last item we received */
+    key->min_objectid = sh.objectid;
+    key->min_type = sh.type;
+    key->min_offset = sh.offset;
+    if (key->min_offset < G_MAXUINT64) {
+        key->min_offset++;
+    } else if (key->min_type < G_MAXUINT8) {
+        key->min_offset = 0;
+        key->min_type++;
+    } else if (key->min_objectid < key->max_objectid) {
+        key->min_offset = 0;
+        key->min_type = 0;
+        key->min_objectid++;
+    } else {
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static gboolean
+btd_tree_search (gint fd,
+                 const struct btrfs_ioctl_search_key *search_key,
+                 guint32 item_type,
+                 BtdTreeItemFunc func,
+                 gpointer user_data,
+                 GError **error)
+{
+    g_autofree struct btrfs_ioctl_search_args_v2 *args = NULL;
+    struct btrfs_ioctl_search_key *key;
+
+    args = g_malloc0 (sizeof (struct btrfs_ioctl_search_args_v2) + BTD_TREE_SEARCH_BUF_SIZE);
+    args->key = *search_key;
+    key = &args->key;
+
+    do {
+        key->nr_items = G_MAXUINT32;
+        args->buf_size = BTD_TREE_SEARCH_BUF_SIZE;
+        if (ioctl (fd, BTRFS_IOC_TREE_SEARCH_V2, args) < 0) {
+            g_set_error (error,
+                         BTD_BTRFS_ERROR,
+                         BTD_BTRFS_ERROR_FAILED,
+                         "Failed to search tree %" G_GUINT64_FORMAT ": %s",
+                         (guint64) key->tree_id,
+                         g_strerror (errno));
+            return FALSE;
+        }
+    } while (btd_tree_search_parse_items ((const guint8 *) args->buf,
+                                          key->nr_items,
+                                          item_type,
+                                          func,
+                                          user_data,
+                                          key));
+
+    return TRUE;
+}
+
+static void
+btd_tree_search_chunk_cb (const struct btrfs_ioctl_search_header *sh,
+                          const guint8 *item,
+                          gpointer user_data)
+{
+    GArray *chunks = user_data;
+    const struct btrfs_chunk *chunk_item = (const struct btrfs_chunk *) item;
+    BtdChunk chunk;
+
+    if (sh->len < sizeof (struct btrfs_chunk))
+        return;
+
+    chunk.start = sh->offset;
+    chunk.length = GUINT64_FROM_LE (chunk_item->length);
+    chunk.type = GUINT64_FROM_LE (chunk_item->type);
+    g_array_append_val (chunks, chunk);
+}
+
+static GArray *
+btd_tree_search_chunks (gint fd, GError **error)
+{
+    g_autoptr(GArray) chunks = g_array_new (FALSE, FALSE, sizeof (BtdChunk));
+    struct btrfs_ioctl_search_key key = { 0 };
+
+    key.tree_id = BTRFS_CHUNK_TREE_OBJECTID;
+    key.min_objectid = BTRFS_FIRST_CHUNK_TREE_OBJECTID;
+    key.max_objectid = BTRFS_FIRST_CHUNK_TREE_OBJECTID;
+    key.min_type = BTRFS_CHUNK_ITEM_KEY;
+    key.max_type = BTRFS_CHUNK_ITEM_KEY;
+    key.max_offset = G_MAXUINT64;
+    key.max_transid = G_MAXUINT64;
+
+    /* chunk items are sorted by their logical offset */
+    if (!btd_tree_search (fd, &key, BTRFS_CHUNK_ITEM_KEY, btd_tree_search_chunk_cb, chunks, error))
+        return NULL;
+
+    return g_steal_pointer (&chunks);
+}
+
+/**
+ * btd_tree_search_find_chunk:
+ * @chunks: (element-type BtdChunk): Chunks sorted by their logical offset.
+ * @logical: A logical address in the filesystem.
+ *
+ * Find the chunk containing a logical address.
+ *
+ * Returns: The chunk, or %NULL if @logical is not part of any chunk.
+ */
+const BtdChunk *
+btd_tree_search_find_chunk (GArray *chunks, guint64 logical)
+{
+    guint low = 0;
+    guint high = chunks->len;
+
+    while (low < high) {
+        guint mid = low + (high - low) / 2;
+        const BtdChunk *chunk = &g_array_index (chunks, BtdChunk, mid);
+
+        if (logical < chunk->start)
+            high = mid;
+        else if (logical >= chunk->start + chunk->length)
+            low = mid + 1;
+        else
+            return chunk;
+    }
+
+    return NULL;
+}
+
+typedef struct {
+    GPtrArray *extents;
+    GHashTable *chunk_types;
+    GHashTable *chunks;
+    guint64 type_mask;
+} BtdDevExtentSearch;
+
+static void
+btd_tree_search_dev_extent_cb (const struct btrfs_ioctl_search_header *sh,
+                               const guint8 *item,
+                               gpointer user_data)
+{
+    BtdDevExtentSearch *search = user_data;
+    const struct btrfs_dev_extent *dev_item = (const struct btrfs_dev_extent *) item;
+    const guint64 *chunk_type;
+    BtdDevExtent *dext;
+    guint64 chunk_offset;
+
+    if (sh->len < sizeof (struct btrfs_dev_extent))
+        return;
+
+    chunk_offset = GUINT64_FROM_LE (dev_item->chunk_offset);
+    if (search->chunks != NULL && !g_hash_table_contains (search->chunks, &chunk_offset))
+        return;
+    chunk_type = g_hash_table_lookup (search->chunk_types, &chunk_offset);
+    if (chunk_type == NULL)
+        return;
+    if (search->type_mask != 0 && (*chunk_type & search->type_mask) == 0)
+        return;
+
+    dext = g_new0 (BtdDevExtent, 1);
+    dext->devid = sh->objectid;
+    dext->physical = sh->offset;
+    dext->length = GUINT64_FROM_LE (dev_item->length);
+    dext->chunk_offset = chunk_offset;
+    dext->chunk_type = *chunk_type;
+    g_ptr_array_add (search->extents, dext);
+}
+
+/**
+ * btd_tree_search_dev_extents:
+ * @bfs: The #BtdFilesystem to query.
+ * @type_mask: Block group type flags of the chunks to consider, or 0 for all.
+ * @chunks: (nullable) (element-type guint64 guint64): Set of logical chunk offsets to limit the result to.
+ * @error: A #GError
+ *
+ * Find the physical device ranges backing the chunks of a filesystem,
+ * optionally limited to chunks of a certain type (e.g. metadata) or to a
+ * given set of chunks.
+ *
+ * Returns: (transfer full) (element-type BtdDevExtent): Device extents sorted by device and physical offset, or %NULL on error.
+ */
+GPtrArray *
+btd_tree_search_dev_extents (BtdFilesystem *bfs,
+                             guint64 type_mask,
+                             GHashTable *chunks,
+                             GError **error)
+{
+    g_autoptr(GArray) chunk_list = NULL;
+    g_autoptr(GHashTable) chunk_types = NULL;
+    g_autoptr(GPtrArray) extents = NULL;
+    struct btrfs_ioctl_search_key key = { 0 };
+    BtdDevExtentSearch search = { 0 };
+    gboolean ret;
+    gint fd;
+
+    fd = btd_filesystem_open (bfs, error);
+    if (fd < 0)
+        return NULL;
+
+    chunk_list = btd_tree_search_chunks (fd, error);
+    if (chunk_list == NULL) {
+        close (fd);
+        return NULL;
+    }
+    chunk_types = g_hash_table_new (g_int64_hash, g_int64_equal);
+    for (guint i = 0; i < chunk_list->len; i++) {
+        BtdChunk *chunk = &g_array_index (chunk_list, BtdChunk, i);
+        g_hash_table_insert (chunk_types, &chunk->start, &chunk->type);
+    }
+
+    extents = g_ptr_array_new_with_free_func (g_free);
+    search.extents = extents;
+    search.chunk_types = chunk_types;
+    search.chunks = chunks;
+    search.type_mask = type_mask;
+
+    /* device extents are keyed by device ID and physical offset */
+    key.tree_id = BTRFS_DEV_TREE_OBJECTID;
+    key.min_objectid = 1;
+    key.max_objectid = G_MAXUINT64;
+    key.min_type = BTRFS_DEV_EXTENT_KEY;
+    key.max_type = BTRFS_DEV_EXTENT_KEY;
+    key.max_offset = G_MAXUINT64;
+    key.max_transid = G_MAXUINT64;
+    ret = btd_tree_search (fd,
+                           &key,
+                           BTRFS_DEV_EXTENT_KEY,
+                           btd_tree_search_dev_extent_cb,
+                           &search,
+                           error);
+    close (fd);
+    if (!ret)
+        return NULL;
+
+    return g_steal_pointer (&extents);
+}
+
+/**
+ * btd_tree_search_new_data_item_cb:
+ * @sh: Header of an extent item.
+ * @item: The extent item.
+ * @user_data: A #BtdNewDataSearch
+ *
+ * Add the chunk of a data extent to the search result if the extent was
+ * written within the generation range of the search.
+ */
+void
+btd_tree_search_new_data_item_cb (const struct btrfs_ioctl_search_header *sh,
+                                  const guint8 *item,
+                                  gpointer user_data)
+{
+    BtdNewDataSearch *search = user_data;
+    const struct btrfs_extent_item *extent_item = (const struct btrfs_extent_item *) item;
+    const BtdChunk *chunk;
+    guint64 generation;
+
+    if (sh->len < sizeof (struct btrfs_extent_item))
+        return;
+    if ((GUINT64_FROM_LE (extent_item->flags) & BTRFS_EXTENT_FLAG_DATA) == 0)
+        return;
+
+    generation = GUINT64_FROM_LE (extent_item->generation);
+    if (generation <= search->min_generation || generation >= search->max_generation)
+        return;
+    search->newest_generation = MAX (search->newest_generation, generation);
+
+    /* the extent item key holds the logical start offset of the extent */
+    chunk = btd_tree_search_find_chunk (search->chunk_list, sh->objectid);
+    if (chunk == NULL || g_hash_table_contains (search->chunks, &chunk->start))
+        return;
+    g_hash_table_add (search->chunks, g_memdup2 (&chunk->start, sizeof (guint64)));
+}
+
+/**
+ * btd_tree_search_new_data_chunks:
+ * @bfs: The #BtdFilesystem to query.
+ * @min_generation: Only consider data written after this generation.
+ * @max_generation: Only consider data written before this generation, or %G_MAXUINT64.
+ * @newest_generation: (out) (optional): The newest generation of any data extent found.
+ * @error: A #GError
+ *
+ * Find all chunks that contain data extents which were written between the
+ * given filesystem generations. Only extent tree blocks that were modified
+ * after @min_generation are read, so this is cheap for mostly static data.
+ *
+ * Returns: (transfer full) (element-type guint64 guint64): Set of logical chunk offsets, or %NULL on error.
+ */
+GHashTable *
+btd_tree_search_new_data_chunks (BtdFilesystem *bfs,
+                                 guint64 min_generation,
+                                 guint64 max_generation,
+                                 guint64 *newest_generation,
+                                 GError **error)
+{
+    g_autoptr(GArray) chunk_list = NULL;
+    g_autoptr(GHashTable) chunks = NULL;
+    struct btrfs_ioctl_search_key key = { 0 };
+    BtdNewDataSearch search = { 0 };
+    gboolean ret;
+    gint fd;
+
+    fd = btd_filesystem_open (bfs, error);
+    if (fd < 0)
+        return NULL;
+
+    chunk_list = btd_tree_search_chunks (fd, error);
+    if (chunk_list == NULL) {
+        close (fd);
+        return NULL;
+    }
+
+    chunks = g_hash_table_new_full (g_int64_hash, g_int64_equal, g_free, NULL);
+    search.chunk_list = chunk_list;
+    search.chunks = chunks;
+    search.min_generation = min_generation;
+    search.max_generation = max_generation;
+    search.newest_generation = min_generation;
+
+    /* skip all tree blocks which were not written since the last check */
+    key.tree_id = BTRFS_EXTENT_TREE_OBJECTID;
+    key.max_objectid = G_MAXUINT64;
+    key.min_type = BTRFS_EXTENT_ITEM_KEY;
+    key.max_type = BTRFS_EXTENT_ITEM_KEY;
+    key.max_offset = G_MAXUINT64;
+    key.min_transid = min_generation + 1;
+    key.max_transid = G_MAXUINT64;
+    ret = btd_tree_search (fd,
+                           &key,
+                           BTRFS_EXTENT_ITEM_KEY,
+                           btd_tree_search_new_data_item_cb,
+                           &search,
+                           error);
+    close (fd);
+    if (!ret)
+        return NULL;
+
+    if (newest_generation != NULL)
+        *newest_generation = search.newest_generation;
+    return g_steal_pointer (&chunks);
+}
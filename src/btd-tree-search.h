@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) Matthias Klumpp <matthias@tenstral.net>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#pragma once
+
+#include <glib-object.h>
+#include <linux/btrfs.h>
+
+#include "btd-filesystem.h"
+
+G_BEGIN_DECLS
+
+/**
+ * BtdDevExtent:
+ * @devid:        The Btrfs device ID
+ * @physical:     Physical start offset of the extent on the device
+ * @length:       Length of the extent on the device
+ * @chunk_offset: Logical start offset of the chunk the extent belongs to
+ * @chunk_type:   Block group type and profile flags of the chunk
+ *
+ * A physical range of a device which backs (part of) a chunk.
+ **/
+typedef struct {
+    guint64 devid;
+    guint64 physical;
+    guint64 length;
+    guint64 chunk_offset;
+    guint64 chunk_type;
+} BtdDevExtent;
+
+/**
+ * BtdChunk:
+ * @start:  Logical start offset of the chunk
+ * @length: Logical length of the chunk
+ * @type:   Block group type and profile flags of the chunk
+ *
+ * A chunk of the logical address space of a filesystem.
+ **/
+typedef struct {
+    guint64 start;
+    guint64 length;
+    guint64 type;
+} BtdChunk;
+
+/**
+ * BtdNewDataSearch:
+ * @chunk_list:        (element-type BtdChunk): All chunks of the filesystem, sorted by offset
+ * @chunks:            (element-type guint64 guint64): Set of chunks found to contain new data
+ * @min_generation:    Only consider data written after this generation
+ * @max_generation:    Only consider data written before this generation
+ * @newest_generation: The newest generation of any data extent found
+ *
+ * State of a search for chunks containing recently written data.
+ **/
+typedef struct {
+    GArray     *chunk_list;
+    GHashTable *chunks;
+    guint64     min_generation;
+    guint64     max_generation;
+    guint64     newest_generation;
+} BtdNewDataSearch;
+
+typedef void (*BtdTreeItemFunc) (const struct btrfs_ioctl_search_header *sh,
+                                 const guint8                           *item,
+                                 gpointer                                user_data);
+
+GPtrArray  *btd_tree_search_dev_extents (BtdFilesystem *bfs,
+                                         guint64        type_mask,
+                                         GHashTable    *chunks,
+                                         GError       **error);
+
+GHashTable *btd_tree_search_new_data_chunks (BtdFilesystem *bfs,
+                                             guint64        min_generation,
+                                             guint64        max_generation,
+                                             guint64       *newest_generation,
+                                             GError       **error);
+
+gboolean    btd_tree_search_parse_items (const guint8                  *buf,
+                                         guint32                        nr_items,
+                                         guint32                        item_type,
+                                         BtdTreeItemFunc                func,
+                                         gpointer                       user_data,
+                                         struct btrfs_ioctl_search_key *key);
+const BtdChunk *btd_tree_search_find_chunk (GArray *chunks, guint64 logical);
+void        btd_tree_search_new_data_item_cb (const struct btrfs_ioctl_search_header *sh,
+                                              const guint8                           *item,
+                                              gpointer                                user_data);
+
+G_END_DECLS
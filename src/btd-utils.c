@@ -16,6 +16,12 @@
 
 #include "btd-resources.h"
 
+/* factor by which an adaptive interval is shortened after issues were found */
+#define BTD_SUSPECT_INTERVAL_DIVISOR 4
+
+/* number of consecutive clean passes after which an adaptive interval is doubled */
+#define BTD_CLEAN_PASSES_PER_STEP 3
+
 /**
  * btd_is_empty:
  * @str: The string to test.
@@ -143,6 +149,10 @@ btd_parse_duration_string (const gchar *str)
     if (value <= 0)
         return 0;
 
+    /* minutes need a longer suffix, as "m" is too easily confused with months */
+    if (g_str_has_suffix (str, "min"))
+        return value * 60;
+
     switch (suffix) {
     case 'h':
         multiplier = SECONDS_IN_AN_HOUR;
@@ -170,6 +180,157 @@ btd_parse_duration_string (const gchar *str)
     return value * multiplier;
 }
 
+/**
+ * btd_parse_size_string:
+ * @str: The string to parse, e.g. "100M".
+ *
+ * Parse a size in bytes with an optional binary K, M, G or T suffix.
+ *
+ * Returns: The size in bytes, or 0 on error or if "off".
+ */
+guint64
+btd_parse_size_string (const gchar *str)
+{
+    gchar *endptr = NULL;
+    guint64 value;
+    guint shift = 0;
+
+    if (btd_is_empty (str) || btd_str_equal0 (str, "off"))
+        return 0;
+    if (!g_ascii_isdigit (str[0]))
+        return 0;
+
+    value = g_ascii_strtoull (str, &endptr, 10);
+    switch (g_ascii_toupper (*endptr)) {
+    case 'K':
+        shift = 10;
+        break;
+    case 'M':
+        shift = 20;
+        break;
+    case 'G':
+        shift = 30;
+        break;
+    case 'T':
+        shift = 40;
+        break;
+    case '\0':
+        return value;
+    default:
+        return 0;
+    }
+
+    /* allow "100M", "100MB" and "100MiB" alike */
+    endptr++;
+    if (*endptr == 'i')
+        endptr++;
+    if (*endptr == 'B')
+        endptr++;
+    if (*endptr != '\0' || value > (G_MAXUINT64 >> shift))
+        return 0;
+
+    return value << shift;
+}
+
+/**
+ * btd_get_stable_offset:
+ * @key: The string to derive the offset from.
+ * @range: Upper bound for the offset.
+ *
+ * Map @key to a number that is evenly distributed between 0 and @range,
+ * and always the same for the same key, so many machines can derive
+ * differing but stable offsets from their own identifiers.
+ *
+ * Returns: A value smaller than @range, or 0 if @range is 0.
+ */
+guint64
+btd_get_stable_offset (const gchar *key, guint64 range)
+{
+    g_autoptr(GChecksum) checksum = NULL;
+    guint8 digest[32];
+    gsize digest_len = sizeof (digest);
+    guint64 value = 0;
+
+    if (range == 0)
+        return 0;
+
+    checksum = g_checksum_new (G_CHECKSUM_SHA256);
+    g_checksum_update (checksum, (const guchar *) key, -1);
+    g_checksum_get_digest (checksum, digest, &digest_len);
+    for (guint i = 0; i < 8; i++)
+        value = (value << 8) | digest[i];
+
+    return value % range;
+}
+
+/**
+ * btd_get_phased_due_time:
+ * @last_time: UNIX timestamp of the last run.
+ * @interval: Time in seconds between runs.
+ * @spread: Length of the phase window in seconds, or 0 to not align runs.
+ * @offset: Phase within the window, smaller than @spread.
+ *
+ * Calculate when the next run is due if runs are aligned to the points in
+ * time at which @offset seconds have passed in a window of @spread seconds.
+ * The last run is attributed to the phase point closest to it, as it usually
+ * completes a while after the point it was scheduled for, so the time between
+ * the scheduled runs stays at @interval if it is a multiple of @spread.
+ *
+ * Returns: UNIX timestamp at which the next run is due.
+ */
+gint64
+btd_get_phased_due_time (gint64 last_time, gint64 interval, gint64 spread, gint64 offset)
+{
+    gint64 phase_time;
+    gint64 due_time;
+
+    if (spread <= 0)
+        return last_time + interval;
+
+    phase_time = last_time - ((last_time - offset) % spread + spread) % spread;
+    if (last_time - phase_time > spread / 2)
+        phase_time += spread;
+
+    due_time = phase_time + interval;
+    return due_time + ((offset - due_time) % spread + spread) % spread;
+}
+
+/**
+ * btd_get_adaptive_interval:
+ * @interval: The configured interval in seconds.
+ * @max_interval: The longest interval in seconds the configured one may be stretched to.
+ * @clean_passes: Number of consecutive passes that found no issue.
+ * @had_issue: %TRUE if any issue was ever found.
+ *
+ * Adapt the interval of a checking action to the results of its previous runs:
+ * The interval is shortened to a quarter, but not below a day, until a pass came
+ * out clean after an issue was found, and doubled for every few consecutive clean
+ * passes, up to @max_interval.
+ *
+ * Returns: The interval to use, in seconds.
+ */
+gulong
+btd_get_adaptive_interval (gulong interval,
+                           gulong max_interval,
+                           gint64 clean_passes,
+                           gboolean had_issue)
+{
+    if (max_interval <= interval)
+        return interval;
+
+    /* check more often until a full pass came out clean after issues were seen */
+    if (had_issue && clean_passes == 0)
+        return MAX (interval / BTD_SUSPECT_INTERVAL_DIVISOR, MIN (interval, SECONDS_IN_A_DAY));
+
+    /* double the interval for every few consecutive clean passes */
+    for (gint64 i = BTD_CLEAN_PASSES_PER_STEP;
+         i <= clean_passes && interval < max_interval;
+         i += BTD_CLEAN_PASSES_PER_STEP)
+        interval *= 2;
+
+    return MIN (interval, max_interval);
+}
+
 /**
  * btd_render_template:
  * @template: the template to render
@@ -31,6 +31,13 @@ GBytes  *btd_get_resource_data (const gchar *resource_path);
 gboolean btd_user_is_root (void);
 
 gulong   btd_parse_duration_string (const gchar *str);
+guint64  btd_parse_size_string (const gchar *str);
+guint64  btd_get_stable_offset (const gchar *key, guint64 range);
+gint64   btd_get_phased_due_time (gint64 last_time, gint64 interval, gint64 spread, gint64 offset);
+gulong   btd_get_adaptive_interval (gulong   interval,
+                                    gulong   max_interval,
+                                    gint64   clean_passes,
+                                    gboolean had_issue);
 
 gchar   *btd_render_template (const gchar *template, const gchar *key1, ...) G_GNUC_NULL_TERMINATED;
 
@@ -0,0 +1,317 @@
+/*
+ * Copyright (C) Matthias Klumpp <matthias@tenstral.net>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+/**
+ * SECTION:btd-window
+ * @short_description: Weekly maintenance windows.
+ *
+ * Parses calendar expressions like "Sat,Sun 01:00..06:00" which describe
+ * the times of the week at which an action may run.
+ */
+
+#include "config.h"
+#include "btd-window.h"
+
+#include <string.h>
+
+#include "btd-utils.h"
+#include "btd-filesystem.h"
+
+#define SECONDS_IN_A_MINUTE 60
+
+typedef struct {
+    gint64 start;
+    gint64 end;
+} BtdWindowSpan;
+
+struct _BtdWindow {
+    /* spans of seconds since the start of the week (Monday, 00:00) */
+    GArray *spans;
+};
+
+static const gchar *btd_window_day_names[] = {
+    "monday", "tuesday", "wednesday", "thursday", "friday", "saturday", "sunday", NULL
+};
+
+static gint
+btd_window_parse_day (const gchar *str)
+{
+    gsize len = strlen (str);
+
+    /* accept the full day name as well as its three letter abbreviation */
+    if (len != 3 && len < 6)
+        return -1;
+    for (guint i = 0; btd_window_day_names[i] != NULL; i++) {
+        if (len == 3 && g_ascii_strncasecmp (str, btd_window_day_names[i], 3) == 0)
+            return (gint) i;
+        if (g_ascii_strcasecmp (str, btd_window_day_names[i]) == 0)
+            return (gint) i;
+    }
+
+    return -1;
+}
+
+static gboolean
+btd_window_parse_days (const gchar *spec, gboolean *days)
+{
+    g_auto(GStrv) items = g_strsplit (spec, ",", -1);
+
+    for (guint i = 0; i < 7; i++)
+        days[i] = FALSE;
+
+    for (guint i = 0; items[i] != NULL; i++) {
+        g_auto(GStrv) range = g_strsplit (items[i], "..", 2);
+        gint first = btd_window_parse_day (range[0]);
+        gint last = first;
+
+        if (range[1] != NULL)
+            last = btd_window_parse_day (range[1]);
+        if (first < 0 || last < 0)
+            return FALSE;
+
+        /* ranges may wrap around the end of the week, like "Fri..Mon" */
+        for (gint day = first;; day = (day + 1) % 7) {
+            days[day] = TRUE;
+            if (day == last)
+                break;
+        }
+    }
+
+    return TRUE;
+}
+
+static gboolean
+btd_window_parse_time (const gchar *str, gint64 *seconds)
+{
+    gchar *endptr = NULL;
+    gint64 hours;
+    gint64 minutes;
+
+    hours = g_ascii_strtoll (str, &endptr, 10);
+    if (endptr == str || *endptr != ':')
+        return FALSE;
+    str = endptr + 1;
+    minutes = g_ascii_strtoll (str, &endptr, 10);
+    if (endptr == str || *endptr != '\0')
+        return FALSE;
+
+    /* 24:00 is allowed to denote the end of a day */
+    if (hours < 0 || hours > 24 || minutes < 0 || minutes > 59 || (hours == 24 && minutes != 0))
+        return FALSE;
+
+    *seconds = hours * SECONDS_IN_AN_HOUR + minutes * SECONDS_IN_A_MINUTE;
+    return TRUE;
+}
+
+static void
+btd_window_add_span (BtdWindow *window, gint64 start, gint64 end)
+{
+    BtdWindowSpan span;
+
+    /* a window opening late on Sunday continues on Monday morning */
+    if (end > SECONDS_IN_A_WEEK) {
+        btd_window_add_span (window, start, SECONDS_IN_A_WEEK);
+        btd_window_add_span (window, 0, end - SECONDS_IN_A_WEEK);
+        return;
+    }
+
+    span.start = start;
+    span.end = end;
+    g_array_append_val (window->spans, span);
+}
+
+static gboolean
+btd_window_parse_one (BtdWindow *window, const gchar *expr)
+{
+    g_auto(GStrv) tokens = g_strsplit_set (expr, " \t", -1);
+    gboolean days[7] = { TRUE, TRUE, TRUE, TRUE, TRUE, TRUE, TRUE };
+    gboolean have_days = FALSE;
+    gboolean have_time = FALSE;
+    gint64 start = 0;
+    gint64 end = SECONDS_IN_A_DAY;
+
+    for (guint i = 0; tokens[i] != NULL; i++) {
+        if (btd_is_empty (tokens[i]))
+            continue;
+
+        if (strchr (tokens[i], ':') != NULL) {
+            g_auto(GStrv) range = g_strsplit (tokens[i], "..", 2);
+
+            if (have_time || range[1] == NULL)
+                return FALSE;
+            if (!btd_window_parse_time (range[0], &start) ||
+                !btd_window_parse_time (range[1], &end))
+                return FALSE;
+            have_time = TRUE;
+        } else {
+            if (have_days || !btd_window_parse_days (tokens[i], days))
+                return FALSE;
+            have_days = TRUE;
+        }
+    }
+    if (!have_days && !have_time)
+        return FALSE;
+
+    /* a window ending before it starts lasts over midnight, like "22:00..05:00" */
+    if (start == end)
+        return FALSE;
+    if (end < start)
+        end += SECONDS_IN_A_DAY;
+
+    for (guint day = 0; day < 7; day++) {
+        if (days[day])
+            btd_window_add_span (window,
+                                 day * SECONDS_IN_A_DAY + start,
+                                 day * SECONDS_IN_A_DAY + end);
+    }
+
+    return TRUE;
+}
+
+/**
+ * btd_window_parse:
+ * @expr: The window expression, e.g. "Sat,Sun 01:00..06:00".
+ * @error: A #GError
+ *
+ * Parse a maintenance window. Every window consists of a list of days or
+ * day ranges like "Mon..Fri", and a time range in local time, either of
+ * which may be omitted. Windows ending before they start last over
+ * midnight. Multiple windows can be combined by separating them with ";".
+ *
+ * Returns: (transfer full): A new #BtdWindow, or %NULL on error.
+ */
+BtdWindow *
+btd_window_parse (const gchar *expr, GError **error)
+{
+    g_autoptr(BtdWindow) window = NULL;
+    g_auto(GStrv) parts = NULL;
+
+    window = g_new0 (BtdWindow, 1);
+    window->spans = g_array_new (FALSE, FALSE, sizeof (BtdWindowSpan));
+
+    parts = g_strsplit (expr != NULL ? expr : "", ";", -1);
+    for (guint i = 0; parts[i] != NULL; i++) {
+        g_strstrip (parts[i]);
+        if (btd_is_empty (parts[i]))
+            continue;
+        if (!btd_window_parse_one (window, parts[i])) {
+            g_set_error (error,
+                         BTD_BTRFS_ERROR,
+                         BTD_BTRFS_ERROR_PARSE,
+                         "Invalid maintenance window '%s', expected e.g. 'Sat,Sun 01:00..06:00'.",
+                         parts[i]);
+            return NULL;
+        }
+    }
+
+    if (window->spans->len == 0) {
+        g_set_error_literal (error,
+                             BTD_BTRFS_ERROR,
+                             BTD_BTRFS_ERROR_PARSE,
+                             "The maintenance window is empty.");
+        return NULL;
+    }
+
+    return g_steal_pointer (&window);
+}
+
+/**
+ * btd_window_free:
+ * @window: A #BtdWindow
+ *
+ * Free a maintenance window.
+ */
+void
+btd_window_free (BtdWindow *window)
+{
+    if (window == NULL)
+        return;
+    g_array_unref (window->spans);
+    g_free (window);
+}
+
+static gint64
+btd_window_get_week_position (GDateTime *time)
+{
+    return (g_date_time_get_day_of_week (time) - 1) * SECONDS_IN_A_DAY +
+           g_date_time_get_hour (time) * SECONDS_IN_AN_HOUR +
+           g_date_time_get_minute (time) * SECONDS_IN_A_MINUTE + g_date_time_get_second (time);
+}
+
+static BtdWindowSpan *
+btd_window_find_span (BtdWindow *window, gint64 pos)
+{
+    for (guint i = 0; i < window->spans->len; i++) {
+        BtdWindowSpan *span = &g_array_index (window->spans, BtdWindowSpan, i);
+        if (span->start <= pos && pos < span->end)
+            return span;
+    }
+
+    return NULL;
+}
+
+/**
+ * btd_window_is_open:
+ * @window: A #BtdWindow
+ * @time: The time to check, in the timezone the window applies to.
+ *
+ * Returns: %TRUE if the window is open at @time.
+ */
+gboolean
+btd_window_is_open (BtdWindow *window, GDateTime *time)
+{
+    return btd_window_find_span (window, btd_window_get_week_position (time)) != NULL;
+}
+
+/**
+ * btd_window_get_time_to_open:
+ * @window: A #BtdWindow
+ * @time: The time to start from, in the timezone the window applies to.
+ *
+ * Returns: Seconds until the window opens, or 0 if it is open at @time.
+ */
+gint64
+btd_window_get_time_to_open (BtdWindow *window, GDateTime *time)
+{
+    gint64 pos = btd_window_get_week_position (time);
+    gint64 wait = SECONDS_IN_A_WEEK;
+
+    if (btd_window_find_span (window, pos) != NULL)
+        return 0;
+
+    for (guint i = 0; i < window->spans->len; i++) {
+        BtdWindowSpan *span = &g_array_index (window->spans, BtdWindowSpan, i);
+        wait = MIN (wait, (span->start - pos + SECONDS_IN_A_WEEK) % SECONDS_IN_A_WEEK);
+    }
+
+    return wait;
+}
+
+/**
+ * btd_window_get_time_to_close:
+ * @window: A #BtdWindow
+ * @time: The time to start from, in the timezone the window applies to.
+ *
+ * Returns: Seconds until the window closes, 0 if it is closed at @time,
+ *          or -1 if it never closes.
+ */
+gint64
+btd_window_get_time_to_close (BtdWindow *window, GDateTime *time)
+{
+    gint64 pos = btd_window_get_week_position (time);
+    gint64 remaining = 0;
+
+    /* follow adjacent spans, so windows spanning midnight are treated as one */
+    while (remaining < SECONDS_IN_A_WEEK) {
+        BtdWindowSpan *span = btd_window_find_span (window, pos);
+        if (span == NULL)
+            return remaining;
+        remaining += span->end - pos;
+        pos = span->end % SECONDS_IN_A_WEEK;
+    }
+
+    return -1;
+}
@@ -0,0 +1,23 @@
+/*
+ * Copyright (C) Matthias Klumpp <matthias@tenstral.net>
+ *
+ * SPDX-License-Identifier: LGPL-2.1+
+ */
+
+#pragma once
+
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+typedef struct _BtdWindow BtdWindow;
+
+BtdWindow *btd_window_parse (const gchar *expr, GError **error);
+void       btd_window_free (BtdWindow *window);
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (BtdWindow, btd_window_free)
+
+gboolean   btd_window_is_open (BtdWindow *window, GDateTime *time);
+gint64     btd_window_get_time_to_open (BtdWindow *window, GDateTime *time);
+gint64     btd_window_get_time_to_close (BtdWindow *window, GDateTime *time);
+
+G_END_DECLS
@@ -11,6 +11,7 @@
 #include <locale.h>
 
 #include "btd-scheduler.h"
+#include "btd-daemon.h"
 #include "btd-logging.h"
 
 int
@@ -23,6 +24,8 @@ main (int argc, char **argv)
     gboolean verbose = FALSE;
     gboolean show_version = FALSE;
     gboolean show_status = FALSE;
+    gboolean daemon_mode = FALSE;
+    g_autofree gchar *scrub_job = NULL;
 
     const GOptionEntry options[] = {
         { "verbose",
@@ -40,6 +43,20 @@ main (int argc, char **argv)
           &show_status,
           "Display some short status information.",
           NULL },
+        { "daemon",
+          '\0',
+          0,
+          G_OPTION_ARG_NONE,
+          &daemon_mode,
+          "Keep running and perform maintenance actions when they are due.",
+          NULL },
+        { "scrub-job",
+          '\0',
+          G_OPTION_FLAG_HIDDEN,
+          G_OPTION_ARG_FILENAME,
+          &scrub_job,
+          "Run the scrub described by a job file (used internally for detached scrubs).",
+          "FILE" },
         { NULL }
     };
 
@@ -65,6 +82,14 @@ main (int argc, char **argv)
     }
 
     scheduler = btd_scheduler_new ();
+
+    /* exit right away if the cached schedule tells us nothing is due yet */
+    if (!show_status && !daemon_mode && scrub_job == NULL && btd_scheduler_is_idle (scheduler)) {
+        btd_debug ("No maintenance actions are due.");
+        btd_logging_finalize ();
+        return EXIT_SUCCESS;
+    }
+
     if (!btd_scheduler_load (scheduler, &error)) {
         g_printerr ("Failed to initialize: %s\n", error->message);
         return EXIT_FAILURE;
@@ -77,6 +102,30 @@ main (int argc, char **argv)
         return EXIT_FAILURE;
     }
 
+    if (scrub_job != NULL) {
+        /* we are the helper process of a detached scrub */
+        if (!btd_scheduler_run_scrub_job (scheduler, scrub_job, &error)) {
+            btd_error ("Detached scrub failed: %s", error->message);
+            btd_logging_finalize ();
+            return EXIT_FAILURE;
+        }
+
+        btd_logging_finalize ();
+        return EXIT_SUCCESS;
+    }
+
+    if (daemon_mode) {
+        g_autoptr(BtdDaemon) daemon = btd_daemon_new (scheduler);
+        if (!btd_daemon_run (daemon, &error)) {
+            btd_error ("Btrfsd daemon failed: %s", error->message);
+            btd_logging_finalize ();
+            return EXIT_FAILURE;
+        }
+
+        btd_logging_finalize ();
+        return EXIT_SUCCESS;
+    }
+
     /* run all scheduled actions */
     if (!btd_scheduler_run (scheduler, &error)) {
         if (btd_is_tty ())
@@ -86,6 +135,7 @@ main (int argc, char **argv)
         btd_logging_finalize ();
         return EXIT_FAILURE;
     }
+    btd_scheduler_update_schedule (scheduler);
 
     btd_logging_finalize ();
     return EXIT_SUCCESS;
@@ -29,8 +29,7 @@ eatmydata apt-get install -yq --no-install-recommends \
     libglib2.0-dev \
     libsystemd-dev \
     gtk-doc-tools \
-    libmount-dev \
-    libjson-glib-dev
+    libmount-dev
 
 if apt-cache show systemd-dev > /dev/null 2>&1; then
     eatmydata apt-get install -yq systemd-dev
@@ -23,4 +23,3 @@ dnf --assumeyes --quiet --setopt=install_weak_deps=False install \
     'pkgconfig(gio-2.0)' \
     'pkgconfig(libsystemd)' \
     'pkgconfig(mount)' \
-    'pkgconfig(json-glib-1.0)' \
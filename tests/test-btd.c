@@ -5,8 +5,17 @@
  */
 
 #include <glib.h>
+#include <linux/btrfs_tree.h>
 
 #include "btd-utils.h"
+#include "btd-filesystem.h"
+#include "btd-kmsg.h"
+#include "btd-cgroup.h"
+#include "btd-pressure.h"
+#include "btd-window.h"
+#include "btd-idle.h"
+#include "btd-tree-search.h"
+#include "btd-scrub.h"
 
 /**
  * test_duration_parser:
@@ -23,10 +32,112 @@ test_duration_parser (void)
     g_assert_cmpint (btd_parse_duration_string ("4w"), ==, 604800 * 4);
     g_assert_cmpint (btd_parse_duration_string ("1M"), ==, 2630016);
     g_assert_cmpint (btd_parse_duration_string ("3M"), ==, 2630016 * 3);
+    g_assert_cmpint (btd_parse_duration_string ("30min"), ==, 1800);
     g_assert_cmpint (btd_parse_duration_string ("notvalid"), ==, 0);
     g_assert_cmpint (btd_parse_duration_string ("2u"), ==, 0);
 }
 
+/**
+ * test_size_parser:
+ */
+static void
+test_size_parser (void)
+{
+    g_assert_cmpuint (btd_parse_size_string ("4096"), ==, 4096);
+    g_assert_cmpuint (btd_parse_size_string ("512K"), ==, 512 * 1024);
+    g_assert_cmpuint (btd_parse_size_string ("100M"), ==, 100 * 1024 * 1024);
+    g_assert_cmpuint (btd_parse_size_string ("100MiB"), ==, 100 * 1024 * 1024);
+    g_assert_cmpuint (btd_parse_size_string ("2g"), ==, G_GUINT64_CONSTANT (2) << 30);
+    g_assert_cmpuint (btd_parse_size_string ("1TB"), ==, G_GUINT64_CONSTANT (1) << 40);
+    g_assert_cmpuint (btd_parse_size_string ("off"), ==, 0);
+    g_assert_cmpuint (btd_parse_size_string ("M"), ==, 0);
+    g_assert_cmpuint (btd_parse_size_string ("10X"), ==, 0);
+    g_assert_cmpuint (btd_parse_size_string ("10Mx"), ==, 0);
+}
+
+/**
+ * test_stable_offset:
+ */
+static void
+test_stable_offset (void)
+{
+    const gchar *key = "0123456789abcdef0123456789abcdef:3c1f7d1e-scrub";
+
+    g_assert_cmpuint (btd_get_stable_offset (key, 86400), ==, 13561);
+    g_assert_cmpuint (btd_get_stable_offset (key, 3600), ==, 2761);
+    g_assert_cmpuint (btd_get_stable_offset (key, 0), ==, 0);
+    g_assert_cmpuint (btd_get_stable_offset ("other-host:3c1f7d1e-scrub", 86400), !=, 13561);
+}
+
+/**
+ * test_phased_due_time:
+ */
+static void
+test_phased_due_time (void)
+{
+    const gint64 week = 7 * 24 * 60 * 60;
+    const gint64 phase = 1700000000 - (1700000000 % week) + 13561;
+    gint64 due_time;
+
+    /* without a spread window, runs are simply an interval apart */
+    g_assert_cmpint (btd_get_phased_due_time (phase + 3600, week, 0, 0), ==, phase + 3600 + week);
+
+    /* a run that completed after its phase point is due exactly one interval later */
+    due_time = btd_get_phased_due_time (phase + 3600, week, week, 13561);
+    g_assert_cmpint (due_time, ==, phase + week);
+
+    /* ...and so is the one after it, the schedule doesn't drift */
+    due_time = btd_get_phased_due_time (due_time + 2 * 3600, week, week, 13561);
+    g_assert_cmpint (due_time, ==, phase + 2 * week);
+
+    /* longer intervals keep their length as well */
+    due_time = btd_get_phased_due_time (phase + 60, 2 * week, week, 13561);
+    g_assert_cmpint (due_time, ==, phase + 2 * week);
+
+    /* a run long before its phase point is attributed to it, so it is never due right away */
+    due_time = btd_get_phased_due_time (phase - 60, week, week, 13561);
+    g_assert_cmpint (due_time, ==, phase + week);
+
+    /* a run that happened much later than planned moves to the following phase point */
+    due_time = btd_get_phased_due_time (phase + 4 * 24 * 60 * 60, week, week, 13561);
+    g_assert_cmpint (due_time, ==, phase + 2 * week);
+}
+
+/**
+ * test_adaptive_interval:
+ */
+static void
+test_adaptive_interval (void)
+{
+    const gulong week = SECONDS_IN_A_WEEK;
+
+    /* nothing adapts if the interval may not be stretched */
+    g_assert_cmpuint (btd_get_adaptive_interval (week, 0, 9, FALSE), ==, week);
+    g_assert_cmpuint (btd_get_adaptive_interval (week, week, 0, TRUE), ==, week);
+
+    /* a new filesystem keeps the configured interval until enough clean passes were made */
+    g_assert_cmpuint (btd_get_adaptive_interval (week, 8 * week, 0, FALSE), ==, week);
+    g_assert_cmpuint (btd_get_adaptive_interval (week, 8 * week, 2, FALSE), ==, week);
+
+    /* every few clean passes double the interval, up to the maximum */
+    g_assert_cmpuint (btd_get_adaptive_interval (week, 8 * week, 3, FALSE), ==, 2 * week);
+    g_assert_cmpuint (btd_get_adaptive_interval (week, 8 * week, 6, TRUE), ==, 4 * week);
+    g_assert_cmpuint (btd_get_adaptive_interval (week, 8 * week, 30, TRUE), ==, 8 * week);
+    g_assert_cmpuint (btd_get_adaptive_interval (week, 3 * week, 6, FALSE), ==, 3 * week);
+
+    /* after an issue, the interval is quartered until a pass comes out clean */
+    g_assert_cmpuint (btd_get_adaptive_interval (4 * week, 8 * week, 0, TRUE), ==, week);
+    g_assert_cmpuint (btd_get_adaptive_interval (4 * week, 8 * week, 1, TRUE), ==, 4 * week);
+
+    /* ...but it never drops below a day */
+    g_assert_cmpuint (btd_get_adaptive_interval (2 * SECONDS_IN_A_DAY, week, 0, TRUE),
+                      ==,
+                      SECONDS_IN_A_DAY);
+    g_assert_cmpuint (btd_get_adaptive_interval (SECONDS_IN_AN_HOUR, week, 0, TRUE),
+                      ==,
+                      SECONDS_IN_AN_HOUR);
+}
+
 /**
  * test_render_template:
  */
@@ -146,6 +257,547 @@ test_humanize_time (void)
     g_clear_pointer (&result, g_free);
 }
 
+/**
+ * test_usage_text:
+ */
+static void
+test_usage_text (void)
+{
+    g_autoptr(BtdFsUsage) usage = NULL;
+    g_autofree gchar *text = NULL;
+    BtdSpaceInfo *sinfo;
+    BtdDeviceInfo *dinfo;
+
+    usage = g_new0 (BtdFsUsage, 1);
+    usage->spaces = g_ptr_array_new_with_free_func (g_free);
+    usage->devices = g_ptr_array_new_with_free_func ((GDestroyNotify) btd_device_info_free);
+
+    sinfo = g_new0 (BtdSpaceInfo, 1);
+    sinfo->flags = BTRFS_BLOCK_GROUP_DATA;
+    sinfo->total_bytes = 1024 * 1024 * 1024;
+    sinfo->used_bytes = 512 * 1024 * 1024;
+    g_ptr_array_add (usage->spaces, sinfo);
+
+    sinfo = g_new0 (BtdSpaceInfo, 1);
+    sinfo->flags = BTRFS_BLOCK_GROUP_METADATA | BTRFS_BLOCK_GROUP_DUP;
+    sinfo->total_bytes = 256 * 1024 * 1024;
+    sinfo->used_bytes = 1024 * 1024;
+    g_ptr_array_add (usage->spaces, sinfo);
+
+    usage->global_reserve = 4 * 1024 * 1024;
+
+    dinfo = g_new0 (BtdDeviceInfo, 1);
+    dinfo->devid = 1;
+    dinfo->path = g_strdup ("/dev/sda1");
+    dinfo->total_bytes = G_GUINT64_CONSTANT (10) * 1024 * 1024 * 1024;
+    dinfo->bytes_used = G_GUINT64_CONSTANT (1536) * 1024 * 1024;
+    g_ptr_array_add (usage->devices, dinfo);
+
+    g_assert_cmpuint (btd_fs_usage_get_device_size (usage), ==, dinfo->total_bytes);
+    g_assert_cmpuint (btd_fs_usage_get_unallocated (usage),
+                      ==,
+                      dinfo->total_bytes - dinfo->bytes_used);
+    g_assert_cmpuint (btd_fs_usage_get_profiles (usage, BTRFS_BLOCK_GROUP_METADATA),
+                      ==,
+                      BTRFS_BLOCK_GROUP_DUP);
+    g_assert_cmpuint (btd_fs_usage_get_profiles (usage, BTRFS_BLOCK_GROUP_DATA), ==, 0);
+    g_assert_cmpuint (btd_fs_usage_get_scrub_concurrency (usage), ==, 0);
+
+    text = btd_fs_usage_to_text (usage);
+    g_assert_cmpstr (text,
+                     ==,
+                     "Data, single: total=1.0 GiB, used=512.0 MiB\n"
+                     "Metadata, DUP: total=256.0 MiB, used=1.0 MiB\n"
+                     "GlobalReserve, single: total=4.0 MiB, used=0 bytes\n"
+                     "Device size: 10.0 GiB, unallocated: 8.5 GiB\n"
+                     "  • /dev/sda1: 8.5 GiB unallocated");
+
+    /* parity RAID profiles are scrubbed one device at a time */
+    sinfo = g_ptr_array_index (usage->spaces, 0);
+    sinfo->flags |= BTRFS_BLOCK_GROUP_RAID6;
+    g_assert_cmpuint (btd_fs_usage_get_scrub_concurrency (usage), ==, 1);
+}
+
+/**
+ * test_kmsg_parse:
+ */
+static void
+test_kmsg_parse (void)
+{
+    g_autofree gchar *device = NULL;
+
+    g_assert_true (btd_kmsg_parse_btrfs_issue (
+        "3,1234,5678901,-;BTRFS error (device sda1): bdev /dev/sda1 errs: wr 0, rd 1, flush 0, "
+        "corrupt 0, gen 0",
+        &device));
+    g_assert_cmpstr (device, ==, "sda1");
+    g_clear_pointer (&device, g_free);
+
+    /* newer kernels add the filesystem state */
+    g_assert_true (btd_kmsg_parse_btrfs_issue (
+        "4,1235,5678902,-;BTRFS warning (device dm-0 state EA): csum failed root 5 ino 257 "
+        "off 0 csum 0x8941f998 expected csum 0x00000000 mirror 1",
+        &device));
+    g_assert_cmpstr (device, ==, "dm-0");
+    g_clear_pointer (&device, g_free);
+
+    /* important messages with info priority */
+    g_assert_true (btd_kmsg_parse_btrfs_issue (
+        "6,1236,5678903,-;BTRFS info (device nvme0n1p2): forced readonly", &device));
+    g_assert_cmpstr (device, ==, "nvme0n1p2");
+    g_clear_pointer (&device, g_free);
+
+    /* harmless messages and other subsystems */
+    g_assert_false (btd_kmsg_parse_btrfs_issue (
+        "6,1237,5678904,-;BTRFS info (device sda1): disk space caching is enabled", &device));
+    g_assert_false (btd_kmsg_parse_btrfs_issue (
+        "3,1238,5678905,-;EXT4-fs error (device sdb1): ext4_find_entry", &device));
+    g_assert_false (btd_kmsg_parse_btrfs_issue ("no record", &device));
+    g_assert_null (device);
+}
+
+/**
+ * test_cgroup:
+ */
+static void
+test_cgroup (void)
+{
+    g_autoptr(GPtrArray) devices = g_ptr_array_new ();
+    g_autoptr(GPtrArray) args = NULL;
+    BtdCgroupLimits limits = { 0 };
+    guint64 read_bytes;
+    guint64 write_bytes;
+
+    g_assert_true (btd_cgroup_parse_io_stat (
+        "8:0 rbytes=1048576 wbytes=4096 rios=256 wios=1 dbytes=0 dios=0\n"
+        "259:0 rbytes=2048 wbytes=0 rios=1 wios=0 dbytes=0 dios=0\n",
+        &read_bytes,
+        &write_bytes));
+    g_assert_cmpuint (read_bytes, ==, 1048576 + 2048);
+    g_assert_cmpuint (write_bytes, ==, 4096);
+    g_assert_true (btd_cgroup_parse_io_stat ("", &read_bytes, &write_bytes));
+    g_assert_cmpuint (read_bytes, ==, 0);
+
+    limits.io_weight = 20;
+    limits.io_read_max = 100 * 1024 * 1024;
+    g_ptr_array_add (devices, "/dev/sda1");
+    args = btd_cgroup_limits_to_unit_args (&limits, devices);
+    g_assert_cmpint (args->len, ==, 3);
+    g_assert_cmpstr (g_ptr_array_index (args, 0), ==, "--property=IOAccounting=yes");
+    g_assert_cmpstr (g_ptr_array_index (args, 1), ==, "--property=IOWeight=20");
+    g_assert_cmpstr (g_ptr_array_index (args, 2),
+                     ==,
+                     "--property=IOReadBandwidthMax=/dev/sda1 104857600");
+}
+
+/**
+ * test_pressure_parse:
+ */
+static void
+test_pressure_parse (void)
+{
+    gdouble some_avg10;
+    gdouble full_avg10;
+
+    g_assert_true (btd_pressure_parse (
+        "some avg10=1.50 avg60=0.80 avg300=0.20 total=123456\n"
+        "full avg10=0.25 avg60=0.10 avg300=0.02 total=23456\n",
+        &some_avg10,
+        &full_avg10));
+    g_assert_cmpfloat_with_epsilon (some_avg10, 1.5, 0.001);
+    g_assert_cmpfloat_with_epsilon (full_avg10, 0.25, 0.001);
+
+    g_assert_false (btd_pressure_parse ("", &some_avg10, &full_avg10));
+    g_assert_cmpfloat (some_avg10, ==, 0);
+}
+
+/**
+ * test_window:
+ */
+static void
+test_window (void)
+{
+    g_autoptr(BtdWindow) window = NULL;
+    g_autoptr(GDateTime) sat_early = g_date_time_new_utc (2024, 1, 6, 2, 0, 0);
+    g_autoptr(GDateTime) fri_late = g_date_time_new_utc (2024, 1, 5, 23, 0, 0);
+    g_autoptr(GDateTime) sun_late = g_date_time_new_utc (2024, 1, 7, 23, 0, 0);
+    g_autoptr(GDateTime) mon_early = g_date_time_new_utc (2024, 1, 1, 1, 0, 0);
+    g_autoptr(GError) error = NULL;
+
+    window = btd_window_parse ("Sat,Sun 01:00..06:00", &error);
+    g_assert_no_error (error);
+    g_assert_true (btd_window_is_open (window, sat_early));
+    g_assert_false (btd_window_is_open (window, fri_late));
+    g_assert_cmpint (btd_window_get_time_to_close (window, sat_early), ==, 4 * 60 * 60);
+    g_assert_cmpint (btd_window_get_time_to_open (window, sat_early), ==, 0);
+    g_assert_cmpint (btd_window_get_time_to_open (window, fri_late), ==, 2 * 60 * 60);
+    g_assert_cmpint (btd_window_get_time_to_close (window, fri_late), ==, 0);
+    g_clear_pointer (&window, btd_window_free);
+
+    /* windows lasting over midnight, also at the end of the week */
+    window = btd_window_parse ("Mon..Fri 22:00..05:00", &error);
+    g_assert_no_error (error);
+    g_assert_true (btd_window_is_open (window, sat_early));
+    g_assert_cmpint (btd_window_get_time_to_close (window, sat_early), ==, 3 * 60 * 60);
+    g_assert_cmpint (btd_window_get_time_to_open (window, sun_late), ==, 23 * 60 * 60);
+    g_clear_pointer (&window, btd_window_free);
+    window = btd_window_parse ("sunday 22:00..02:00; Wed", &error);
+    g_assert_no_error (error);
+    g_assert_true (btd_window_is_open (window, mon_early));
+    g_assert_cmpint (btd_window_get_time_to_close (window, sun_late), ==, 3 * 60 * 60);
+    g_clear_pointer (&window, btd_window_free);
+
+    window = btd_window_parse ("00:00..24:00", &error);
+    g_assert_no_error (error);
+    g_assert_cmpint (btd_window_get_time_to_close (window, fri_late), ==, -1);
+    g_clear_pointer (&window, btd_window_free);
+
+    window = btd_window_parse ("Sat 25:00..26:00", &error);
+    g_assert_error (error, BTD_BTRFS_ERROR, BTD_BTRFS_ERROR_PARSE);
+    g_assert_null (window);
+    g_clear_error (&error);
+    window = btd_window_parse ("Funday", &error);
+    g_assert_error (error, BTD_BTRFS_ERROR, BTD_BTRFS_ERROR_PARSE);
+    g_clear_error (&error);
+    window = btd_window_parse ("", &error);
+    g_assert_error (error, BTD_BTRFS_ERROR, BTD_BTRFS_ERROR_PARSE);
+    g_clear_error (&error);
+}
+
+/**
+ * test_idle_parse:
+ */
+static void
+test_idle_parse (void)
+{
+    gdouble load1;
+    gdouble load5;
+    gdouble load15;
+    guint64 io_ticks;
+    guint64 io_count;
+
+    g_assert_true (
+        btd_idle_parse_loadavg ("0.52 1.58 2.59 1/467 12345\n", &load1, &load5, &load15));
+    g_assert_cmpfloat_with_epsilon (load1, 0.52, 0.001);
+    g_assert_cmpfloat_with_epsilon (load5, 1.58, 0.001);
+    g_assert_cmpfloat_with_epsilon (load15, 2.59, 0.001);
+    g_assert_false (btd_idle_parse_loadavg ("", &load1, &load5, &load15));
+
+    g_assert_true (btd_idle_parse_block_stat (
+        "   18214     4622  1566458    10418    13633    18390   989994    28498        0    "
+        "19024    41016        0        0        0        0     1474     2099\n",
+        &io_ticks,
+        &io_count));
+    g_assert_cmpuint (io_ticks, ==, 19024);
+    g_assert_cmpuint (io_count, ==, 18214 + 13633);
+    g_assert_false (btd_idle_parse_block_stat ("1 2 3", &io_ticks, NULL));
+}
+
+/**
+ * test_device_stats_report:
+ */
+static void
+test_device_stats_report (void)
+{
+    g_autoptr(GPtrArray) dev_stats = NULL;
+    g_autofree gchar *report = NULL;
+    BtdDeviceErrorStats *dstats;
+    guint64 errors_count;
+
+    dev_stats = g_ptr_array_new_with_free_func ((GDestroyNotify) btd_device_error_stats_free);
+    dstats = g_new0 (BtdDeviceErrorStats, 1);
+    dstats->devid = 2;
+    dstats->device = g_strdup ("/dev/sdb");
+    g_ptr_array_add (dev_stats, dstats);
+
+    report = btd_render_device_stats_report (dev_stats, &errors_count);
+    g_assert_cmpuint (errors_count, ==, 0);
+    g_assert_cmpstr (report,
+                     ==,
+                     "Registered Devices:\n"
+                     "  • /dev/sdb\n"
+                     "\n"
+                     "Issue Report:\n"
+                     "  • No errors found");
+    g_clear_pointer (&report, g_free);
+
+    dstats = g_new0 (BtdDeviceErrorStats, 1);
+    dstats->devid = 1;
+    dstats->device = g_strdup ("/dev/sda");
+    btd_parse_sysfs_error_stats ("write_errs 0\n"
+                                 "read_errs 3\n"
+                                 "flush_errs 0\n"
+                                 "corruption_errs 1\n"
+                                 "generation_errs 0\n",
+                                 dstats->values);
+    g_assert_cmpuint (dstats->values[BTRFS_DEV_STAT_WRITE_ERRS], ==, 0);
+    g_assert_cmpuint (dstats->values[BTRFS_DEV_STAT_READ_ERRS], ==, 3);
+    g_assert_cmpuint (dstats->values[BTRFS_DEV_STAT_FLUSH_ERRS], ==, 0);
+    g_assert_cmpuint (dstats->values[BTRFS_DEV_STAT_CORRUPTION_ERRS], ==, 1);
+    g_assert_cmpuint (dstats->values[BTRFS_DEV_STAT_GENERATION_ERRS], ==, 0);
+    g_ptr_array_insert (dev_stats, 0, dstats);
+
+    report = btd_render_device_stats_report (dev_stats, &errors_count);
+    g_assert_cmpuint (errors_count, ==, 4);
+    g_assert_cmpstr (report,
+                     ==,
+                     "Registered Devices:\n"
+                     "  • /dev/sda\n"
+                     "  • /dev/sdb\n"
+                     "\n"
+                     "Issue Report:\n"
+                     "Device: /dev/sda\n"
+                     "Devid:  1\n"
+                     "Write IO Errors: 0\n"
+                     "Read IO Errors:  3\n"
+                     "Flush IO Errors: 0\n"
+                     "Corruption Errors: 1\n"
+                     "Generation Errors: 0");
+}
+
+/**
+ * test_search_buf_add_item:
+ *
+ * Append an item to a canned TREE_SEARCH_V2 result buffer.
+ */
+static void
+test_search_buf_add_item (GByteArray *buf,
+                          guint64 objectid,
+                          guint32 type,
+                          guint64 offset,
+                          gconstpointer item,
+                          guint32 len)
+{
+    struct btrfs_ioctl_search_header sh = { 0 };
+
+    sh.objectid = objectid;
+    sh.type = type;
+    sh.offset = offset;
+    sh.len = len;
+    g_byte_array_append (buf, (const guint8 *) &sh, sizeof (sh));
+    g_byte_array_append (buf, item, len);
+}
+
+/**
+ * test_search_collect_offset_cb:
+ */
+static void
+test_search_collect_offset_cb (const struct btrfs_ioctl_search_header *sh,
+                               const guint8 *item,
+                               gpointer user_data)
+{
+    GArray *offsets = user_data;
+    guint64 offset = sh->offset;
+    g_array_append_val (offsets, offset);
+}
+
+/**
+ * test_tree_search_parse:
+ */
+static void
+test_tree_search_parse (void)
+{
+    g_autoptr(GByteArray) buf = g_byte_array_new ();
+    g_autoptr(GArray) offsets = g_array_new (FALSE, FALSE, sizeof (guint64));
+    struct btrfs_ioctl_search_key key = { 0 };
+    guint8 item[16] = { 0 };
+
+    /* items of other types are skipped, and the key continues after the last item */
+    key.max_objectid = 300;
+    test_search_buf_add_item (buf, 256, BTRFS_CHUNK_ITEM_KEY, 4096, item, sizeof (item));
+    test_search_buf_add_item (buf, 256, BTRFS_DEV_ITEM_KEY, 1, item, 8);
+    test_search_buf_add_item (buf, 256, BTRFS_CHUNK_ITEM_KEY, 8192, item, sizeof (item));
+    g_assert_true (btd_tree_search_parse_items (buf->data,
+                                                3,
+                                                BTRFS_CHUNK_ITEM_KEY,
+                                                test_search_collect_offset_cb,
+                                                offsets,
+                                                &key));
+    g_assert_cmpint (offsets->len, ==, 2);
+    g_assert_cmpuint (g_array_index (offsets, guint64, 0), ==, 4096);
+    g_assert_cmpuint (g_array_index (offsets, guint64, 1), ==, 8192);
+    g_assert_cmpuint (key.min_objectid, ==, 256);
+    g_assert_cmpuint (key.min_type, ==, BTRFS_CHUNK_ITEM_KEY);
+    g_assert_cmpuint (key.min_offset, ==, 8193);
+
+    /* the offset wraps over into the next type, then into the next object */
+    g_byte_array_set_size (buf, 0);
+    test_search_buf_add_item (buf, 256, BTRFS_DEV_ITEM_KEY, G_MAXUINT64, item, 0);
+    g_assert_true (btd_tree_search_parse_items (buf->data,
+                                                1,
+                                                BTRFS_CHUNK_ITEM_KEY,
+                                                test_search_collect_offset_cb,
+                                                offsets,
+                                                &key));
+    g_assert_cmpuint (key.min_objectid, ==, 256);
+    g_assert_cmpuint (key.min_type, ==, BTRFS_DEV_ITEM_KEY + 1);
+    g_assert_cmpuint (key.min_offset, ==, 0);
+
+    g_byte_array_set_size (buf, 0);
+    test_search_buf_add_item (buf, 256, G_MAXUINT8, G_MAXUINT64, item, 0);
+    g_assert_true (btd_tree_search_parse_items (buf->data,
+                                                1,
+                                                BTRFS_CHUNK_ITEM_KEY,
+                                                test_search_collect_offset_cb,
+                                                offsets,
+                                                &key));
+    g_assert_cmpuint (key.min_objectid, ==, 257);
+    g_assert_cmpuint (key.min_type, ==, 0);
+    g_assert_cmpuint (key.min_offset, ==, 0);
+
+    /* the search ends at the end of the key range, or if no items were returned */
+    g_byte_array_set_size (buf, 0);
+    test_search_buf_add_item (buf, 300, G_MAXUINT8, G_MAXUINT64, item, 0);
+    g_assert_false (btd_tree_search_parse_items (buf->data,
+                                                 1,
+                                                 BTRFS_CHUNK_ITEM_KEY,
+                                                 test_search_collect_offset_cb,
+                                                 offsets,
+                                                 &key));
+    g_assert_false (btd_tree_search_parse_items (buf->data,
+                                                 0,
+                                                 BTRFS_CHUNK_ITEM_KEY,
+                                                 test_search_collect_offset_cb,
+                                                 offsets,
+                                                 &key));
+    g_assert_cmpint (offsets->len, ==, 2);
+}
+
+/**
+ * test_tree_search_chunks:
+ */
+static void
+test_tree_search_chunks (void)
+{
+    g_autoptr(GArray) chunk_list = g_array_new (FALSE, FALSE, sizeof (BtdChunk));
+    g_autoptr(GHashTable) chunks = g_hash_table_new_full (g_int64_hash,
+                                                          g_int64_equal,
+                                                          g_free,
+                                                          NULL);
+    g_autoptr(GByteArray) buf = g_byte_array_new ();
+    struct btrfs_ioctl_search_key key = { 0 };
+    BtdNewDataSearch search = { 0 };
+    const BtdChunk chunk_data[] = {
+        { 0, 100, BTRFS_BLOCK_GROUP_DATA },
+        { 100, 50, BTRFS_BLOCK_GROUP_METADATA },
+        { 1000, 500, BTRFS_BLOCK_GROUP_DATA },
+    };
+    const struct {
+        guint64 logical;
+        guint32 type;
+        guint64 generation;
+        guint64 flags;
+    } extent_data[] = {
+        { 10, BTRFS_EXTENT_ITEM_KEY, 15, BTRFS_EXTENT_FLAG_DATA },
+        { 20, BTRFS_EXTENT_ITEM_KEY, 10, BTRFS_EXTENT_FLAG_DATA },
+        { 30, BTRFS_EXTENT_ITEM_KEY, 20, BTRFS_EXTENT_FLAG_DATA },
+        { 120, BTRFS_METADATA_ITEM_KEY, 17, BTRFS_EXTENT_FLAG_DATA },
+        { 130, BTRFS_EXTENT_ITEM_KEY, 18, BTRFS_EXTENT_FLAG_TREE_BLOCK },
+        { 1200, BTRFS_EXTENT_ITEM_KEY, 19, BTRFS_EXTENT_FLAG_DATA },
+        { 5000, BTRFS_EXTENT_ITEM_KEY, 12, BTRFS_EXTENT_FLAG_DATA },
+    };
+    guint64 offset;
+
+    /* an empty chunk list contains nothing */
+    g_assert_null (btd_tree_search_find_chunk (chunk_list, 0));
+
+    g_array_append_vals (chunk_list, chunk_data, G_N_ELEMENTS (chunk_data));
+    g_assert_cmpuint (btd_tree_search_find_chunk (chunk_list, 0)->start, ==, 0);
+    g_assert_cmpuint (btd_tree_search_find_chunk (chunk_list, 99)->start, ==, 0);
+    g_assert_cmpuint (btd_tree_search_find_chunk (chunk_list, 100)->start, ==, 100);
+    g_assert_cmpuint (btd_tree_search_find_chunk (chunk_list, 149)->start, ==, 100);
+    g_assert_null (btd_tree_search_find_chunk (chunk_list, 150));
+    g_assert_null (btd_tree_search_find_chunk (chunk_list, 999));
+    g_assert_cmpuint (btd_tree_search_find_chunk (chunk_list, 1499)->start, ==, 1000);
+    g_assert_null (btd_tree_search_find_chunk (chunk_list, 1500));
+
+    /* only data extents written within the generation range are considered */
+    for (guint i = 0; i < G_N_ELEMENTS (extent_data); i++) {
+        struct btrfs_extent_item extent_item = { 0 };
+
+        extent_item.refs = GUINT64_TO_LE (1);
+        extent_item.generation = GUINT64_TO_LE (extent_data[i].generation);
+        extent_item.flags = GUINT64_TO_LE (extent_data[i].flags);
+        test_search_buf_add_item (buf,
+                                  extent_data[i].logical,
+                                  extent_data[i].type,
+                                  4096,
+                                  &extent_item,
+                                  sizeof (extent_item));
+    }
+    /* truncated items are ignored */
+    test_search_buf_add_item (buf, 1300, BTRFS_EXTENT_ITEM_KEY, 4096, chunk_data, 8);
+
+    search.chunk_list = chunk_list;
+    search.chunks = chunks;
+    search.min_generation = 10;
+    search.max_generation = 20;
+    search.newest_generation = 10;
+    key.max_objectid = G_MAXUINT64;
+    g_assert_true (btd_tree_search_parse_items (buf->data,
+                                                G_N_ELEMENTS (extent_data) + 1,
+                                                BTRFS_EXTENT_ITEM_KEY,
+                                                btd_tree_search_new_data_item_cb,
+                                                &search,
+                                                &key));
+    g_assert_cmpuint (search.newest_generation, ==, 19);
+    g_assert_cmpint (g_hash_table_size (chunks), ==, 2);
+    offset = 0;
+    g_assert_true (g_hash_table_contains (chunks, &offset));
+    offset = 1000;
+    g_assert_true (g_hash_table_contains (chunks, &offset));
+    g_assert_cmpuint (key.min_objectid, ==, 1300);
+}
+
+/**
+ * test_scrub_merge_extents:
+ */
+static void
+test_scrub_merge_extents (void)
+{
+    g_autoptr(GPtrArray) dev_extents = g_ptr_array_new ();
+    g_autoptr(GPtrArray) ranges = NULL;
+    g_autoptr(BtdScrubDevice) total = btd_scrub_device_new (1, "/dev/sda");
+    g_autoptr(BtdScrubDevice) total2 = btd_scrub_device_new (2, "/dev/sdb");
+    BtdDevExtent extents[] = {
+        { 1, 0, 10, 0, BTRFS_BLOCK_GROUP_DATA },
+        { 1, 10, 10, 100, BTRFS_BLOCK_GROUP_DATA },
+        { 1, 30, 10, 200, BTRFS_BLOCK_GROUP_METADATA },
+        { 1, 40, 5, 300, BTRFS_BLOCK_GROUP_DATA },
+        { 2, 0, 5, 300, BTRFS_BLOCK_GROUP_DATA },
+    };
+    BtdScrubDevice *range;
+
+    for (guint i = 0; i < G_N_ELEMENTS (extents); i++)
+        g_ptr_array_add (dev_extents, &extents[i]);
+
+    /* adjacent extents are scrubbed as one range */
+    total->device_size = 1000;
+    ranges = btd_scrub_device_merge_extents (total, dev_extents, 4096);
+    g_assert_cmpint (ranges->len, ==, 2);
+    range = g_ptr_array_index (ranges, 0);
+    g_assert_cmpuint (range->devid, ==, 1);
+    g_assert_cmpstr (range->path, ==, "/dev/sda");
+    g_assert_cmpuint (range->start, ==, 0);
+    g_assert_cmpuint (range->end, ==, 20);
+    g_assert_cmpuint (range->size, ==, 20);
+    g_assert_cmpuint (range->device_size, ==, 1000);
+    g_assert_cmpuint (range->speed_max, ==, 4096);
+    range = g_ptr_array_index (ranges, 1);
+    g_assert_cmpuint (range->start, ==, 30);
+    g_assert_cmpuint (range->end, ==, 45);
+    g_assert_cmpuint (range->size, ==, 15);
+    g_assert_cmpuint (total->size, ==, 35);
+    g_clear_pointer (&ranges, g_ptr_array_unref);
+
+    ranges = btd_scrub_device_merge_extents (total2, dev_extents, 0);
+    g_assert_cmpint (ranges->len, ==, 1);
+    range = g_ptr_array_index (ranges, 0);
+    g_assert_cmpuint (range->devid, ==, 2);
+    g_assert_cmpuint (range->end, ==, 5);
+    g_assert_cmpuint (total2->size, ==, 5);
+}
+
 int
 main (int argc, char **argv)
 {
@@ -163,9 +815,23 @@ main (int argc, char **argv)
     g_log_set_fatal_mask (NULL, G_LOG_LEVEL_ERROR | G_LOG_LEVEL_CRITICAL);
 
     g_test_add_func ("/Btrfsd/Misc/DurationParser", test_duration_parser);
+    g_test_add_func ("/Btrfsd/Misc/SizeParser", test_size_parser);
+    g_test_add_func ("/Btrfsd/Misc/StableOffset", test_stable_offset);
+    g_test_add_func ("/Btrfsd/Misc/PhasedDueTime", test_phased_due_time);
+    g_test_add_func ("/Btrfsd/Misc/AdaptiveInterval", test_adaptive_interval);
     g_test_add_func ("/Btrfsd/Misc/RenderTemplate", test_render_template);
     g_test_add_func ("/Btrfsd/Misc/PathEscape", test_path_escape);
     g_test_add_func ("/Btrfsd/Misc/HumanizeTime", test_humanize_time);
+    g_test_add_func ("/Btrfsd/Misc/UsageText", test_usage_text);
+    g_test_add_func ("/Btrfsd/Misc/KmsgParse", test_kmsg_parse);
+    g_test_add_func ("/Btrfsd/Misc/Cgroup", test_cgroup);
+    g_test_add_func ("/Btrfsd/Misc/PressureParse", test_pressure_parse);
+    g_test_add_func ("/Btrfsd/Misc/Window", test_window);
+    g_test_add_func ("/Btrfsd/Misc/IdleParse", test_idle_parse);
+    g_test_add_func ("/Btrfsd/Misc/DeviceStatsReport", test_device_stats_report);
+    g_test_add_func ("/Btrfsd/Misc/TreeSearchParse", test_tree_search_parse);
+    g_test_add_func ("/Btrfsd/Misc/TreeSearchChunks", test_tree_search_chunks);
+    g_test_add_func ("/Btrfsd/Misc/ScrubMergeExtents", test_scrub_merge_extents);
 
     ret = g_test_run ();
     return ret;